@@ -0,0 +1,406 @@
+#include "accesslog.h"
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "timefmt.h"
+
+/* Records formatted and written per writev(2) */
+#define ALOG_BATCH 64
+
+/*
+ * Seconds a claimed slot may stay unpublished before the writer gives up
+ * on it, when its producer can't be seen to have died
+ */
+#define ALOG_ABANDON 5
+
+/* Longest formatted log line */
+#define ALOG_LINE (INET6_ADDRSTRLEN + ISO_DATE_LEN + MAX_METHOD + MAX_URI + \
+                   MAX_VERSION + 64)
+
+struct alog_slot
+{
+	/*
+	 * Slot i of lap n is free for a producer while seq == i + n * size,
+	 * and holds a record for the writer once seq == i + n * size + 1.
+	 */
+	uint64_t seq;
+
+	/* Producer that claimed the slot, 0 while unknown */
+	pid_t owner;
+
+	int64_t when;
+	int status;
+	uint64_t content_len;
+	char client[INET6_ADDRSTRLEN];
+	char method[MAX_METHOD];
+	char path[MAX_URI];
+	char version[MAX_VERSION];
+};
+
+struct alog_ring
+{
+	/* Next position to claim; advanced by producers */
+	uint64_t tail __attribute__((aligned(64)));
+
+	/* Next position to write; advanced by the writer only */
+	uint64_t head __attribute__((aligned(64)));
+
+	pid_t writer;
+	unsigned char kicked; /* the writer has been woken early */
+	struct alog_stats stats;
+
+	struct alog_slot slots[ALOG_SLOTS];
+};
+
+static struct alog_ring *ring = NULL;
+
+/* The process that started the writer; only it may stop it */
+static pid_t server_pid = 0;
+
+static volatile sig_atomic_t writer_stop = 0;
+
+static void
+copy_field(char *dst, size_t dstsz, const char *src)
+{
+	size_t n = strnlen(src, dstsz - 1);
+
+	memcpy(dst, src, n);
+	dst[n] = '\0';
+}
+
+void
+alog_record(const char *client_ip, const struct http_request *req,
+            const struct http_response *resp)
+{
+	struct alog_slot *s;
+	uint64_t pos;
+
+	if (ring == NULL)
+	{
+		return;
+	}
+
+	/* Claim a slot: Vyukov's bounded queue, drained by the writer alone */
+	pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		int64_t diff;
+
+		s = &ring->slots[pos & (ALOG_SLOTS - 1)];
+		diff = (int64_t)(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0)
+		{
+			if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1,
+			                                __ATOMIC_RELAXED,
+			                                __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		else if (diff < 0)
+		{
+			/* Full: the writer is a whole lap behind */
+			__atomic_add_fetch(&ring->stats.dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		else
+		{
+			pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	__atomic_store_n(&s->owner, getpid(), __ATOMIC_RELAXED);
+
+	s->when = (int64_t)timefmt_now();
+	s->status = resp->status_code;
+	s->content_len = resp->content_len;
+	copy_field(s->client, sizeof(s->client), client_ip);
+	copy_field(s->method, sizeof(s->method), req->method);
+	copy_field(s->path, sizeof(s->path), req->path);
+	copy_field(s->version, sizeof(s->version), req->version);
+
+	/* Fails only if the writer gave up waiting for us (see skip_stuck) */
+	if (!__atomic_compare_exchange_n(&s->seq, &pos, pos + 1, 0,
+	                                 __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	{
+		__atomic_add_fetch(&ring->stats.dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	__atomic_add_fetch(&ring->stats.submitted, 1, __ATOMIC_RELAXED);
+
+	/* Half full: don't wait for the next flush */
+	if (pos + 1 - __atomic_load_n(&ring->head, __ATOMIC_RELAXED) >
+	        ALOG_SLOTS / 2 &&
+	    !__atomic_test_and_set(&ring->kicked, __ATOMIC_RELAXED))
+	{
+		__atomic_add_fetch(&ring->stats.overflows, 1, __ATOMIC_RELAXED);
+		(void)kill(ring->writer, SIGUSR1);
+	}
+}
+
+/* Writes all of iov, resuming after short writes */
+static int
+write_batch(int fd, struct iovec *iov, int cnt)
+{
+	while (cnt > 0)
+	{
+		ssize_t n = writev(fd, iov, cnt);
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		while (cnt > 0 && (size_t)n >= iov->iov_len)
+		{
+			n -= (ssize_t)iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0)
+		{
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= (size_t)n;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Called when the slot at the head is not published. If it was claimed
+ * by a producer that died before publishing it (or that has kept it for
+ * ALOG_ABANDON seconds), hands the slot back for the next lap and counts
+ * its record as dropped, so that the records behind it can be written.
+ * Returns non-zero if the slot was skipped.
+ */
+static int
+skip_stuck(struct alog_slot *s)
+{
+	static uint64_t stuck_pos = UINT64_MAX;
+	static time_t stuck_since;
+	uint64_t pos = ring->head;
+	time_t now = time(NULL);
+	pid_t owner;
+
+	if (__atomic_load_n(&ring->tail, __ATOMIC_RELAXED) == pos)
+	{
+		/* Not claimed at all */
+		return 0;
+	}
+	if (stuck_pos != pos)
+	{
+		stuck_pos = pos;
+		stuck_since = now;
+	}
+
+	owner = __atomic_load_n(&s->owner, __ATOMIC_RELAXED);
+	if (!(owner > 0 && kill(owner, 0) < 0 && errno == ESRCH) &&
+	    now - stuck_since < ALOG_ABANDON)
+	{
+		return 0;
+	}
+
+	/* Unless the producer published it just now */
+	if (!__atomic_compare_exchange_n(&s->seq, &pos, pos + ALOG_SLOTS, 0,
+	                                 __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+	{
+		return 0;
+	}
+	__atomic_store_n(&s->owner, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ring->head, pos + 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ring->stats.dropped, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/*
+ * Formats and writes every published record, in batches.
+ */
+static void
+drain(int fd)
+{
+	static char lines[ALOG_BATCH][ALOG_LINE];
+	static unsigned long long reported_drops = 0;
+	struct iovec iov[ALOG_BATCH];
+	unsigned long long drops;
+	int cnt;
+
+	do
+	{
+		cnt = 0;
+
+		drops = __atomic_load_n(&ring->stats.dropped, __ATOMIC_RELAXED);
+		if (drops != reported_drops)
+		{
+			int k = snprintf(lines[0], sizeof(lines[0]),
+			                 "sws: %llu access log records dropped\n",
+			                 drops - reported_drops);
+			iov[cnt].iov_base = lines[0];
+			iov[cnt++].iov_len = (size_t)k;
+			reported_drops = drops;
+		}
+
+		while (cnt < ALOG_BATCH)
+		{
+			struct alog_slot *s = &ring->slots[ring->head & (ALOG_SLOTS - 1)];
+			char stamp[ISO_DATE_LEN + 1];
+			int k;
+
+			if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != ring->head + 1)
+			{
+				if (skip_stuck(s))
+				{
+					continue;
+				}
+				break;
+			}
+
+			(void)timefmt_iso((time_t)s->when, stamp);
+			k = snprintf(lines[cnt], sizeof(lines[cnt]),
+			             "%s %s \"%s %s %s\" %d %llu\n", s->client, stamp,
+			             s->method, s->path, s->version, s->status,
+			             (unsigned long long)s->content_len);
+			if (k < 0 || (size_t)k >= sizeof(lines[cnt]))
+			{
+				k = (int)sizeof(lines[cnt]) - 1;
+				lines[cnt][k - 1] = '\n';
+			}
+			iov[cnt].iov_base = lines[cnt];
+			iov[cnt++].iov_len = (size_t)k;
+
+			/* Hand the slot back for the next lap */
+			__atomic_store_n(&s->owner, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&s->seq, ring->head + ALOG_SLOTS,
+			                 __ATOMIC_RELEASE);
+			__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELAXED);
+		}
+
+		if (cnt > 0)
+		{
+			/* A failing log must not stall the ring; the lines are lost */
+			(void)write_batch(fd, iov, cnt);
+			__atomic_add_fetch(&ring->stats.written, (unsigned long long)cnt,
+			                   __ATOMIC_RELAXED);
+			__atomic_add_fetch(&ring->stats.batches, 1, __ATOMIC_RELAXED);
+		}
+	} while (cnt == ALOG_BATCH);
+
+	__atomic_clear(&ring->kicked, __ATOMIC_RELAXED);
+}
+
+static void
+writer_signal(int sig)
+{
+	if (sig == SIGTERM)
+	{
+		writer_stop = 1;
+	}
+}
+
+static void
+run_writer(int fd, int flush_ms, pid_t parent)
+{
+	struct sigaction sa;
+	struct timespec interval;
+
+	/* No SA_RESTART: either signal cuts the sleep short */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = writer_signal;
+	sigemptyset(&sa.sa_mask);
+	(void)sigaction(SIGTERM, &sa, NULL);
+	(void)sigaction(SIGUSR1, &sa, NULL);
+	(void)signal(SIGINT, SIG_IGN);
+	(void)signal(SIGCHLD, SIG_DFL);
+	(void)signal(SIGPIPE, SIG_IGN);
+#ifdef __linux__
+	/* Don't outlive the server */
+	(void)prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+
+	interval.tv_sec = flush_ms / 1000;
+	interval.tv_nsec = (long)(flush_ms % 1000) * 1000000L;
+
+	while (!writer_stop && getppid() == parent)
+	{
+		(void)nanosleep(&interval, NULL);
+		drain(fd);
+	}
+	drain(fd);
+	_exit(0);
+}
+
+int
+alog_init(int fd, int flush_ms)
+{
+	pid_t parent = getpid();
+	pid_t pid;
+	void *base;
+
+	base = mmap(NULL, sizeof(*ring), PROT_READ | PROT_WRITE,
+	            MAP_SHARED | MAP_ANON, -1, 0);
+	if (base == MAP_FAILED)
+	{
+		return -1;
+	}
+	ring = base;
+	for (uint64_t i = 0; i < ALOG_SLOTS; i++)
+	{
+		ring->slots[i].seq = i;
+	}
+
+	if ((pid = fork()) < 0)
+	{
+		(void)munmap(base, sizeof(*ring));
+		ring = NULL;
+		return -1;
+	}
+	if (pid == 0)
+	{
+		run_writer(fd, flush_ms > 0 ? flush_ms : ALOG_FLUSH_MS, parent);
+	}
+
+	ring->writer = pid;
+	server_pid = parent;
+	return 0;
+}
+
+void
+alog_get_stats(struct alog_stats *st)
+{
+	if (ring == NULL)
+	{
+		memset(st, 0, sizeof(*st));
+		return;
+	}
+	st->submitted = __atomic_load_n(&ring->stats.submitted, __ATOMIC_RELAXED);
+	st->written = __atomic_load_n(&ring->stats.written, __ATOMIC_RELAXED);
+	st->dropped = __atomic_load_n(&ring->stats.dropped, __ATOMIC_RELAXED);
+	st->overflows = __atomic_load_n(&ring->stats.overflows, __ATOMIC_RELAXED);
+	st->batches = __atomic_load_n(&ring->stats.batches, __ATOMIC_RELAXED);
+}
+
+void
+alog_shutdown(void)
+{
+	if (ring == NULL || getpid() != server_pid)
+	{
+		return;
+	}
+	(void)kill(ring->writer, SIGTERM);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "http.h"
+
+/*
+ * Asynchronous access log. Server processes put a fixed-size record per
+ * request into a lock-free ring in shared memory; a dedicated writer
+ * process formats the records and appends them to the log in batches
+ * with writev(2). Logging never blocks a request: when the ring is full
+ * the record is dropped and counted. So is a record whose process died
+ * after claiming a slot but before publishing it; the writer skips it.
+ */
+
+/* Records the ring holds; a power of two */
+#define ALOG_SLOTS 1024
+
+/* Default time between two batches, in milliseconds */
+#define ALOG_FLUSH_MS 100
+
+struct alog_stats
+{
+	unsigned long long submitted; /* records put into the ring */
+	unsigned long long written;   /* records written to the log */
+	unsigned long long dropped;   /* records lost to a full ring */
+	unsigned long long overflows; /* early flushes: ring half full */
+	unsigned long long batches;   /* writev batches */
+};
+
+/*
+ * Sets up the ring and starts the writer process, which appends to fd
+ * every flush_ms milliseconds (or sooner, when the ring fills up).
+ * Call before forking the processes that log.
+ * Returns 0 on success, -1 on error.
+ */
+int alog_init(int fd, int flush_ms);
+
+/*
+ * Queues a log record for the request. Does nothing if alog_init() was
+ * not called.
+ */
+void alog_record(const char *client_ip, const struct http_request *req,
+                 const struct http_response *resp);
+
+/*
+ * Copies the current counters into st (all zero without a log).
+ */
+void alog_get_stats(struct alog_stats *st);
+
+/*
+ * Asks the writer to write what is left and exit. Does nothing outside
+ * the process that called alog_init(). Async-signal-safe.
+ */
+void alog_shutdown(void);
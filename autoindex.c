@@ -0,0 +1,250 @@
+#include "autoindex.h"
+
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* A growing output buffer; appends are amortized O(1) */
+struct strbuf
+{
+	char *p;
+	size_t len;
+	size_t cap;
+	int failed;
+};
+
+struct dir_entry
+{
+	size_t off; /* of the name in the names buffer */
+	const char *name;
+	int is_dir;
+};
+
+static int
+sb_reserve(struct strbuf *sb, size_t n)
+{
+	size_t cap = sb->cap ? sb->cap : 4096;
+	char *p;
+
+	if (sb->failed)
+	{
+		return -1;
+	}
+	if (sb->len + n <= sb->cap)
+	{
+		return 0;
+	}
+	while (cap < sb->len + n)
+	{
+		cap *= 2;
+	}
+	if ((p = realloc(sb->p, cap)) == NULL)
+	{
+		sb->failed = 1;
+		return -1;
+	}
+	sb->p = p;
+	sb->cap = cap;
+	return 0;
+}
+
+static void
+sb_add(struct strbuf *sb, const char *s, size_t n)
+{
+	if (sb_reserve(sb, n) == 0)
+	{
+		memcpy(sb->p + sb->len, s, n);
+		sb->len += n;
+	}
+}
+
+static void
+sb_puts(struct strbuf *sb, const char *s)
+{
+	sb_add(sb, s, strlen(s));
+}
+
+/* Appends s as HTML text */
+static void
+sb_add_html(struct strbuf *sb, const char *s)
+{
+	while (*s != '\0')
+	{
+		size_t run = strcspn(s, "&<>\"'");
+
+		sb_add(sb, s, run);
+		s += run;
+		switch (*s)
+		{
+		case '&':
+			sb_puts(sb, "&amp;");
+			break;
+		case '<':
+			sb_puts(sb, "&lt;");
+			break;
+		case '>':
+			sb_puts(sb, "&gt;");
+			break;
+		case '"':
+			sb_puts(sb, "&quot;");
+			break;
+		case '\'':
+			sb_puts(sb, "&#39;");
+			break;
+		default:
+			return;
+		}
+		s++;
+	}
+}
+
+/* Appends the file name s as a relative URI path segment */
+static void
+sb_add_href(struct strbuf *sb, const char *s)
+{
+	static const char hex[] = "0123456789ABCDEF";
+
+	for (; *s != '\0'; s++)
+	{
+		unsigned char c = (unsigned char)*s;
+
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+		    (c >= '0' && c <= '9') || strchr("-._~", c) != NULL)
+		{
+			sb_add(sb, s, 1);
+		}
+		else
+		{
+			char esc[3] = {'%', hex[c >> 4], hex[c & 0xf]};
+			sb_add(sb, esc, sizeof(esc));
+		}
+	}
+}
+
+/* Symlinks are listed as what they point to */
+static int
+is_directory(int dfd, const struct dirent *de)
+{
+	struct stat st;
+
+#ifdef _DIRENT_HAVE_D_TYPE
+	if (de->d_type == DT_DIR)
+	{
+		return 1;
+	}
+	if (de->d_type != DT_LNK && de->d_type != DT_UNKNOWN)
+	{
+		return 0;
+	}
+#endif
+	return fstatat(dfd, de->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+}
+
+static int
+dir_entry_cmp(const void *a, const void *b)
+{
+	const struct dir_entry *ea = a;
+	const struct dir_entry *eb = b;
+	return strcmp(ea->name, eb->name);
+}
+
+int
+autoindex_render(int fd, const char *uri, char **body, size_t *len)
+{
+	struct strbuf names = {0}, html = {0};
+	struct dir_entry *entries = NULL;
+	size_t nent = 0, cap = 0;
+	struct dirent *de;
+	DIR *dir;
+
+	if ((dir = fdopendir(fd)) == NULL)
+	{
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	/* All names go into one buffer: no allocation per entry */
+	while ((de = readdir(dir)) != NULL)
+	{
+		/* ".", ".." and hidden files */
+		if (de->d_name[0] == '.')
+		{
+			continue;
+		}
+
+		if (nent == cap)
+		{
+			size_t newcap = cap ? cap * 2 : 64;
+			struct dir_entry *tmp =
+				realloc(entries, newcap * sizeof(*entries));
+			if (tmp == NULL)
+			{
+				names.failed = 1;
+				break;
+			}
+			entries = tmp;
+			cap = newcap;
+		}
+
+		entries[nent].off = names.len;
+		entries[nent].is_dir = is_directory(dirfd(dir), de);
+		sb_add(&names, de->d_name, strlen(de->d_name) + 1);
+		nent++;
+	}
+	closedir(dir);
+
+	if (names.failed)
+	{
+		free(entries);
+		free(names.p);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (size_t i = 0; i < nent; i++)
+	{
+		entries[i].name = names.p + entries[i].off;
+	}
+	qsort(entries, nent, sizeof(*entries), dir_entry_cmp);
+
+	sb_puts(&html, "<html><head><title>Index of ");
+	sb_add_html(&html, uri);
+	sb_puts(&html, "</title></head><body>\n<h1>Index of ");
+	sb_add_html(&html, uri);
+	sb_puts(&html, "</h1>\n<ul>\n");
+
+	for (size_t i = 0; i < nent; i++)
+	{
+		const char *slash = entries[i].is_dir ? "/" : "";
+
+		sb_puts(&html, "<li><a href=\"");
+		sb_add_href(&html, entries[i].name);
+		sb_puts(&html, slash);
+		sb_puts(&html, "\">");
+		sb_add_html(&html, entries[i].name);
+		sb_puts(&html, slash);
+		sb_puts(&html, "</a></li>\n");
+	}
+
+	sb_puts(&html, "</ul>\n</body></html>\n");
+
+	free(entries);
+	free(names.p);
+
+	if (html.failed)
+	{
+		free(html.p);
+		errno = ENOMEM;
+		return -1;
+	}
+	*body = html.p;
+	*len = html.len;
+	return 0;
+}
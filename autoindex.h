@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Renders the HTML index of the directory open as 'fd' (which is closed
+ * in any case), as reached through the request URI 'uri'. Hidden entries
+ * are left out; the others are listed by name, with a trailing slash on
+ * subdirectories. Names are percent-encoded in links and HTML-escaped in
+ * text.
+ * On success stores a malloc'd body in *body and its length in *len.
+ * Returns 0 on success, -1 on error (errno set).
+ */
+int autoindex_render(int fd, const char *uri, char **body, size_t *len);
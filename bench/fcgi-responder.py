@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+#
+# A FastCGI responder for trying out sws -f. Like most responders it
+# serves one connection at a time, and it keeps a connection open after
+# a request only if sws asked for that with FCGI_KEEP_CONN.
+#
+# Copy it into the CGI directory and start sws with, e.g.,
+#
+#   sws -c cgi -f fcgi-responder.py docroot
+#
+# then request /cgi-bin/fcgi-responder.py from two keep-alive clients at
+# once: the second must not wait for the first one's connection to go
+# idle and time out.
+#
+# Environment:
+#   FCGI_DELAY  seconds to wait before answering each request (default: 0)
+
+import os
+import socket
+import struct
+import time
+
+BEGIN_REQUEST, END_REQUEST, PARAMS, STDIN, STDOUT = 1, 3, 4, 5, 6
+KEEP_CONN = 1
+HEADER = struct.Struct(">BBHHBx")
+
+
+def read_exactly(conn, n):
+    data = b""
+    while len(data) < n:
+        chunk = conn.recv(n - len(data))
+        if not chunk:
+            return None
+        data += chunk
+    return data
+
+
+def read_record(conn):
+    head = read_exactly(conn, HEADER.size)
+    if head is None:
+        return None
+    _, rtype, rid, clen, plen = HEADER.unpack(head)
+    body = read_exactly(conn, clen + plen)
+    if body is None:
+        return None
+    return rtype, rid, body[:clen]
+
+
+def write_record(conn, rtype, rid, content):
+    conn.sendall(HEADER.pack(1, rtype, rid, len(content), 0) + content)
+
+
+def serve(conn):
+    delay = float(os.environ.get("FCGI_DELAY", "0"))
+    keep = False
+
+    while True:
+        rec = read_record(conn)
+        if rec is None:
+            return
+        rtype, rid, content = rec
+        if rtype == BEGIN_REQUEST:
+            keep = bool(content[2] & KEEP_CONN)
+        elif rtype == STDIN and not content:
+            time.sleep(delay)
+            body = "served by pid %d at %.3f\n" % (os.getpid(), time.time())
+            write_record(conn, STDOUT, rid,
+                         b"Content-Type: text/plain\r\n\r\n" + body.encode())
+            write_record(conn, STDOUT, rid, b"")
+            write_record(conn, END_REQUEST, rid, b"\0" * 8)
+            if not keep:
+                return
+
+
+def main():
+    # FCGI_LISTENSOCK_FILENO
+    listener = socket.socket(fileno=0)
+    while True:
+        conn, _ = listener.accept()
+        try:
+            serve(conn)
+        except OSError:
+            pass
+        finally:
+            conn.close()
+
+
+main()
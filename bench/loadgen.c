@@ -0,0 +1,854 @@
+/*
+ * HTTP load generator for "make bench".
+ *
+ * Keeps a number of connections busy with GET requests for one URL and
+ * prints a JSON summary: throughput, latency percentiles and, given the
+ * server's pid, the CPU time and peak RSS of the server's process tree.
+ *
+ * In closed-loop mode (the default) every connection sends its next
+ * request as soon as the previous response is complete. In open-loop mode
+ * (-r) requests are due at a fixed total rate whether or not the server
+ * keeps up, and latency is measured from when a request was due, so a
+ * stalling server shows up in the tail instead of slowing the client down.
+ */
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CONNS 1024
+#define MAX_HEAD 16384
+#define READ_CHUNK 65536
+
+/* How often the server's memory use is sampled */
+#define SAMPLE_NS 250000000LL
+
+enum conn_state
+{
+	CONN_IDLE,
+	CONN_CONNECTING,
+	CONN_SENDING,
+	CONN_READING
+};
+
+enum body_mode
+{
+	BODY_NONE,
+	BODY_LENGTH,
+	BODY_CHUNKED,
+	BODY_UNTIL_CLOSE
+};
+
+enum chunk_state
+{
+	CHUNK_SIZE,
+	CHUNK_DATA,
+	CHUNK_DATA_END,
+	CHUNK_TRAILER
+};
+
+struct conn
+{
+	int fd;
+	enum conn_state state;
+	size_t sent;
+	long long due; /* when the current request was due (ns) */
+
+	/* Response parsing */
+	char head[MAX_HEAD];
+	size_t head_len;
+	int in_body;
+	int status;
+	int close_after;
+	enum body_mode body;
+	long long left;
+	enum chunk_state chunk;
+	long long chunk_size;
+	int line_len; /* of the current chunk size or trailer line */
+};
+
+struct options
+{
+	const char *host;
+	const char *port;
+	const char *path;
+	const char *name;
+	const char *headers;
+	int conns;
+	double duration;
+	double rate;
+	int close_conns;
+	pid_t server;
+};
+
+struct results
+{
+	long long *lat;
+	size_t nlat;
+	size_t cap;
+	long long errors;
+	long long status[6]; /* by class: 1xx .. 5xx; [0] for anything else */
+	long long bytes;
+};
+
+static struct addrinfo *target;
+static char request[MAX_HEAD];
+static size_t request_len;
+static struct results res;
+static int close_conns = 0;
+
+static long long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	        "usage: loadgen [-C] [-c conns] [-d seconds] [-H header] "
+	        "[-n name]\n"
+	        "               [-P server-pid] [-r rate] host port path\n");
+	exit(2);
+}
+
+static void
+record(long long latency)
+{
+	if (res.nlat == res.cap)
+	{
+		size_t cap = res.cap ? res.cap * 2 : 65536;
+		long long *lat = realloc(res.lat, cap * sizeof(*lat));
+
+		if (lat == NULL)
+		{
+			perror("realloc");
+			exit(1);
+		}
+		res.lat = lat;
+		res.cap = cap;
+	}
+	res.lat[res.nlat++] = latency;
+}
+
+static void
+conn_close(struct conn *c)
+{
+	if (c->fd >= 0)
+	{
+		close(c->fd);
+	}
+	c->fd = -1;
+	c->state = CONN_IDLE;
+}
+
+static int
+conn_open(struct conn *c)
+{
+	int one = 1;
+
+	if ((c->fd = socket(target->ai_family, SOCK_STREAM, 0)) < 0)
+	{
+		return -1;
+	}
+	(void)fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+	(void)setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(c->fd, target->ai_addr, target->ai_addrlen) < 0 &&
+	    errno != EINPROGRESS)
+	{
+		conn_close(c);
+		return -1;
+	}
+	c->state = CONN_CONNECTING;
+	return 0;
+}
+
+/* Starts a request that was due at 'due' */
+static void
+conn_start(struct conn *c, long long due)
+{
+	c->due = due;
+	c->sent = 0;
+	c->head_len = 0;
+	c->in_body = 0;
+	if (c->fd < 0)
+	{
+		if (conn_open(c) < 0)
+		{
+			res.errors++;
+			return;
+		}
+	}
+	else
+	{
+		c->state = CONN_SENDING;
+	}
+}
+
+static void
+conn_done(struct conn *c)
+{
+	int class = c->status / 100;
+
+	record(now_ns() - c->due);
+	res.status[class >= 1 && class <= 5 ? class : 0]++;
+	if (c->close_after)
+	{
+		conn_close(c);
+	}
+	c->state = CONN_IDLE;
+}
+
+static void
+conn_fail(struct conn *c)
+{
+	res.errors++;
+	conn_close(c);
+}
+
+/* Looks for header 'name' in the response head; returns its value */
+static const char *
+find_header(const char *head, const char *name)
+{
+	size_t len = strlen(name);
+	const char *p = strstr(head, "\r\n");
+
+	while (p != NULL && p[2] != '\r')
+	{
+		p += 2;
+		if (strncasecmp(p, name, len) == 0 && p[len] == ':')
+		{
+			p += len + 1;
+			while (*p == ' ' || *p == '\t')
+			{
+				p++;
+			}
+			return p;
+		}
+		p = strstr(p, "\r\n");
+	}
+	return NULL;
+}
+
+/* Parses the complete response head; returns -1 if it is malformed */
+static int
+parse_head(struct conn *c)
+{
+	const char *v;
+
+	if (sscanf(c->head, "HTTP/%*d.%*d %d", &c->status) != 1)
+	{
+		return -1;
+	}
+	c->close_after = close_conns;
+	if ((v = find_header(c->head, "Connection")) != NULL &&
+	    strncasecmp(v, "close", 5) == 0)
+	{
+		c->close_after = 1;
+	}
+
+	if (c->status / 100 == 1 || c->status == 204 || c->status == 304)
+	{
+		c->body = BODY_NONE;
+	}
+	else if ((v = find_header(c->head, "Transfer-Encoding")) != NULL &&
+	         strncasecmp(v, "chunked", 7) == 0)
+	{
+		c->body = BODY_CHUNKED;
+		c->chunk = CHUNK_SIZE;
+		c->chunk_size = 0;
+		c->line_len = 0;
+	}
+	else if ((v = find_header(c->head, "Content-Length")) != NULL)
+	{
+		c->body = BODY_LENGTH;
+		c->left = strtoll(v, NULL, 10);
+	}
+	else
+	{
+		c->body = BODY_UNTIL_CLOSE;
+		c->close_after = 1;
+	}
+	return 0;
+}
+
+/*
+ * Consumes n body bytes at p.
+ * Returns 1 once the body is complete, 0 if more is needed, -1 on error.
+ */
+static int
+consume_body(struct conn *c, const char *p, size_t n)
+{
+	res.bytes += (long long)n;
+
+	switch (c->body)
+	{
+	case BODY_NONE:
+		return 1;
+	case BODY_UNTIL_CLOSE:
+		return 0;
+	case BODY_LENGTH:
+		c->left -= (long long)n;
+		return c->left <= 0 ? 1 : 0;
+	case BODY_CHUNKED:
+		break;
+	}
+
+	while (n > 0)
+	{
+		switch (c->chunk)
+		{
+		case CHUNK_SIZE:
+			if (*p == '\n')
+			{
+				c->chunk = c->chunk_size ? CHUNK_DATA : CHUNK_TRAILER;
+				c->left = c->chunk_size;
+				c->line_len = 0;
+			}
+			else if (isxdigit((unsigned char)*p) && c->line_len >= 0)
+			{
+				c->chunk_size = c->chunk_size * 16 +
+				                (isdigit((unsigned char)*p)
+				                     ? *p - '0'
+				                     : (tolower((unsigned char)*p) - 'a' + 10));
+			}
+			else
+			{
+				/* Chunk extensions and the CR: ignore the rest */
+				c->line_len = -1;
+			}
+			p++;
+			n--;
+			break;
+		case CHUNK_DATA:
+		{
+			size_t k = (size_t)c->left < n ? (size_t)c->left : n;
+			p += k;
+			n -= k;
+			c->left -= (long long)k;
+			if (c->left == 0)
+			{
+				c->chunk = CHUNK_DATA_END;
+			}
+			break;
+		}
+		case CHUNK_DATA_END:
+			if (*p == '\n')
+			{
+				c->chunk = CHUNK_SIZE;
+				c->chunk_size = 0;
+				c->line_len = 0;
+			}
+			p++;
+			n--;
+			break;
+		case CHUNK_TRAILER:
+			if (*p == '\n')
+			{
+				if (c->line_len == 0)
+				{
+					return n == 1 ? 1 : -1;
+				}
+				c->line_len = 0;
+			}
+			else if (*p != '\r')
+			{
+				c->line_len++;
+			}
+			p++;
+			n--;
+			break;
+		}
+	}
+	return 0;
+}
+
+static void
+conn_read(struct conn *c)
+{
+	static char buf[READ_CHUNK];
+
+	for (;;)
+	{
+		ssize_t n = read(c->fd, buf, sizeof(buf));
+		const char *p = buf;
+		size_t len;
+		int rc;
+
+		if (n < 0)
+		{
+			if (errno != EAGAIN && errno != EINTR)
+			{
+				conn_fail(c);
+			}
+			return;
+		}
+		if (n == 0)
+		{
+			if (c->in_body && c->body == BODY_UNTIL_CLOSE)
+			{
+				conn_done(c);
+				conn_close(c);
+			}
+			else
+			{
+				conn_fail(c);
+			}
+			return;
+		}
+		len = (size_t)n;
+
+		if (!c->in_body)
+		{
+			size_t k = len < MAX_HEAD - 1 - c->head_len
+			               ? len
+			               : MAX_HEAD - 1 - c->head_len;
+			char *end;
+
+			memcpy(c->head + c->head_len, buf, k);
+			c->head_len += k;
+			c->head[c->head_len] = '\0';
+			if ((end = strstr(c->head, "\r\n\r\n")) == NULL)
+			{
+				if (c->head_len == MAX_HEAD - 1)
+				{
+					conn_fail(c);
+					return;
+				}
+				continue;
+			}
+
+			/* Whatever followed the head is the start of the body */
+			p = buf + (k - (c->head_len - (size_t)(end + 4 - c->head)));
+			len = (size_t)(buf + len - p);
+			end[2] = '\0';
+			if (parse_head(c) < 0)
+			{
+				conn_fail(c);
+				return;
+			}
+			c->in_body = 1;
+			if (c->body == BODY_NONE ||
+			    (c->body == BODY_LENGTH && c->left == 0))
+			{
+				conn_done(c);
+				return;
+			}
+			if (len == 0)
+			{
+				continue;
+			}
+		}
+
+		if ((rc = consume_body(c, p, len)) < 0)
+		{
+			conn_fail(c);
+			return;
+		}
+		if (rc > 0)
+		{
+			conn_done(c);
+			return;
+		}
+	}
+}
+
+static void
+conn_write(struct conn *c)
+{
+	while (c->sent < request_len)
+	{
+		ssize_t n = write(c->fd, request + c->sent, request_len - c->sent);
+
+		if (n < 0)
+		{
+			if (errno != EAGAIN && errno != EINTR)
+			{
+				conn_fail(c);
+			}
+			return;
+		}
+		c->sent += (size_t)n;
+	}
+	c->state = CONN_READING;
+}
+
+/* ----- Server resource usage, from /proc ----- */
+
+/* Reads utime+stime+cutime+cstime (ticks), ppid and rss (pages) of pid */
+static int
+proc_stat(pid_t pid, long long *ticks, pid_t *ppid, long long *rss)
+{
+	char path[64], buf[1024], *p;
+	long long ut, st, cut, cst;
+	int pp;
+	FILE *f;
+	size_t n;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if ((f = fopen(path, "r")) == NULL)
+	{
+		return -1;
+	}
+	n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[n] = '\0';
+
+	/* The command name may contain anything: skip past its ')' */
+	if ((p = strrchr(buf, ')')) == NULL ||
+	    sscanf(p + 2,
+	           "%*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lld %lld %lld "
+	           "%lld %*d %*d %*d %*d %*u %*u %lld",
+	           &pp, &ut, &st, &cut, &cst, rss) != 6)
+	{
+		return -1;
+	}
+	*ticks = ut + st + cut + cst;
+	*ppid = (pid_t)pp;
+	return 0;
+}
+
+/*
+ * Adds up the CPU time (ticks, including reaped children) and resident
+ * memory (KiB) of the server and its direct children.
+ * Returns -1 if the server can't be found.
+ */
+static int
+tree_usage(pid_t server, long long *ticks, long long *rss_kb)
+{
+	long long t, rss, pages = 0;
+	struct dirent *de;
+	pid_t ppid;
+	DIR *d;
+	int found = 0;
+
+	*ticks = 0;
+	if ((d = opendir("/proc")) == NULL)
+	{
+		return -1;
+	}
+	while ((de = readdir(d)) != NULL)
+	{
+		pid_t pid = (pid_t)atoi(de->d_name);
+
+		if (pid > 0 && proc_stat(pid, &t, &ppid, &rss) == 0 &&
+		    (pid == server || ppid == server))
+		{
+			found |= (pid == server);
+			*ticks += t;
+			pages += rss;
+		}
+	}
+	closedir(d);
+	*rss_kb = pages * (sysconf(_SC_PAGESIZE) / 1024);
+	return found ? 0 : -1;
+}
+
+static int
+cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of the sorted latencies, in microseconds */
+static double
+percentile(double p)
+{
+	size_t rank;
+
+	if (res.nlat == 0)
+	{
+		return 0;
+	}
+	rank = (size_t)(p * (double)res.nlat + 0.999999);
+	if (rank < 1)
+	{
+		rank = 1;
+	}
+	if (rank > res.nlat)
+	{
+		rank = res.nlat;
+	}
+	return (double)res.lat[rank - 1] / 1000.0;
+}
+
+static void
+report(const struct options *o, double elapsed, long long cpu_ticks,
+       long long peak_rss)
+{
+	double sum = 0;
+
+	qsort(res.lat, res.nlat, sizeof(*res.lat), cmp_ll);
+	for (size_t i = 0; i < res.nlat; i++)
+	{
+		sum += (double)res.lat[i];
+	}
+
+	printf("{\"name\": \"%s\", \"path\": \"%s\", \"mode\": \"%s\", "
+	       "\"connections\": %d, ",
+	       o->name, o->path, o->rate > 0 ? "open" : "closed", o->conns);
+	if (o->rate > 0)
+	{
+		printf("\"target_rps\": %.0f, ", o->rate);
+	}
+	printf("\"duration_s\": %.3f, \"requests\": %zu, \"errors\": %lld, "
+	       "\"rps\": %.1f, \"mbytes_per_s\": %.2f, ",
+	       elapsed, res.nlat, res.errors, (double)res.nlat / elapsed,
+	       (double)res.bytes / elapsed / 1e6);
+	printf("\"status\": {\"2xx\": %lld, \"3xx\": %lld, \"4xx\": %lld, "
+	       "\"5xx\": %lld, \"other\": %lld}, ",
+	       res.status[2], res.status[3], res.status[4], res.status[5],
+	       res.status[0] + res.status[1]);
+	printf("\"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, "
+	       "\"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}",
+	       res.nlat ? sum / (double)res.nlat / 1000.0 : 0.0, percentile(0.5),
+	       percentile(0.9), percentile(0.99), percentile(0.999),
+	       percentile(1.0));
+	if (o->server > 0)
+	{
+		printf(", \"server\": {\"cpu_s\": %.3f, \"cpu_us_per_req\": %.1f, "
+		       "\"peak_rss_kb\": %lld}",
+		       (double)cpu_ticks / (double)sysconf(_SC_CLK_TCK),
+		       res.nlat ? (double)cpu_ticks / (double)sysconf(_SC_CLK_TCK) *
+		                      1e6 / (double)res.nlat
+		                : 0.0,
+		       peak_rss);
+	}
+	printf("}\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	struct options o = {0};
+	static struct conn conns[MAX_CONNS];
+	static struct pollfd pfd[MAX_CONNS];
+	struct addrinfo hints;
+	long long start, end, next_due = 0, interval = 0, pending = 0;
+	long long next_sample, ticks0 = 0, ticks1 = 0, peak_rss = -1, ticks, kb;
+	int ch, rc;
+
+	o.conns = 16;
+	o.duration = 5;
+	o.name = "run";
+	o.headers = "";
+
+	while ((ch = getopt(argc, argv, "Cc:d:H:n:P:r:")) != -1)
+	{
+		switch (ch)
+		{
+		case 'C':
+			o.close_conns = 1;
+			break;
+		case 'c':
+			o.conns = atoi(optarg);
+			break;
+		case 'd':
+			o.duration = atof(optarg);
+			break;
+		case 'H':
+			o.headers = optarg;
+			break;
+		case 'n':
+			o.name = optarg;
+			break;
+		case 'P':
+			o.server = (pid_t)atoi(optarg);
+			break;
+		case 'r':
+			o.rate = atof(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 3 || o.conns < 1 || o.conns > MAX_CONNS ||
+	    o.duration <= 0)
+	{
+		usage();
+	}
+	o.host = argv[optind];
+	o.port = argv[optind + 1];
+	o.path = argv[optind + 2];
+	close_conns = o.close_conns;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	if ((rc = getaddrinfo(o.host, o.port, &hints, &target)) != 0)
+	{
+		fprintf(stderr, "loadgen: %s: %s\n", o.host, gai_strerror(rc));
+		return 1;
+	}
+
+	request_len = (size_t)snprintf(request, sizeof(request),
+	                               "GET %s HTTP/1.1\r\nHost: %s\r\n%s%s"
+	                               "Connection: %s\r\n\r\n",
+	                               o.path, o.host, o.headers,
+	                               *o.headers ? "\r\n" : "",
+	                               o.close_conns ? "close" : "keep-alive");
+	if (request_len >= sizeof(request))
+	{
+		fprintf(stderr, "loadgen: request too long\n");
+		return 1;
+	}
+
+	for (int i = 0; i < o.conns; i++)
+	{
+		conns[i].fd = -1;
+		conns[i].state = CONN_IDLE;
+	}
+
+	if (o.server > 0 && tree_usage(o.server, &ticks0, &peak_rss) < 0)
+	{
+		fprintf(stderr, "loadgen: can't read /proc for pid %d\n",
+		        (int)o.server);
+		o.server = 0;
+	}
+
+	start = now_ns();
+	end = start + (long long)(o.duration * 1e9);
+	next_sample = start;
+	if (o.rate > 0)
+	{
+		interval = (long long)(1e9 / o.rate);
+		next_due = start;
+	}
+
+	for (;;)
+	{
+		long long now = now_ns();
+		int timeout = 10;
+
+		if (now >= end)
+		{
+			break;
+		}
+
+		if (o.server > 0 && now >= next_sample)
+		{
+			if (tree_usage(o.server, &ticks, &kb) == 0 && kb > peak_rss)
+			{
+				peak_rss = kb;
+			}
+			next_sample = now + SAMPLE_NS;
+		}
+
+		/* Open loop: everything due by now joins the queue */
+		if (o.rate > 0)
+		{
+			while (next_due <= now)
+			{
+				pending++;
+				next_due += interval;
+			}
+		}
+
+		for (int i = 0; i < o.conns; i++)
+		{
+			struct conn *c = &conns[i];
+
+			if (c->state != CONN_IDLE)
+			{
+				continue;
+			}
+			if (o.rate <= 0)
+			{
+				conn_start(c, now);
+			}
+			else if (pending > 0)
+			{
+				/* Late requests keep their due time */
+				conn_start(c, next_due - pending * interval);
+				pending--;
+			}
+		}
+
+		for (int i = 0; i < o.conns; i++)
+		{
+			struct conn *c = &conns[i];
+
+			pfd[i].fd = c->state == CONN_IDLE ? -1 : c->fd;
+			pfd[i].events = c->state == CONN_READING ? POLLIN : POLLOUT;
+			pfd[i].revents = 0;
+		}
+		if (o.rate > 0 && pending == 0)
+		{
+			long long wait_ms = (next_due - now) / 1000000;
+			timeout = wait_ms < timeout ? (int)wait_ms : timeout;
+		}
+
+		if (poll(pfd, (nfds_t)o.conns, timeout) < 0 && errno != EINTR)
+		{
+			perror("poll");
+			return 1;
+		}
+
+		for (int i = 0; i < o.conns; i++)
+		{
+			struct conn *c = &conns[i];
+
+			if (pfd[i].fd < 0 || pfd[i].revents == 0)
+			{
+				continue;
+			}
+			if (c->state == CONN_CONNECTING)
+			{
+				int err = 0;
+				socklen_t len = sizeof(err);
+
+				if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+				    err != 0)
+				{
+					conn_fail(c);
+					continue;
+				}
+				c->state = CONN_SENDING;
+			}
+			if (c->state == CONN_SENDING)
+			{
+				conn_write(c);
+			}
+			else if (c->state == CONN_READING)
+			{
+				conn_read(c);
+			}
+		}
+	}
+
+	if (o.server > 0 && tree_usage(o.server, &ticks1, &kb) < 0)
+	{
+		ticks1 = ticks0;
+	}
+	for (int i = 0; i < o.conns; i++)
+	{
+		conn_close(&conns[i]);
+	}
+
+	report(&o, (double)(now_ns() - start) / 1e9, ticks1 - ticks0, peak_rss);
+	freeaddrinfo(target);
+	free(res.lat);
+	return 0;
+}
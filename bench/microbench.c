@@ -0,0 +1,416 @@
+/*
+ * Microbenchmarks of the request parsing and path handling functions.
+ *
+ * Each case runs one function over one input, in memory, for long enough
+ * to be timed, and reports the time per call, calls per second and input
+ * bytes per CPU cycle (from the time-stamp counter, where there is one).
+ * The corpora mix realistic requests with adversarial ones: long
+ * percent-encoded paths, many headers and deep ".." chains.
+ *
+ * usage: microbench [-j] [-t msec] [filter]
+ *   -j       print JSON lines instead of a table
+ *   -t msec  minimum time per case (default: 200)
+ *   filter   only run cases whose name contains this string
+ */
+
+#include <sys/types.h>
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#include "../http.h"
+#include "../parser.h"
+
+/* Keeps the compiler from dropping the calls being measured */
+static volatile long sink;
+
+struct bench_case
+{
+	const char *name;
+	void (*run)(const struct bench_case *bc, long iters);
+	const char *input;
+	size_t input_len;
+	const char *arg;
+};
+
+static char *
+repeat(const char *prefix, const char *unit, int n, const char *suffix)
+{
+	size_t len = strlen(prefix) + strlen(unit) * (size_t)n + strlen(suffix);
+	char *s = malloc(len + 1), *p;
+
+	if (s == NULL)
+	{
+		perror("malloc");
+		exit(1);
+	}
+	p = stpcpy(s, prefix);
+	for (int i = 0; i < n; i++)
+	{
+		p = stpcpy(p, unit);
+	}
+	strcpy(p, suffix);
+	return s;
+}
+
+/* ----- Cases ----- */
+
+static void
+run_hexval(const struct bench_case *bc, long iters)
+{
+	long acc = 0;
+
+	for (long i = 0; i < iters; i++)
+	{
+		for (size_t k = 0; k < bc->input_len; k++)
+		{
+			acc += hexval((unsigned char)bc->input[k]);
+		}
+	}
+	sink = acc;
+}
+
+static void
+run_normalize_path(const struct bench_case *bc, long iters)
+{
+	char out[PATH_MAX];
+	long acc = 0;
+
+	for (long i = 0; i < iters; i++)
+	{
+		acc += normalize_path(bc->input, out, sizeof(out));
+		acc += out[0];
+	}
+	sink = acc;
+}
+
+static void
+run_validate_uri(const struct bench_case *bc, long iters)
+{
+	long acc = 0;
+
+	for (long i = 0; i < iters; i++)
+	{
+		acc += validate_uri(bc->input);
+	}
+	sink = acc;
+}
+
+static void
+run_extract_header(const struct bench_case *bc, long iters)
+{
+	char value[MAX_HEADER_VALUE];
+	long acc = 0;
+
+	for (long i = 0; i < iters; i++)
+	{
+		acc += extract_header(bc->input, bc->arg, value, sizeof(value));
+	}
+	sink = acc;
+}
+
+/* The line is split in place, so every call works on a fresh copy */
+static void
+run_parse_request_line(const struct bench_case *bc, long iters)
+{
+	char line[HTTP_MAX_HEAD];
+	char method[MAX_METHOD], path[MAX_URI], version[MAX_VERSION];
+	long acc = 0;
+
+	for (long i = 0; i < iters; i++)
+	{
+		memcpy(line, bc->input, bc->input_len + 1);
+		acc += parse_request_line(line, method, sizeof(method), path,
+		                          sizeof(path), version, sizeof(version));
+	}
+	sink = acc;
+}
+
+/* What parse_http_request() does once the head has been read */
+static void
+run_parse_head(const struct bench_case *bc, long iters)
+{
+	struct http_parser p;
+	struct http_request req;
+	long acc = 0;
+
+	for (long i = 0; i < iters; i++)
+	{
+		http_parser_init(&p);
+		if (http_parser_feed(&p, bc->input, bc->input_len) > 0)
+		{
+			acc += http_request_from_parser(&p, &req);
+		}
+	}
+	sink = acc;
+}
+
+/* The same head fed in 64-byte pieces, as if it trickled in */
+static void
+run_parse_head_split(const struct bench_case *bc, long iters)
+{
+	struct http_parser p;
+	struct http_request req;
+	long acc = 0;
+
+	for (long i = 0; i < iters; i++)
+	{
+		ssize_t n = 0;
+
+		http_parser_init(&p);
+		for (size_t len = 64; n == 0; len += 64)
+		{
+			n = http_parser_feed(&p, bc->input,
+			                     len < bc->input_len ? len : bc->input_len);
+		}
+		if (n > 0)
+		{
+			acc += http_request_from_parser(&p, &req);
+		}
+	}
+	sink = acc;
+}
+
+/*
+ * parse_http_request() reads from a descriptor; an unlinked temporary
+ * file stands in for the socket, so this includes a read(2) per call.
+ */
+static void
+run_parse_http_request(const struct bench_case *bc, long iters)
+{
+	static char buf[HTTP_MAX_HEAD];
+	struct http_request req;
+	FILE *f = tmpfile();
+	long acc = 0;
+
+	if (f == NULL || fwrite(bc->input, 1, bc->input_len, f) != bc->input_len ||
+	    fflush(f) != 0)
+	{
+		perror("tmpfile");
+		exit(1);
+	}
+	for (long i = 0; i < iters; i++)
+	{
+		size_t len = 0, used = 0;
+
+		(void)lseek(fileno(f), 0, SEEK_SET);
+		acc += parse_http_request(fileno(f), buf, &len, &used, &req);
+	}
+	fclose(f);
+	sink = acc;
+}
+
+/* ----- Timing ----- */
+
+static long long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned long long
+cycles(void)
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void
+measure(const struct bench_case *bc, long long min_ns, int json)
+{
+	long iters = 1;
+	long long t0, t1;
+	unsigned long long c0, c1;
+	double ns_per_op, cyc_per_op;
+
+	/* Warm up, then grow the count until a run takes long enough */
+	bc->run(bc, 1);
+	for (;;)
+	{
+		c0 = cycles();
+		t0 = now_ns();
+		bc->run(bc, iters);
+		t1 = now_ns();
+		c1 = cycles();
+		if (t1 - t0 >= min_ns || iters > LONG_MAX / 4)
+		{
+			break;
+		}
+		iters *= t1 - t0 < min_ns / 16 ? 8 : 2;
+	}
+
+	ns_per_op = (double)(t1 - t0) / (double)iters;
+	cyc_per_op = (double)(c1 - c0) / (double)iters;
+	if (json)
+	{
+		printf("{\"name\": \"%s\", \"input_bytes\": %zu, \"iterations\": %ld, "
+		       "\"ns_per_op\": %.2f, \"ops_per_s\": %.0f",
+		       bc->name, bc->input_len, iters, ns_per_op, 1e9 / ns_per_op);
+		if (cyc_per_op > 0)
+		{
+			printf(", \"cycles_per_op\": %.1f, \"bytes_per_cycle\": %.3f",
+			       cyc_per_op, (double)bc->input_len / cyc_per_op);
+		}
+		printf("}\n");
+	}
+	else
+	{
+		printf("%-36s %7zu %12.1f %14.0f", bc->name, bc->input_len, ns_per_op,
+		       1e9 / ns_per_op);
+		if (cyc_per_op > 0)
+		{
+			printf(" %12.3f", (double)bc->input_len / cyc_per_op);
+		}
+		printf("\n");
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *filter = NULL;
+	long long min_ns = 200000000LL;
+	int json = 0, ch;
+
+	while ((ch = getopt(argc, argv, "jt:")) != -1)
+	{
+		switch (ch)
+		{
+		case 'j':
+			json = 1;
+			break;
+		case 't':
+			min_ns = atoll(optarg) * 1000000LL;
+			break;
+		default:
+			fprintf(stderr, "usage: microbench [-j] [-t msec] [filter]\n");
+			return 2;
+		}
+	}
+	if (optind < argc)
+	{
+		filter = argv[optind];
+	}
+
+	/* ----- Corpora ----- */
+
+	char hexchars[256];
+	for (int i = 0; i < 256; i++)
+	{
+		hexchars[i] = (char)(i == 0 ? '0' : i);
+	}
+
+	const char *path_simple = "/docs/guide/index.html";
+	char *path_pct = repeat("/", "%61%62%63%2F", 70, "index.html");
+	char *path_dots = repeat("/a/b/c", "/d/../e/./..", 60, "/index.html");
+	char *path_escape = repeat("", "/..", 300, "/etc/passwd");
+	char *path_slashes = repeat("", "//////////", 90, "x");
+
+	const char *line_simple = "GET /index.html HTTP/1.1\r\n";
+	char *line_long = repeat("GET /", "%41", 300, " HTTP/1.1\r\n");
+
+	const char *header_line = "If-Modified-Since: Wed, 21 Oct 2015 "
+	                          "07:28:00 GMT";
+	char *header_long = repeat("X-Padding: ", "a", 4000, "");
+
+	const char *head_browser =
+		"GET /static/app.js?v=1234 HTTP/1.1\r\n"
+		"Host: www.example.com\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) "
+		"Gecko/20100101 Firefox/128.0\r\n"
+		"Accept: */*\r\n"
+		"Accept-Language: en-US,en;q=0.5\r\n"
+		"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+		"Referer: https://www.example.com/\r\n"
+		"Connection: keep-alive\r\n"
+		"Cookie: session=0123456789abcdef0123456789abcdef; theme=dark\r\n"
+		"If-Modified-Since: Wed, 21 Oct 2015 07:28:00 GMT\r\n"
+		"If-None-Match: \"abc-123-456\"\r\n"
+		"Sec-Fetch-Dest: script\r\n"
+		"Sec-Fetch-Mode: no-cors\r\n"
+		"Sec-Fetch-Site: same-origin\r\n"
+		"\r\n";
+	char *head_many = repeat("GET / HTTP/1.1\r\nHost: example.com\r\n",
+	                         "X-Header-Name: some header value\r\n", 200,
+	                         "\r\n");
+	char *head_pct = repeat("GET /", "%7e%41%2f", 100,
+	                        " HTTP/1.1\r\nHost: example.com\r\n\r\n");
+
+	struct bench_case cases[] = {
+		{"hexval/all-bytes", run_hexval, hexchars, sizeof(hexchars), NULL},
+		{"normalize_path/simple", run_normalize_path, path_simple, 0, NULL},
+		{"normalize_path/percent", run_normalize_path, path_pct, 0, NULL},
+		{"normalize_path/dot-chain", run_normalize_path, path_dots, 0, NULL},
+		{"normalize_path/escape-root", run_normalize_path, path_escape, 0,
+		 NULL},
+		{"normalize_path/slashes", run_normalize_path, path_slashes, 0, NULL},
+		{"validate_uri/simple", run_validate_uri, path_simple, 0, NULL},
+		{"validate_uri/percent", run_validate_uri, path_pct, 0, NULL},
+		{"validate_uri/dot-chain", run_validate_uri, path_dots, 0, NULL},
+		{"extract_header/match", run_extract_header, header_line, 0,
+		 "If-Modified-Since"},
+		{"extract_header/miss", run_extract_header, header_line, 0, "Range"},
+		{"extract_header/long-value", run_extract_header, header_long, 0,
+		 "X-Padding"},
+		{"parse_request_line/simple", run_parse_request_line, line_simple, 0,
+		 NULL},
+		{"parse_request_line/percent", run_parse_request_line, line_long, 0,
+		 NULL},
+		{"parse_head/browser", run_parse_head, head_browser, 0, NULL},
+		{"parse_head/many-headers", run_parse_head, head_many, 0, NULL},
+		{"parse_head/percent-path", run_parse_head, head_pct, 0, NULL},
+		{"parse_head/browser-split", run_parse_head_split, head_browser, 0,
+		 NULL},
+		{"parse_head/many-headers-split", run_parse_head_split, head_many, 0,
+		 NULL},
+		{"parse_http_request/browser", run_parse_http_request, head_browser, 0,
+		 NULL},
+	};
+
+	if (!json)
+	{
+		printf("%-36s %7s %12s %14s", "case", "bytes", "ns/op", "ops/s");
+		if (cycles())
+		{
+			printf(" %12s", "bytes/cycle");
+		}
+		printf("\n");
+	}
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+	{
+		struct bench_case *bc = &cases[i];
+
+		if (bc->input_len == 0)
+		{
+			bc->input_len = strlen(bc->input);
+		}
+		if (filter == NULL || strstr(bc->name, filter) != NULL)
+		{
+			measure(bc, min_ns, json);
+		}
+	}
+
+	free(path_pct);
+	free(path_dots);
+	free(path_escape);
+	free(path_slashes);
+	free(line_long);
+	free(header_long);
+	free(head_many);
+	free(head_pct);
+	return 0;
+}
@@ -0,0 +1,111 @@
+#!/bin/sh
+#
+# Starts sws on a scratch document root, drives it with bench/loadgen
+# through a set of scenarios and prints the results as one JSON document.
+#
+# Environment:
+#   BENCH_DURATION  seconds per scenario (default: 5)
+#   BENCH_CONNS     concurrent connections (default: 16)
+#   BENCH_RATE      requests per second of the open-loop run (default: 1000)
+#   BENCH_FLAGS     extra sws options, e.g. "-e" or "-w 4 -C 64m"
+#   BENCH_PORT      port to listen on (default: 18080)
+#   BENCH_OUT       file to also write the results to
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+DURATION=${BENCH_DURATION:-5}
+CONNS=${BENCH_CONNS:-16}
+RATE=${BENCH_RATE:-1000}
+PORT=${BENCH_PORT:-18080}
+FLAGS=${BENCH_FLAGS:-}
+
+ROOT=$(mktemp -d "${TMPDIR:-/tmp}/sws-bench.XXXXXX")
+USER_NAME=$(id -un)
+USER_HOME=$(getent passwd "$USER_NAME" 2>/dev/null | cut -d: -f6)
+USER_HOME=${USER_HOME:-$HOME}
+USER_DIR=
+SERVER=
+
+cleanup()
+{
+	if [ -n "$SERVER" ]; then
+		kill "$SERVER" 2>/dev/null || true
+	fi
+	rm -rf "$ROOT"
+	if [ -n "$USER_DIR" ]; then
+		rm -rf "$USER_DIR"
+	fi
+}
+trap cleanup EXIT INT TERM
+
+# ----- Document root -----
+
+mkdir -p "$ROOT/www/dir" "$ROOT/cgi"
+head -c 1024 /dev/zero | tr '\0' 'x' > "$ROOT/www/small.html"
+head -c 8388608 /dev/zero > "$ROOT/www/large.bin"
+i=0
+while [ $i -lt 1000 ]; do
+	: > "$ROOT/www/dir/file$i.txt"
+	i=$((i + 1))
+done
+printf '#!/bin/sh\nprintf "Content-Type: text/plain\\r\\n\\r\\nhello\\n"\n' \
+	> "$ROOT/cgi/hello.sh"
+chmod 755 "$ROOT/cgi/hello.sh"
+
+# /~user maps to the user's ~/sws: only create (and later remove) it if
+# it isn't there already
+if [ ! -e "$USER_HOME/sws" ] && mkdir "$USER_HOME/sws" 2>/dev/null; then
+	USER_DIR="$USER_HOME/sws"
+	cp "$ROOT/www/small.html" "$USER_DIR/index.html"
+fi
+
+# ----- Server -----
+
+# shellcheck disable=SC2086
+./sws $FLAGS -p "$PORT" -c "$ROOT/cgi" "$ROOT/www"
+sleep 1
+SERVER=$(pgrep -o -f "sws .*-p $PORT " || true)
+if [ -z "$SERVER" ]; then
+	echo "bench: sws did not start" >&2
+	exit 1
+fi
+
+# A date after every file's mtime, for revalidations answered with 304
+IMS=$(LC_ALL=C date -u '+%a, %d %b %Y %H:%M:%S GMT')
+
+run()
+{
+	name=$1
+	shift
+	bench/loadgen -n "$name" -d "$DURATION" -P "$SERVER" "$@"
+}
+
+RESULTS=$(
+	{
+		run small -c "$CONNS" 127.0.0.1 "$PORT" /small.html
+		run small-open -c "$CONNS" -r "$RATE" 127.0.0.1 "$PORT" /small.html
+		run small-close -C -c "$CONNS" 127.0.0.1 "$PORT" /small.html
+		run large -c 4 127.0.0.1 "$PORT" /large.bin
+		run not-modified -c "$CONNS" -H "If-Modified-Since: $IMS" \
+			127.0.0.1 "$PORT" /small.html
+		run dirindex -c "$CONNS" 127.0.0.1 "$PORT" /dir/
+		if [ -e "$USER_HOME/sws" ]; then
+			run userdir -c "$CONNS" 127.0.0.1 "$PORT" "/~$USER_NAME/"
+		fi
+		run cgi -c 4 127.0.0.1 "$PORT" /cgi-bin/hello.sh
+	} | sed '$!s/$/,/'
+)
+
+OUTPUT=$(cat <<EOF
+{"date": "$(date -u '+%Y-%m-%dT%H:%M:%SZ')", "commit": "$(git rev-parse --short HEAD 2>/dev/null || echo unknown)", "sws_flags": "$FLAGS", "results": [
+$RESULTS
+]}
+EOF
+)
+
+echo "$OUTPUT"
+if [ -n "$BENCH_OUT" ]; then
+	echo "$OUTPUT" > "$BENCH_OUT"
+fi
@@ -0,0 +1,566 @@
+#include "cache.h"
+
+#include <sys/mman.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* File data is stored in fixed-size chunks, chained per entry */
+#define CACHE_CHUNK 4096
+
+/* One entry slot per this many bytes of budget */
+#define CACHE_BYTES_PER_ENTRY (16 * 1024)
+
+#define NONE UINT32_MAX
+
+struct cache_entry
+{
+	int in_use;
+	uint32_t hash;
+	uint32_t bucket_next; /* hash chain, or free list */
+	uint32_t lru_prev;
+	uint32_t lru_next;
+	uint32_t first_chunk;
+	uint32_t nchunks;
+
+	/*
+	 * Bumped whenever the entry is removed, before its chunks can be
+	 * reused. A reader copies the body outside the lock and keeps the
+	 * copy only if the generation is unchanged afterwards.
+	 */
+	uint32_t gen;
+
+	/* File version the entry was stored for */
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+
+	char key[CACHE_MAX_KEY];
+	char headers[CACHE_MAX_HEADERS];
+	size_t headers_len;
+	char content_type[128];
+	char last_modified[64];
+	size_t body_len;
+};
+
+struct cache_header
+{
+	/* Process-shared and robust: a process dying with it held is noticed */
+	pthread_mutex_t lock;
+
+	uint32_t nentries;
+	uint32_t nbuckets; /* power of two */
+	uint32_t nchunks;
+
+	uint32_t free_entry;
+	uint32_t free_chunk;
+	uint32_t nfree_chunks;
+
+	/* Most recently used at the head */
+	uint32_t lru_head;
+	uint32_t lru_tail;
+
+	struct cache_stats stats;
+};
+
+static struct cache_header *hdr = NULL;
+static struct cache_entry *entries;
+static uint32_t *buckets;
+static uint32_t *chunk_next;
+static char *chunk_data;
+
+static void reset_entries(void);
+
+/*
+ * Takes the lock shared by all processes. If its previous owner died in
+ * the middle of an update, the index can't be trusted any more: the cache
+ * is emptied before the lock is marked consistent again.
+ * Returns 0 with the lock held, or -1.
+ */
+static int
+cache_lock(void)
+{
+	int rc = pthread_mutex_lock(&hdr->lock);
+
+	if (rc == EOWNERDEAD)
+	{
+		reset_entries();
+		rc = pthread_mutex_consistent(&hdr->lock);
+	}
+	return rc == 0 ? 0 : -1;
+}
+
+static void
+cache_unlock(void)
+{
+	(void)pthread_mutex_unlock(&hdr->lock);
+}
+
+/* FNV-1a */
+static uint32_t
+hash_key(const char *key)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *key; key++)
+	{
+		h ^= (unsigned char)*key;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* Sets up a mutex that is shared between processes and robust */
+static int
+init_lock(pthread_mutex_t *m)
+{
+	pthread_mutexattr_t attr;
+	int rc;
+
+	if (pthread_mutexattr_init(&attr) != 0)
+	{
+		return -1;
+	}
+	rc = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	if (rc == 0)
+	{
+		rc = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	}
+	if (rc == 0)
+	{
+		rc = pthread_mutex_init(m, &attr);
+	}
+	(void)pthread_mutexattr_destroy(&attr);
+	return rc == 0 ? 0 : -1;
+}
+
+static size_t
+align_up(size_t n)
+{
+	return (n + 63) & ~(size_t)63;
+}
+
+int
+cache_init(size_t budget)
+{
+	size_t nentries, nbuckets, nchunks, size;
+	size_t off_entries, off_buckets, off_next, off_data;
+	char *base;
+
+	if (budget == 0)
+	{
+		return 0;
+	}
+
+	nchunks = budget / CACHE_CHUNK;
+	nentries = budget / CACHE_BYTES_PER_ENTRY;
+	if (nchunks < 1 || nentries < 16)
+	{
+		nentries = 16;
+		nchunks = nchunks < 1 ? 1 : nchunks;
+	}
+	if (nchunks >= NONE || nentries >= NONE / 2)
+	{
+		return -1;
+	}
+	for (nbuckets = 1; nbuckets < nentries; nbuckets <<= 1)
+		;
+
+	off_entries = align_up(sizeof(struct cache_header));
+	off_buckets = off_entries + align_up(nentries * sizeof(*entries));
+	off_next = off_buckets + align_up(nbuckets * sizeof(*buckets));
+	off_data = off_next + align_up(nchunks * sizeof(*chunk_next));
+	size = off_data + nchunks * CACHE_CHUNK;
+
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1,
+	            0);
+	if (base == MAP_FAILED)
+	{
+		return -1;
+	}
+
+	hdr = (struct cache_header *)base;
+	entries = (struct cache_entry *)(base + off_entries);
+	buckets = (uint32_t *)(base + off_buckets);
+	chunk_next = (uint32_t *)(base + off_next);
+	chunk_data = base + off_data;
+
+	hdr->nentries = (uint32_t)nentries;
+	hdr->nbuckets = (uint32_t)nbuckets;
+	hdr->nchunks = (uint32_t)nchunks;
+	hdr->stats.budget = nchunks * CACHE_CHUNK;
+	reset_entries();
+
+	if (init_lock(&hdr->lock) < 0)
+	{
+		(void)munmap(base, size);
+		hdr = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+cache_enabled(void)
+{
+	return hdr != NULL;
+}
+
+/* ----- Internal helpers; all called with the lock held ----- */
+
+/* Empties the cache: every entry and chunk goes back on the free lists */
+static void
+reset_entries(void)
+{
+	uint32_t nentries = hdr->nentries, nchunks = hdr->nchunks;
+
+	for (uint32_t i = 0; i < hdr->nbuckets; i++)
+	{
+		buckets[i] = NONE;
+	}
+	for (uint32_t i = 0; i < nentries; i++)
+	{
+		/* Readers still copying an entry must see it go away */
+		__atomic_add_fetch(&entries[i].gen, 1, __ATOMIC_RELAXED);
+		entries[i].in_use = 0;
+		entries[i].first_chunk = NONE;
+		entries[i].nchunks = 0;
+		entries[i].bucket_next = (i + 1 < nentries) ? i + 1 : NONE;
+	}
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	hdr->free_entry = 0;
+	for (uint32_t i = 0; i < nchunks; i++)
+	{
+		chunk_next[i] = (i + 1 < nchunks) ? i + 1 : NONE;
+	}
+	hdr->free_chunk = 0;
+	hdr->nfree_chunks = nchunks;
+	hdr->lru_head = hdr->lru_tail = NONE;
+	hdr->stats.bytes_used = 0;
+}
+
+static void
+lru_unlink(uint32_t i)
+{
+	struct cache_entry *e = &entries[i];
+
+	if (e->lru_prev != NONE)
+	{
+		entries[e->lru_prev].lru_next = e->lru_next;
+	}
+	else
+	{
+		hdr->lru_head = e->lru_next;
+	}
+	if (e->lru_next != NONE)
+	{
+		entries[e->lru_next].lru_prev = e->lru_prev;
+	}
+	else
+	{
+		hdr->lru_tail = e->lru_prev;
+	}
+	e->lru_prev = e->lru_next = NONE;
+}
+
+static void
+lru_push_front(uint32_t i)
+{
+	struct cache_entry *e = &entries[i];
+
+	e->lru_prev = NONE;
+	e->lru_next = hdr->lru_head;
+	if (hdr->lru_head != NONE)
+	{
+		entries[hdr->lru_head].lru_prev = i;
+	}
+	hdr->lru_head = i;
+	if (hdr->lru_tail == NONE)
+	{
+		hdr->lru_tail = i;
+	}
+}
+
+static uint32_t
+find_entry(const char *key, uint32_t hash)
+{
+	uint32_t i = buckets[hash & (hdr->nbuckets - 1)];
+
+	while (i != NONE)
+	{
+		if (entries[i].hash == hash && strcmp(entries[i].key, key) == 0)
+		{
+			return i;
+		}
+		i = entries[i].bucket_next;
+	}
+	return NONE;
+}
+
+/* Unlinks entry i from its hash chain and the LRU list and frees it */
+static void
+remove_entry(uint32_t i)
+{
+	struct cache_entry *e = &entries[i];
+	uint32_t *pp = &buckets[e->hash & (hdr->nbuckets - 1)];
+
+	while (*pp != NONE && *pp != i)
+	{
+		pp = &entries[*pp].bucket_next;
+	}
+	if (*pp == i)
+	{
+		*pp = e->bucket_next;
+	}
+	lru_unlink(i);
+
+	/* Invalidate copies in progress before the chunks can be reused */
+	__atomic_add_fetch(&e->gen, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	/* Return the chunk chain to the free list */
+	if (e->first_chunk != NONE)
+	{
+		uint32_t last = e->first_chunk;
+		while (chunk_next[last] != NONE)
+		{
+			last = chunk_next[last];
+		}
+		chunk_next[last] = hdr->free_chunk;
+		hdr->free_chunk = e->first_chunk;
+		hdr->nfree_chunks += e->nchunks;
+	}
+	hdr->stats.bytes_used -= e->body_len;
+
+	e->in_use = 0;
+	e->first_chunk = NONE;
+	e->nchunks = 0;
+	e->bucket_next = hdr->free_entry;
+	hdr->free_entry = i;
+}
+
+static int
+same_version(const struct cache_entry *e, const struct stat *st)
+{
+	return e->dev == st->st_dev && e->ino == st->st_ino &&
+	       e->size == st->st_size && e->mtime.tv_sec == st->st_mtim.tv_sec &&
+	       e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* ----- Public interface ----- */
+
+int
+cache_lookup(const char *key, const struct stat *st, struct cache_object *obj)
+{
+	uint32_t hash, i, first, gen;
+	struct cache_entry *e;
+	size_t copied = 0;
+
+	if (hdr == NULL || strlen(key) >= CACHE_MAX_KEY)
+	{
+		return -1;
+	}
+
+	hash = hash_key(key);
+	if (cache_lock() < 0)
+	{
+		return -1;
+	}
+
+	if ((i = find_entry(key, hash)) == NONE)
+	{
+		hdr->stats.misses++;
+		cache_unlock();
+		return -1;
+	}
+
+	e = &entries[i];
+	if (!same_version(e, st))
+	{
+		/* The file changed since it was cached */
+		remove_entry(i);
+		hdr->stats.stale++;
+		hdr->stats.misses++;
+		cache_unlock();
+		return -1;
+	}
+
+	/* Only the metadata is copied under the lock */
+	memcpy(obj->headers, e->headers, e->headers_len);
+	obj->headers_len = e->headers_len;
+	memcpy(obj->content_type, e->content_type, sizeof(obj->content_type));
+	memcpy(obj->last_modified, e->last_modified, sizeof(obj->last_modified));
+	obj->body_len = e->body_len;
+	first = e->first_chunk;
+	gen = e->gen;
+
+	lru_unlink(i);
+	lru_push_front(i);
+	hdr->stats.hits++;
+
+	cache_unlock();
+
+	if ((obj->body = malloc(obj->body_len ? obj->body_len : 1)) == NULL)
+	{
+		return -1;
+	}
+
+	/*
+	 * The chunks may be evicted and reused while we copy. Chunk indices
+	 * always stay in range and the copy stops after body_len bytes, so a
+	 * torn copy is harmless; it is thrown away if the entry's generation
+	 * moved on meanwhile.
+	 */
+	for (uint32_t c = first; c != NONE && copied < obj->body_len;
+	     c = __atomic_load_n(&chunk_next[c], __ATOMIC_RELAXED))
+	{
+		size_t n = obj->body_len - copied;
+		if (n > CACHE_CHUNK)
+		{
+			n = CACHE_CHUNK;
+		}
+		memcpy(obj->body + copied, chunk_data + (size_t)c * CACHE_CHUNK, n);
+		copied += n;
+	}
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&e->gen, __ATOMIC_RELAXED) != gen)
+	{
+		free(obj->body);
+		obj->body = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+int
+cache_store(const char *key, const struct stat *st,
+            const struct cache_object *obj)
+{
+	uint32_t hash, i, need, prev = NONE;
+	struct cache_entry *e;
+
+	if (hdr == NULL || strlen(key) >= CACHE_MAX_KEY ||
+	    obj->headers_len > sizeof(e->headers))
+	{
+		return -1;
+	}
+
+	/* Big objects may not take more than a quarter of the cache */
+	need = (uint32_t)((obj->body_len + CACHE_CHUNK - 1) / CACHE_CHUNK);
+	if (need > hdr->nchunks ||
+	    (obj->body_len > CACHE_MAX_OBJECT && need > hdr->nchunks / 4))
+	{
+		return -1;
+	}
+
+	hash = hash_key(key);
+	if (cache_lock() < 0)
+	{
+		return -1;
+	}
+
+	/* Replace any older version */
+	if ((i = find_entry(key, hash)) != NONE)
+	{
+		remove_entry(i);
+	}
+
+	/* Make room */
+	while ((hdr->free_entry == NONE || hdr->nfree_chunks < need) &&
+	       hdr->lru_tail != NONE)
+	{
+		remove_entry(hdr->lru_tail);
+		hdr->stats.evictions++;
+	}
+	if (hdr->free_entry == NONE || hdr->nfree_chunks < need)
+	{
+		cache_unlock();
+		return -1;
+	}
+
+	i = hdr->free_entry;
+	e = &entries[i];
+	hdr->free_entry = e->bucket_next;
+
+	{
+		uint32_t gen = e->gen;
+		memset(e, 0, sizeof(*e));
+		e->gen = gen;
+	}
+	e->in_use = 1;
+	e->hash = hash;
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->size = st->st_size;
+	e->mtime = st->st_mtim;
+	strcpy(e->key, key);
+	memcpy(e->headers, obj->headers, obj->headers_len);
+	e->headers_len = obj->headers_len;
+	memcpy(e->content_type, obj->content_type, sizeof(e->content_type));
+	memcpy(e->last_modified, obj->last_modified, sizeof(e->last_modified));
+	e->body_len = obj->body_len;
+
+	/* Take 'need' chunks off the free list and fill them */
+	e->first_chunk = NONE;
+	e->nchunks = need;
+	for (uint32_t k = 0; k < need; k++)
+	{
+		uint32_t c = hdr->free_chunk;
+		size_t off = (size_t)k * CACHE_CHUNK;
+		size_t n = obj->body_len - off;
+
+		if (n > CACHE_CHUNK)
+		{
+			n = CACHE_CHUNK;
+		}
+
+		hdr->free_chunk = chunk_next[c];
+		chunk_next[c] = NONE;
+		if (prev == NONE)
+		{
+			e->first_chunk = c;
+		}
+		else
+		{
+			chunk_next[prev] = c;
+		}
+		prev = c;
+
+		memcpy(chunk_data + (size_t)c * CACHE_CHUNK, obj->body + off, n);
+	}
+	hdr->nfree_chunks -= need;
+	hdr->stats.bytes_used += obj->body_len;
+	hdr->stats.stores++;
+
+	e->bucket_next = buckets[hash & (hdr->nbuckets - 1)];
+	buckets[hash & (hdr->nbuckets - 1)] = i;
+	e->lru_prev = e->lru_next = NONE;
+	lru_push_front(i);
+
+	cache_unlock();
+	return 0;
+}
+
+void
+cache_get_stats(struct cache_stats *out)
+{
+	if (hdr == NULL)
+	{
+		memset(out, 0, sizeof(*out));
+		return;
+	}
+
+	if (cache_lock() < 0)
+	{
+		memset(out, 0, sizeof(*out));
+		return;
+	}
+	*out = hdr->stats;
+	cache_unlock();
+}
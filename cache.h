@@ -0,0 +1,81 @@
+#pragma once
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <stddef.h>
+
+/*
+ * A bounded, LRU-evicted cache of small static files, shared by all server
+ * processes. Entries are keyed by the file's normalized filesystem path
+ * and remembered together with the (st_dev, st_ino, st_size, st_mtim) they
+ * were read with, so a single stat(2) of the file tells whether the cached
+ * copy may still be served.
+ */
+
+#define CACHE_MAX_KEY 512
+#define CACHE_MAX_HEADERS 512
+
+/* Files larger than this are always sent from disk */
+#define CACHE_MAX_OBJECT (256 * 1024)
+
+struct cache_object
+{
+	/* Pre-rendered entity headers ("Last-Modified: ...\r\n" etc.) */
+	char headers[CACHE_MAX_HEADERS];
+	size_t headers_len;
+
+	char content_type[128];
+	char last_modified[64];
+
+	/* Body; owned by the caller after a successful cache_lookup() */
+	char *body;
+	size_t body_len;
+};
+
+struct cache_stats
+{
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long stale;
+	unsigned long long stores;
+	unsigned long long evictions;
+	size_t bytes_used;
+	size_t budget;
+};
+
+/*
+ * Sets up the shared cache with room for 'budget' bytes of file data.
+ * Must be called before forking so every process shares the same region.
+ * A budget of 0 leaves the cache disabled.
+ * Returns 0 on success, -1 on error.
+ */
+int cache_init(size_t budget);
+
+/*
+ * Returns non-zero if the cache was set up.
+ */
+int cache_enabled(void);
+
+/*
+ * Looks up 'key'. If the entry was stored for the same file version as
+ * described by 'st', fills obj with a copy (obj->body is malloc'd and must
+ * be freed by the caller) and returns 0. Otherwise returns -1.
+ */
+int cache_lookup(const char *key, const struct stat *st,
+                 struct cache_object *obj);
+
+/*
+ * Stores obj (including obj->body) under 'key' for the file version 'st',
+ * evicting least recently used entries as needed. Objects larger than
+ * CACHE_MAX_OBJECT (such as big directory listings) are only stored if
+ * they take up at most a quarter of the cache.
+ * Returns 0 on success, -1 if the object does not fit.
+ */
+int cache_store(const char *key, const struct stat *st,
+                const struct cache_object *obj);
+
+/*
+ * Copies the current counters into out.
+ */
+void cache_get_stats(struct cache_stats *out);
@@ -4,12 +4,36 @@
 
 #include <errno.h>
 #include <limits.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
 
-static int
+#include "io.h"
+#include "metrics.h"
+#include "outbuf.h"
+
+/* Longest header block a script may emit before its body */
+#define CGI_MAX_HEADERS 8192
+
+/* Bytes read from the script per chunk when relaying chunked output */
+#define CGI_CHUNK 16384
+
+struct cgi_headers
+{
+	int status;
+	char status_text[64];
+	char content_type[128];
+	long long content_length; /* -1 if the script didn't say */
+
+	/* Other script headers, passed through to the client */
+	char extra[CGI_MAX_HEADERS];
+	size_t extra_len;
+};
+
+int
 cgi_build_script_path(const struct http_request *req, const char *cgi_dir,
                       char *script_path, size_t script_path_len,
                       char *script_name, size_t script_name_len,
@@ -70,9 +94,432 @@ cgi_build_script_path(const struct http_request *req, const char *cgi_dir,
 	return 0;
 }
 
+/*
+ * Fills 'buf' from src until it holds the end of the script's header
+ * block, the buffer is full or the script's output ends.
+ * Returns the number of bytes read, or -1 on error. *header_end is set to
+ * the offset of the first body byte, or 0 if no header block was found;
+ * *eof is set if the script closed its output.
+ */
+static ssize_t
+read_cgi_headers(const struct cgi_source *src, char *buf, size_t bufsz,
+                 size_t *header_end, int *eof)
+{
+	size_t len = 0;
+
+	*header_end = 0;
+	*eof = 0;
+
+	while (len < bufsz)
+	{
+		ssize_t n = src->read(src->ctx, buf + len, bufsz - len);
+		if (n < 0)
+		{
+			return -1;
+		}
+		if (n == 0)
+		{
+			*eof = 1;
+			break;
+		}
+
+		/* Rescan from slightly before the new data for \r\n\r\n or \n\n */
+		for (size_t i = len > 3 ? len - 3 : 0; i + 1 < len + (size_t)n; i++)
+		{
+			if (buf[i] != '\n')
+			{
+				continue;
+			}
+			if (buf[i + 1] == '\n')
+			{
+				*header_end = i + 2;
+			}
+			else if (buf[i + 1] == '\r' && i + 2 < len + (size_t)n &&
+			         buf[i + 2] == '\n')
+			{
+				*header_end = i + 3;
+			}
+			if (*header_end)
+			{
+				break;
+			}
+		}
+		len += (size_t)n;
+		if (*header_end)
+		{
+			break;
+		}
+	}
+	return (ssize_t)len;
+}
+
+/*
+ * Parses the script's header block ("Name: value" lines, LF or CRLF
+ * terminated). Content-Type, Status, Location and Content-Length are
+ * interpreted; other headers are kept for the client, except those
+ * describing the connection, which are ours to set.
+ */
+static void
+parse_cgi_headers(char *hdr, size_t len, struct cgi_headers *h)
+{
+	char *saveptr = NULL;
+	char *line;
+	int have_status = 0;
+	int have_location = 0;
+
+	h->status = HTTP_STATUS_OK;
+	strcpy(h->status_text, "OK");
+	strcpy(h->content_type, "text/plain");
+	h->content_length = -1;
+	h->extra_len = 0;
+
+	hdr[len] = '\0';
+	for (line = strtok_r(hdr, "\r\n", &saveptr); line != NULL;
+	     line = strtok_r(NULL, "\r\n", &saveptr))
+	{
+		char *val = strchr(line, ':');
+		size_t name_len;
+
+		if (val == NULL)
+		{
+			continue;
+		}
+		name_len = (size_t)(val - line);
+		for (val++; *val == ' ' || *val == '\t'; val++)
+			;
+
+#define IS_HEADER(name)                                                       \
+	(name_len == sizeof(name) - 1 && strncasecmp(line, name, name_len) == 0)
+
+		if (IS_HEADER("Content-Type"))
+		{
+			if (*val != '\0')
+			{
+				strncpy(h->content_type, val, sizeof(h->content_type) - 1);
+				h->content_type[sizeof(h->content_type) - 1] = '\0';
+			}
+			continue;
+		}
+		if (IS_HEADER("Status"))
+		{
+			char *end;
+			long code = strtol(val, &end, 10);
+
+			if (code >= 100 && code <= 999)
+			{
+				while (*end == ' ')
+				{
+					end++;
+				}
+				h->status = (int)code;
+				strncpy(h->status_text, *end ? end : "Unknown",
+				        sizeof(h->status_text) - 1);
+				h->status_text[sizeof(h->status_text) - 1] = '\0';
+				have_status = 1;
+			}
+			continue;
+		}
+		if (IS_HEADER("Content-Length"))
+		{
+			char *end;
+			long long cl = strtoll(val, &end, 10);
+
+			if (end != val && *end == '\0' && cl >= 0)
+			{
+				h->content_length = cl;
+			}
+			continue;
+		}
+		if (IS_HEADER("Connection") || IS_HEADER("Keep-Alive") ||
+		    IS_HEADER("Transfer-Encoding") || IS_HEADER("Date") ||
+		    IS_HEADER("Server"))
+		{
+			continue;
+		}
+		if (IS_HEADER("Location"))
+		{
+			have_location = 1;
+		}
+
+#undef IS_HEADER
+
+		/* Pass through anything else that fits */
+		{
+			int n = snprintf(h->extra + h->extra_len,
+			                 sizeof(h->extra) - h->extra_len, "%s\r\n", line);
+			if (n > 0 && (size_t)n < sizeof(h->extra) - h->extra_len)
+			{
+				h->extra_len += (size_t)n;
+			}
+		}
+	}
+
+	/* A bare Location is a redirect (RFC 3875, 6.2.3) */
+	if (have_location && !have_status)
+	{
+		h->status = HTTP_STATUS_MOVED_TEMPORARILY;
+		strcpy(h->status_text, "Found");
+	}
+}
+
+/*
+ * Queues data for the client. The buffer only references it: 'out' is
+ * blocking, and sink_flush() sends it before the memory is reused.
+ */
+static int
+sink_add(struct outbuf *out, const void *buf, size_t len)
+{
+	return outbuf_ref(out, buf, len);
+}
+
+/* Returns 0 on success, -1 on error (the queued data is dropped) */
+static int
+sink_flush(struct outbuf *out)
+{
+	if (outbuf_send(out) == 1)
+	{
+		return 0;
+	}
+	outbuf_reset(out);
+	return -1;
+}
+
+static int
+sink_write(struct outbuf *out, const void *buf, size_t len)
+{
+	return sink_add(out, buf, len) < 0 ? -1 : sink_flush(out);
+}
+
+/*
+ * Sends body data with chunked transfer coding: the 'pre' bytes already
+ * read, then everything else the script writes.
+ * Returns the number of body bytes sent, or -1 on error.
+ */
+static long long
+relay_chunked(struct outbuf *out, const struct cgi_source *src,
+              const char *pre, size_t pre_len)
+{
+	char buf[CGI_CHUNK + 32];
+	long long total = 0;
+	ssize_t n;
+
+	if (pre_len > 0)
+	{
+		char size_line[32];
+		int k = snprintf(size_line, sizeof(size_line), "%zx\r\n", pre_len);
+
+		if (sink_add(out, size_line, (size_t)k) < 0 ||
+		    sink_add(out, pre, pre_len) < 0 || sink_add(out, "\r\n", 2) < 0 ||
+		    sink_flush(out) < 0)
+		{
+			return -1;
+		}
+		total += (long long)pre_len;
+	}
+
+	/* Leave room in front of the data for the chunk size line */
+	for (;;)
+	{
+		char *data = buf + 16;
+		char size_line[16];
+		int k;
+
+		if ((n = src->read(src->ctx, data, CGI_CHUNK)) < 0)
+		{
+			return -1;
+		}
+		if (n == 0)
+		{
+			break;
+		}
+
+		k = snprintf(size_line, sizeof(size_line), "%zx\r\n", (size_t)n);
+		memcpy(data - k, size_line, (size_t)k);
+		memcpy(data + n, "\r\n", 2);
+		if (sink_write(out, data - k, (size_t)k + (size_t)n + 2) < 0)
+		{
+			return -1;
+		}
+		total += n;
+	}
+
+	if (sink_write(out, "0\r\n\r\n", 5) < 0)
+	{
+		return -1;
+	}
+	return total;
+}
+
+/*
+ * Copies the rest of the body (up to 'limit' bytes; limit < 0: all of it).
+ * Pipes are spliced straight to the socket where possible.
+ * Returns the number of bytes copied, or -1 on error.
+ */
+static long long
+relay_raw(struct outbuf *out, const struct cgi_source *src, long long limit)
+{
+	char buf[CGI_CHUNK];
+	long long total = 0;
+
+	if (src->pipe_fd >= 0)
+	{
+		/* Whatever is queued must go first */
+		if (sink_flush(out) < 0)
+		{
+			return -1;
+		}
+		return relay_pipe(out->fd, src->pipe_fd, limit);
+	}
+
+	while (limit < 0 || total < limit)
+	{
+		size_t want = sizeof(buf);
+		ssize_t n;
+
+		if (limit >= 0 && (long long)want > limit - total)
+		{
+			want = (size_t)(limit - total);
+		}
+		if ((n = src->read(src->ctx, buf, want)) < 0)
+		{
+			return -1;
+		}
+		if (n == 0)
+		{
+			break;
+		}
+		if (sink_write(out, buf, (size_t)n) < 0)
+		{
+			return -1;
+		}
+		total += n;
+	}
+	return total;
+}
+
+int
+cgi_relay(struct outbuf *out, const struct cgi_source *src,
+          const struct http_request *req, int is_head,
+          struct http_response *resp)
+{
+	char buf[CGI_MAX_HEADERS + 1];
+	char hdr[CGI_MAX_HEADERS + 1];
+	char entity[CGI_MAX_HEADERS + 256];
+	struct cgi_headers h;
+	size_t header_end, entity_len, body_len;
+	const char *body;
+	ssize_t len;
+	int eof, chunked = 0;
+	long long sent;
+
+	len = read_cgi_headers(src, buf, CGI_MAX_HEADERS, &header_end, &eof);
+	if (len <= 0)
+	{
+		return -1;
+	}
+
+	/* Parse a copy; the buffer still holds the start of the body */
+	memcpy(hdr, buf, header_end);
+	parse_cgi_headers(hdr, header_end, &h);
+	body = buf + header_end;
+	body_len = (size_t)len - header_end;
+
+	if (h.content_length < 0 && eof)
+	{
+		h.content_length = (long long)body_len;
+	}
+
+	if (h.content_length >= 0)
+	{
+		entity_len = (size_t)snprintf(entity, sizeof(entity),
+		                              "Content-Length: %lld\r\n"
+		                              "Content-Type: %s\r\n",
+		                              h.content_length, h.content_type);
+	}
+	else if (strcmp(req->version, "HTTP/1.1") == 0)
+	{
+		chunked = 1;
+		entity_len = (size_t)snprintf(entity, sizeof(entity),
+		                              "Transfer-Encoding: chunked\r\n"
+		                              "Content-Type: %s\r\n",
+		                              h.content_type);
+	}
+	else
+	{
+		/* Length unknown and no chunking: the end of data is EOF */
+		resp->keep_alive = 0;
+		entity_len = (size_t)snprintf(entity, sizeof(entity),
+		                              "Content-Type: %s\r\n", h.content_type);
+	}
+	if (entity_len + h.extra_len < sizeof(entity))
+	{
+		memcpy(entity + entity_len, h.extra, h.extra_len);
+		entity_len += h.extra_len;
+	}
+
+	write_http_head(out, (enum HTTP_STATUS_CODE)h.status, h.status_text,
+	                entity, entity_len, resp);
+	resp->status_code = h.status;
+	resp->content_len = 0;
+
+	/* The head stays queued, to leave together with the first data */
+	if (is_head)
+	{
+		return 0;
+	}
+
+	if (chunked)
+	{
+		sent = relay_chunked(out, src, body, body_len);
+	}
+	else
+	{
+		long long limit = h.content_length;
+
+		if (limit >= 0 && (long long)body_len > limit)
+		{
+			body_len = (size_t)limit;
+		}
+		sent = -1;
+		if (sink_write(out, body, body_len) == 0)
+		{
+			sent = (long long)body_len;
+			if (limit < 0 || sent < limit)
+			{
+				long long n =
+					relay_raw(out, src, limit < 0 ? -1 : limit - sent);
+				sent = n < 0 ? -1 : sent + n;
+			}
+		}
+		if (limit >= 0 && sent != limit)
+		{
+			/* Short body: the client can't tell where it ends */
+			resp->keep_alive = 0;
+		}
+	}
+
+	if (sent < 0)
+	{
+		resp->keep_alive = 0;
+		return 0;
+	}
+	resp->content_len = (size_t)sent;
+	return 0;
+}
+
+static ssize_t
+pipe_read(void *ctx, void *buf, size_t len)
+{
+	ssize_t n;
+
+	while ((n = read(*(int *)ctx, buf, len)) < 0 && errno == EINTR)
+		;
+	return n;
+}
+
 int
-cgi_handle(FILE *stream, const struct http_request *req, const char *cgi_dir,
-           int is_head, struct http_response *resp)
+cgi_handle(struct outbuf *out, const struct http_request *req,
+           const char *cgi_dir, int is_head, struct http_response *resp)
 {
 	char script_path[PATH_MAX];
 	char script_name[PATH_MAX];
@@ -80,6 +527,8 @@ cgi_handle(FILE *stream, const struct http_request *req, const char *cgi_dir,
 	pid_t pid;
 	int status;
 	int pfd[2];
+	int ret;
+	struct cgi_source src;
 
 	if (cgi_build_script_path(req, cgi_dir, script_path, sizeof(script_path),
 	                          script_name, sizeof(script_name),
@@ -128,7 +577,7 @@ cgi_handle(FILE *stream, const struct http_request *req, const char *cgi_dir,
 		{
 			_exit(1);
 		}
-		if (setenv("SERVER_PROTOCOL", "HTTP/1.0", 1) == -1)
+		if (setenv("SERVER_PROTOCOL", req->version, 1) == -1)
 		{
 			_exit(1);
 		}
@@ -142,169 +591,28 @@ cgi_handle(FILE *stream, const struct http_request *req, const char *cgi_dir,
 		}
 		/* REMOTE_ADDR etc. are optional; server.c may have already set them */
 
+		/* The server ignores SIGPIPE, which exec() would pass on */
+		(void)signal(SIGPIPE, SIG_DFL);
+
 		execl(script_path, script_path, (char *)NULL);
 
 		/* If we reach here, execl failed */
 		_exit(127);
 	}
 
-	/* ---- Parent: read CGI output and wrap it in HTTP/1.0 ---- */
+	/* ---- Parent: relay CGI output as it is produced ---- */
+	metrics_cgi_spawn();
 
 	close(pfd[1]); /* parent only reads */
 
-	char tmp[4096];
-	char *buf = NULL;
-	size_t buf_len = 0, buf_cap = 0;
-	ssize_t n;
-
-	while ((n = read(pfd[0], tmp, sizeof(tmp))) > 0)
-	{
-		if (buf_len + (size_t)n > buf_cap)
-		{
-			size_t newcap = buf_cap ? buf_cap * 2 : 8192;
-			while (newcap < buf_len + (size_t)n)
-			{
-				newcap *= 2;
-			}
-			char *nb = realloc(buf, newcap);
-			if (!nb)
-			{
-				free(buf);
-				close(pfd[0]);
-				(void)waitpid(pid, &status, 0);
-				return -1;
-			}
-			buf = nb;
-			buf_cap = newcap;
-		}
-		memcpy(buf + buf_len, tmp, (size_t)n);
-		buf_len += (size_t)n;
-	}
+	src.read = pipe_read;
+	src.ctx = &pfd[0];
+	src.pipe_fd = pfd[0];
+	ret = cgi_relay(out, &src, req, is_head, resp);
 	close(pfd[0]);
 
 	/* Avoid zombies */
 	(void)waitpid(pid, &status, 0);
 
-	if (!buf || buf_len == 0)
-	{
-		free(buf);
-		return -1;
-	}
-
-	/* Find header/body separator: try \r\n\r\n, then \n\n */
-	size_t header_end = 0;
-	for (size_t i = 0; i + 3 < buf_len; i++)
-	{
-		if (buf[i] == '\r' && buf[i + 1] == '\n' && buf[i + 2] == '\r' &&
-		    buf[i + 3] == '\n')
-		{
-			header_end = i + 4;
-			break;
-		}
-	}
-	if (header_end == 0)
-	{
-		for (size_t i = 0; i + 1 < buf_len; i++)
-		{
-			if (buf[i] == '\n' && buf[i + 1] == '\n')
-			{
-				header_end = i + 2;
-				break;
-			}
-		}
-	}
-
-	const char *content_type = "text/plain";
-	char ctype_buf[128];
-	int have_ctype = 0;
-	char *body = NULL;
-	size_t body_len = 0;
-
-	if (header_end > 0)
-	{
-		/* Parse CGI headers in [0, header_end) */
-		size_t hdr_len = header_end;
-		char *hdr = malloc(hdr_len + 1);
-		if (!hdr)
-		{
-			free(buf);
-			return -1;
-		}
-		memcpy(hdr, buf, hdr_len);
-		hdr[hdr_len] = '\0';
-
-		/* Normalize CRLF to LF */
-		for (char *p = hdr; *p; p++)
-		{
-			if (*p == '\r')
-			{
-				*p = '\n';
-			}
-		}
-
-		char *saveptr = NULL;
-		char *line = strtok_r(hdr, "\n", &saveptr);
-		while (line)
-		{
-			while (*line == ' ' || *line == '\t')
-			{
-				line++;
-			}
-			if (*line == '\0')
-			{
-				/* blank line => end of headers */
-				break;
-			}
-			if (strncasecmp(line, "Content-Type:", 13) == 0)
-			{
-				char *val = line + 13;
-				while (*val == ' ' || *val == '\t')
-				{
-					val++;
-				}
-				if (*val != '\0')
-				{
-					strncpy(ctype_buf, val, sizeof(ctype_buf) - 1);
-					ctype_buf[sizeof(ctype_buf) - 1] = '\0';
-					have_ctype = 1;
-				}
-			}
-			line = strtok_r(NULL, "\n", &saveptr);
-		}
-		free(hdr);
-
-		content_type = have_ctype ? ctype_buf : "text/plain";
-
-		body_len = buf_len - header_end;
-		body = malloc(body_len + 1);
-		if (!body)
-		{
-			free(buf);
-			return -1;
-		}
-		memcpy(body, buf + header_end, body_len);
-		body[body_len] = '\0';
-		free(buf);
-	}
-	else
-	{
-		/* No headers at all: whole output is body */
-		body_len = buf_len;
-		body = malloc(body_len + 1);
-		if (!body)
-		{
-			free(buf);
-			return -1;
-		}
-		memcpy(body, buf, body_len);
-		body[body_len] = '\0';
-		free(buf);
-	}
-
-	/* Wrap in a proper HTTP/1.0 response */
-	craft_http_response(stream, HTTP_STATUS_OK, "OK", body, content_type, NULL,
-	                    is_head, resp);
-
-	free(body);
-	return 0;
-}
\ No newline at end of file
+	return ret;
+}
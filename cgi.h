@@ -1,14 +1,14 @@
 #pragma once
 
-#include <stdio.h>
+#include <sys/types.h>
 
 #include "http.h"
 
 /*
  * Execute a CGI script for the given request and wrap its output
- * in a proper HTTP/1.0 response.
+ * in a proper HTTP response.
  *
- * stream   - stdio wrapper around client_fd
+ * out      - output buffer for the client connection
  * req      - parsed HTTP request
  * cgi_dir  - directory passed via -c where CGI binaries/scripts live
  * is_head  - non-zero if this was a HEAD request
@@ -16,5 +16,40 @@
  *
  * Returns 0 on success, -1 on error.
  */
-int cgi_handle(FILE *stream, const struct http_request *req,
+int cgi_handle(struct outbuf *out, const struct http_request *req,
                const char *cgi_dir, int is_head, struct http_response *resp);
+
+/* Where a script's CGI-style output (headers, blank line, body) comes from */
+struct cgi_source
+{
+	/* Like read(2): returns bytes read, 0 at the end, -1 on error */
+	ssize_t (*read)(void *ctx, void *buf, size_t len);
+	void *ctx;
+
+	/* A plain pipe the output may be spliced from, or -1 */
+	int pipe_fd;
+};
+
+/*
+ * Reads a script's output from src and relays it to the client, keeping
+ * at most one header block and one chunk in memory. 'out' must be
+ * blocking: the output is sent as it arrives.
+ * The body is framed by the script's own Content-Length if it gave one,
+ * by its total length if it finished within the first read, with chunked
+ * coding for HTTP/1.1 clients, and by closing the connection otherwise.
+ * Returns -1 if nothing was sent, so the caller can answer with an error;
+ * once the head is out, failures only end the connection.
+ */
+int cgi_relay(struct outbuf *out, const struct cgi_source *src,
+              const struct http_request *req, int is_head,
+              struct http_response *resp);
+
+/*
+ * Maps a /cgi-bin/ request to the script's path under cgi_dir, its
+ * SCRIPT_NAME and query string (pointing into req->path).
+ * Returns -1 if the request is not for a CGI script, 0 on success.
+ */
+int cgi_build_script_path(const struct http_request *req, const char *cgi_dir,
+                          char *script_path, size_t script_path_len,
+                          char *script_name, size_t script_name_len,
+                          const char **query_string_out);
@@ -0,0 +1,328 @@
+#include "encoding.h"
+
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "fdcache.h"
+#include "io.h"
+#include "mime.h"
+
+/* Directories nftw(3) keeps open while walking the tree */
+#define ENC_WALK_FDS 16
+
+/* Bytes read and compressed at a time when building .gz sidecars */
+#define ENC_GZIP_CHUNK 16384
+
+struct coding
+{
+	int bit;
+	const char *name;   /* for Content-Encoding */
+	const char *suffix; /* of the sidecar file */
+};
+
+/* In order of preference: smallest output first */
+static const struct coding codings[] = {
+	{ENC_BR, "br", ".br"},
+	{ENC_ZSTD, "zstd", ".zst"},
+	{ENC_GZIP, "gzip", ".gz"},
+};
+
+#define NCODINGS (sizeof(codings) / sizeof(codings[0]))
+
+/* Sidecars written by the current encoding_build_sidecars() walk */
+static int built = 0;
+
+static int
+coding_bit(const char *tok, size_t len)
+{
+	if (len == 1 && tok[0] == '*')
+	{
+		return -1;
+	}
+	if (len == 6 && strncasecmp(tok, "x-gzip", 6) == 0)
+	{
+		return ENC_GZIP;
+	}
+	for (size_t i = 0; i < NCODINGS; i++)
+	{
+		if (strlen(codings[i].name) == len &&
+		    strncasecmp(tok, codings[i].name, len) == 0)
+		{
+			return codings[i].bit;
+		}
+	}
+	return 0;
+}
+
+/* Returns non-zero unless the parameters say "q=0" (or 0.0, 0.00...) */
+static int
+q_nonzero(const char *p, const char *end)
+{
+	while (p < end)
+	{
+		while (p < end && (*p == ';' || *p == ' ' || *p == '\t'))
+		{
+			p++;
+		}
+		if (end - p >= 2 && (p[0] == 'q' || p[0] == 'Q') && p[1] == '=')
+		{
+			for (p += 2; p < end && *p != ';'; p++)
+			{
+				if (*p >= '1' && *p <= '9')
+				{
+					return 1;
+				}
+			}
+			return 0;
+		}
+		while (p < end && *p != ';')
+		{
+			p++;
+		}
+	}
+	return 1;
+}
+
+int
+encoding_parse_accept(const char *value, size_t len)
+{
+	const char *p = value;
+	const char *end = value + len;
+	int accept = 0, listed = 0, star = 0;
+
+	while (p < end)
+	{
+		const char *tok, *elem_end;
+		size_t tok_len;
+		int bit;
+
+		while (p < end && (*p == ',' || *p == ' ' || *p == '\t'))
+		{
+			p++;
+		}
+		for (tok = p; p < end && *p != ',' && *p != ';' && *p != ' ' &&
+		              *p != '\t';
+		     p++)
+			;
+		tok_len = (size_t)(p - tok);
+		for (elem_end = p; elem_end < end && *elem_end != ','; elem_end++)
+			;
+
+		if (tok_len > 0 && (bit = coding_bit(tok, tok_len)) != 0)
+		{
+			int ok = q_nonzero(p, elem_end);
+
+			if (bit < 0)
+			{
+				star = ok ? 1 : -1;
+			}
+			else
+			{
+				listed |= bit;
+				accept |= ok ? bit : 0;
+			}
+		}
+		p = elem_end;
+	}
+
+	/* "*" stands for every coding not named on its own */
+	if (star > 0)
+	{
+		accept |= (ENC_BR | ENC_ZSTD | ENC_GZIP) & ~listed;
+	}
+	return accept;
+}
+
+const char *
+encoding_sidecar(int rootfd, const char *path, const char *rel,
+                 const struct stat *st, int accept, char *sidecar,
+                 size_t sidecar_len, int *sidecar_fd, struct stat *sidecar_st)
+{
+	size_t skip = (size_t)(rel - path);
+
+	for (size_t i = 0; i < NCODINGS; i++)
+	{
+		int fd, is_index;
+
+		if (!(accept & codings[i].bit))
+		{
+			continue;
+		}
+		if (snprintf(sidecar, sidecar_len, "%s%s", path,
+		             codings[i].suffix) >= (int)sidecar_len)
+		{
+			continue;
+		}
+		fd = fdcache_open(rootfd, sidecar, sidecar + skip, 0, sidecar_st,
+		                  &is_index);
+		if (fd < 0)
+		{
+			continue;
+		}
+		/* A stale sidecar would serve outdated content */
+		if (S_ISREG(sidecar_st->st_mode) &&
+		    sidecar_st->st_mtime >= st->st_mtime)
+		{
+			*sidecar_fd = fd;
+			return codings[i].name;
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+static int
+has_sidecar_suffix(const char *path)
+{
+	size_t len = strlen(path);
+
+	for (size_t i = 0; i < NCODINGS; i++)
+	{
+		size_t n = strlen(codings[i].suffix);
+		if (len > n && strcmp(path + len - n, codings[i].suffix) == 0)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Compresses in_fd into out_fd in gzip format.
+ * Returns the compressed size, or -1 on error.
+ */
+static long long
+gzip_file(int in_fd, int out_fd)
+{
+	unsigned char in[ENC_GZIP_CHUNK], out[ENC_GZIP_CHUNK];
+	long long total = 0;
+	z_stream zs;
+	int flush, rc = Z_OK;
+
+	memset(&zs, 0, sizeof(zs));
+	/* 15 bits of window, +16 for the gzip wrapper */
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+	                 Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		return -1;
+	}
+
+	do
+	{
+		ssize_t n = read(in_fd, in, sizeof(in));
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			total = -1;
+			break;
+		}
+		flush = n == 0 ? Z_FINISH : Z_NO_FLUSH;
+		zs.next_in = in;
+		zs.avail_in = (uInt)n;
+
+		do
+		{
+			size_t have;
+
+			zs.next_out = out;
+			zs.avail_out = sizeof(out);
+			rc = deflate(&zs, flush);
+			have = sizeof(out) - zs.avail_out;
+			if (rc == Z_STREAM_ERROR || write_all(out_fd, out, have) < 0)
+			{
+				total = -1;
+				break;
+			}
+			total += (long long)have;
+		} while (zs.avail_out == 0);
+	} while (total >= 0 && flush != Z_FINISH);
+
+	(void)deflateEnd(&zs);
+	return total >= 0 && rc == Z_STREAM_END ? total : -1;
+}
+
+/* Writes path.gz through a temporary file, unless it doesn't pay off */
+static void
+build_gzip(const char *path, const struct stat *st)
+{
+	char gz[PATH_MAX], tmp[PATH_MAX];
+	struct stat gz_st;
+	struct timespec times[2];
+	long long size;
+	int in_fd, out_fd, failed;
+
+	if (snprintf(gz, sizeof(gz), "%s.gz", path) >= (int)sizeof(gz) ||
+	    snprintf(tmp, sizeof(tmp), "%s.gz.XXXXXX", path) >= (int)sizeof(tmp))
+	{
+		return;
+	}
+	if (stat(gz, &gz_st) == 0 && gz_st.st_mtime >= st->st_mtime)
+	{
+		return;
+	}
+
+	if ((in_fd = open(path, O_RDONLY)) < 0)
+	{
+		return;
+	}
+	if ((out_fd = mkstemp(tmp)) < 0)
+	{
+		close(in_fd);
+		return;
+	}
+
+	size = gzip_file(in_fd, out_fd);
+	close(in_fd);
+
+	/* Same mtime as the original, so both have one Last-Modified */
+	times[0] = st->st_atim;
+	times[1] = st->st_mtim;
+	failed = size < 0 || size >= (long long)st->st_size ||
+	         fchmod(out_fd, st->st_mode & 0644) < 0 ||
+	         futimens(out_fd, times) < 0;
+	if (close(out_fd) < 0 || failed || rename(tmp, gz) < 0)
+	{
+		(void)unlink(tmp);
+		return;
+	}
+	built++;
+}
+
+static int
+visit(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	(void)ftw;
+
+	if (type == FTW_F && S_ISREG(st->st_mode) && st->st_size >= ENC_MIN_SIZE &&
+	    !has_sidecar_suffix(path) && mime_compressible(mime_type(path, st)))
+	{
+		build_gzip(path, st);
+	}
+	return 0;
+}
+
+int
+encoding_build_sidecars(const char *root)
+{
+	built = 0;
+	if (nftw(root, visit, ENC_WALK_FDS, FTW_PHYS) < 0)
+	{
+		return -1;
+	}
+	return built;
+}
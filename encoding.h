@@ -0,0 +1,45 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <stddef.h>
+
+/*
+ * Content codings of precompressed sidecar files: "foo.js" may be served
+ * as "foo.js.br", "foo.js.zst" or "foo.js.gz" to clients that accept the
+ * coding, as long as the sidecar is at least as new as the original.
+ */
+#define ENC_BR 0x1
+#define ENC_ZSTD 0x2
+#define ENC_GZIP 0x4
+
+/* Files smaller than this aren't worth precompressing */
+#define ENC_MIN_SIZE 256
+
+/*
+ * Parses an Accept-Encoding header value.
+ * Returns the ENC_* codings the client accepts (q > 0).
+ */
+int encoding_parse_accept(const char *value, size_t len);
+
+/*
+ * Looks for the best sidecar of the file at 'path' (described by 'st')
+ * among the codings in 'accept'. 'rel' is the tail of 'path' that names
+ * the file beneath the directory 'rootfd', through which sidecars are
+ * opened (see fdcache.h). On success the sidecar's path, open descriptor
+ * and stat are stored in sidecar, sidecar_fd and sidecar_st.
+ * Returns the coding's name ("br", "zstd" or "gzip"), or NULL if the
+ * original should be sent.
+ */
+const char *encoding_sidecar(int rootfd, const char *path, const char *rel,
+                             const struct stat *st, int accept, char *sidecar,
+                             size_t sidecar_len, int *sidecar_fd,
+                             struct stat *sidecar_st);
+
+/*
+ * Creates or refreshes the .gz sidecar of every compressible regular file
+ * under 'root' that is missing one or whose sidecar is older than the
+ * file. Other codings are served when present but never built here.
+ * Returns the number of sidecars written, or -1 if root can't be read.
+ */
+int encoding_build_sidecars(const char *root);
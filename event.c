@@ -0,0 +1,1269 @@
+#include "event.h"
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+#include <netinet/in.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fcgi.h"
+#include "http.h"
+#include "metrics.h"
+#include "outbuf.h"
+#include "parser.h"
+#include "timefmt.h"
+#include "uring.h"
+
+/* Largest request head (request line + headers) we buffer per connection */
+#define EVENT_INBUF HTTP_MAX_HEAD
+
+/* Maximum number of readiness events handled per wakeup */
+#define EVENT_BATCH 64
+
+#define EV_READ 0x1
+#define EV_WRITE 0x2
+
+enum CONN_STATE
+{
+	CONN_READING,
+	CONN_WRITING,
+};
+
+struct event_conn
+{
+	int fd;
+	enum CONN_STATE state;
+	char rip[INET6_ADDRSTRLEN];
+
+	/* Requests served so far, and when we last made progress */
+	int nreq;
+	time_t last_active;
+	int keep_alive;
+	int peer_closed;
+
+	char in[EVENT_INBUF];
+	size_t in_len;
+	struct http_parser parser; /* over 'in', resumed as data arrives */
+
+	/* metrics_clock() times: first byte of the buffered request, and when
+	   the response being written was begun and finished building */
+	long long received;
+	long long started;
+	long long ready;
+
+	/* The response being written, file body included */
+	struct outbuf out;
+
+#ifdef __linux__
+	/* io_uring: requests in flight for this connection */
+	int ops;
+	int recv_armed;
+	int failed;  /* a request failed; close once the rest are back */
+	int closing; /* close once the requests in flight are back */
+
+	/* The send in flight: 'send_head' bytes of outbuf segments followed
+	   by 'fbuf_len' bytes of file data read into 'fbuf' */
+	struct msghdr msg;
+	struct iovec msg_iov[OUTBUF_IOV + 1];
+	size_t send_head;
+	char *fbuf;
+	size_t fbuf_len;
+
+	/* Long file pieces are spliced through this pipe, which holds
+	   'pipe_fill' bytes not yet sent */
+	int pipe_fd[2];
+	size_t pipe_cap;
+	size_t pipe_fill;
+#endif
+};
+
+/* Connections indexed by file descriptor */
+static struct event_conn **conns = NULL;
+static size_t conns_cap = 0;
+
+static int listen_fd = -1;
+
+/* Completions come from io_uring(7) instead of readiness from the poller */
+static int use_uring = 0;
+
+/* ----- Readiness notification: epoll(7) or poll(2) ----- */
+
+#ifdef __linux__
+
+static int epfd = -1;
+
+static int
+poller_init(void)
+{
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	return epfd < 0 ? -1 : 0;
+}
+
+static int
+poller_ctl(int op, int fd, int events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = ((events & EV_READ) ? EPOLLIN : 0) |
+	            ((events & EV_WRITE) ? EPOLLOUT : 0);
+	ev.data.fd = fd;
+	return epoll_ctl(epfd, op, fd, &ev);
+}
+
+static int
+poller_add(int fd, int events)
+{
+	return poller_ctl(EPOLL_CTL_ADD, fd, events);
+}
+
+static int
+poller_mod(int fd, int events)
+{
+	return poller_ctl(EPOLL_CTL_MOD, fd, events);
+}
+
+static void
+poller_del(int fd)
+{
+	(void)epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/*
+ * Waits for readiness and stores up to 'max' ready descriptors (and their
+ * EV_* bits) in fds/events. Returns the number stored, or -1.
+ */
+static int
+poller_wait(int *fds, int *events, int max, int timeout_ms)
+{
+	struct epoll_event evs[EVENT_BATCH];
+	int n;
+
+	if (max > EVENT_BATCH)
+	{
+		max = EVENT_BATCH;
+	}
+
+	if ((n = epoll_wait(epfd, evs, max, timeout_ms)) < 0)
+	{
+		return -1;
+	}
+
+	for (int i = 0; i < n; i++)
+	{
+		fds[i] = evs[i].data.fd;
+		events[i] = 0;
+		if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		{
+			events[i] |= EV_READ;
+		}
+		if (evs[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+		{
+			events[i] |= EV_WRITE;
+		}
+	}
+	return n;
+}
+
+static void
+poller_close(void)
+{
+	close(epfd);
+}
+
+#else /* !__linux__ */
+
+static struct pollfd *pfds = NULL;
+static size_t npfds = 0, pfds_cap = 0;
+static size_t poll_next = 0;
+
+static int
+poller_init(void)
+{
+	return 0;
+}
+
+static short
+poll_events(int events)
+{
+	return (short)(((events & EV_READ) ? POLLIN : 0) |
+	               ((events & EV_WRITE) ? POLLOUT : 0));
+}
+
+static int
+poller_add(int fd, int events)
+{
+	if (npfds == pfds_cap)
+	{
+		size_t newcap = pfds_cap ? pfds_cap * 2 : 64;
+		struct pollfd *tmp = realloc(pfds, newcap * sizeof(*pfds));
+		if (!tmp)
+		{
+			return -1;
+		}
+		pfds = tmp;
+		pfds_cap = newcap;
+	}
+	pfds[npfds].fd = fd;
+	pfds[npfds].events = poll_events(events);
+	pfds[npfds].revents = 0;
+	npfds++;
+	return 0;
+}
+
+static int
+poller_mod(int fd, int events)
+{
+	for (size_t i = 0; i < npfds; i++)
+	{
+		if (pfds[i].fd == fd)
+		{
+			pfds[i].events = poll_events(events);
+			return 0;
+		}
+	}
+	errno = ENOENT;
+	return -1;
+}
+
+static void
+poller_del(int fd)
+{
+	for (size_t i = 0; i < npfds; i++)
+	{
+		if (pfds[i].fd == fd)
+		{
+			pfds[i] = pfds[--npfds];
+			return;
+		}
+	}
+}
+
+static int
+poller_wait(int *fds, int *events, int max, int timeout_ms)
+{
+	int n, found = 0;
+
+	if ((n = poll(pfds, (nfds_t)npfds, timeout_ms)) < 0)
+	{
+		return -1;
+	}
+
+	/* Rotate the scan start so busy descriptors can't starve the rest */
+	for (size_t k = 0; k < npfds && n > 0 && found < max; k++)
+	{
+		size_t i = (poll_next + k) % npfds;
+		short re = pfds[i].revents;
+
+		if (re == 0)
+		{
+			continue;
+		}
+		n--;
+		fds[found] = pfds[i].fd;
+		events[found] = 0;
+		if (re & (POLLIN | POLLHUP | POLLERR))
+		{
+			events[found] |= EV_READ;
+		}
+		if (re & (POLLOUT | POLLHUP | POLLERR))
+		{
+			events[found] |= EV_WRITE;
+		}
+		found++;
+	}
+	poll_next = npfds ? (poll_next + 1) % npfds : 0;
+	return found;
+}
+
+static void
+poller_close(void)
+{
+	free(pfds);
+	pfds = NULL;
+	npfds = pfds_cap = 0;
+}
+
+#endif /* __linux__ */
+
+/* ----- Connection bookkeeping ----- */
+
+static int
+set_nonblocking(int fd, int on)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0)
+	{
+		return -1;
+	}
+	flags = on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+	return fcntl(fd, F_SETFL, flags);
+}
+
+static struct event_conn *
+conn_new(int fd, const struct sockaddr_storage *client)
+{
+	struct event_conn *c;
+	char addrbuf[INET6_ADDRSTRLEN];
+
+	if ((size_t)fd >= conns_cap)
+	{
+		size_t newcap = conns_cap ? conns_cap : 256;
+		while (newcap <= (size_t)fd)
+		{
+			newcap *= 2;
+		}
+		struct event_conn **tmp = realloc(conns, newcap * sizeof(*conns));
+		if (!tmp)
+		{
+			return NULL;
+		}
+		memset(tmp + conns_cap, 0, (newcap - conns_cap) * sizeof(*conns));
+		conns = tmp;
+		conns_cap = newcap;
+	}
+
+	if ((c = calloc(1, sizeof(*c))) == NULL)
+	{
+		return NULL;
+	}
+	c->fd = fd;
+#ifdef __linux__
+	c->pipe_fd[0] = c->pipe_fd[1] = -1;
+#endif
+	outbuf_init(&c->out, fd, 0);
+	c->state = CONN_READING;
+	c->last_active = timefmt_now();
+	strncpy(c->rip, clientAddress(client, addrbuf, sizeof(addrbuf)),
+	        sizeof(c->rip) - 1);
+	conns[fd] = c;
+	metrics_connection_opened();
+	return c;
+}
+
+/*
+ * Forgets the connection and closes our descriptor. A CGI child may still
+ * hold its own copy of the descriptor.
+ */
+static void
+conn_free(struct event_conn *c)
+{
+	if (!use_uring)
+	{
+		poller_del(c->fd);
+	}
+	conns[c->fd] = NULL;
+	close(c->fd);
+	outbuf_reset(&c->out);
+#ifdef __linux__
+	if (c->pipe_fd[0] >= 0)
+	{
+		close(c->pipe_fd[0]);
+		close(c->pipe_fd[1]);
+	}
+	free(c->fbuf);
+#endif
+	free(c);
+	metrics_connection_closed();
+}
+
+/*
+ * Closes the connection. With io_uring, requests in flight still refer to
+ * it: they are cut short and the connection is freed once they are back.
+ */
+static void
+conn_drop(struct event_conn *c)
+{
+#ifdef __linux__
+	if (c->ops > 0)
+	{
+		if (!c->closing)
+		{
+			c->closing = 1;
+			(void)shutdown(c->fd, SHUT_RDWR);
+		}
+		return;
+	}
+#endif
+	conn_free(c);
+}
+
+/*
+ * Returns non-zero once the first buffered request can be answered: its
+ * head is complete or malformed, or it filled the buffer without ending
+ * (then it gets rejected). The parser picks up where the previous read
+ * left off, so each byte is scanned only once.
+ */
+static int
+request_complete(struct event_conn *c)
+{
+	return http_parser_feed(&c->parser, c->in, c->in_len) != 0 ||
+	       c->in_len == sizeof(c->in);
+}
+
+/*
+ * Handles a CGI request, or one for a FastCGI responder, in a forked
+ * child, where the script is allowed to block. The child talks to the
+ * client over a blocking socket, just like the forking server does.
+ * Returns 0 once the request was handed off, or -1 if no child could be
+ * forked; then a 500 response is built in c->out (described by 'resp')
+ * and the connection closes after it.
+ */
+static int
+conn_fork_cgi(struct event_conn *c, struct server_config *config,
+              struct http_request *req, struct http_response *resp)
+{
+	pid_t pid;
+
+	if ((pid = fork()) < 0)
+	{
+		const char *body = "500 Internal Server Error\n";
+
+		perror("fork");
+		memset(resp, 0, sizeof(*resp));
+		craft_http_response(&c->out, HTTP_STATUS_INTERNAL_SERVER_ERROR,
+		                    "Internal Server Error", body, "text/plain", NULL,
+		                    strcmp(req->method, "HEAD") == 0, resp);
+		return -1;
+	}
+
+	if (pid == 0)
+	{
+		/* Drop everything that belongs to the event loop */
+		for (size_t i = 0; i < conns_cap; i++)
+		{
+			if (conns[i] && conns[i] != c)
+			{
+				close(conns[i]->fd);
+			}
+		}
+		close(listen_fd);
+		poller_close();
+#ifdef __linux__
+		if (use_uring)
+		{
+			uring_close();
+		}
+#endif
+
+		/* SIGPIPE stays ignored, so an aborted response is still logged */
+		(void)set_nonblocking(c->fd, 0);
+		setRequestEnvironment(c->rip, config);
+
+		/* The child answers this one request, then the connection ends */
+		req->keep_alive = 0;
+
+		outbuf_init(&c->out, c->fd, 1);
+		(void)respond_http_request(&c->out, config, HTTP_PARSE_OK, req,
+		                           resp);
+		(void)outbuf_send(&c->out);
+		metrics_response(resp);
+		logRequest(config, c->rip, req, resp);
+
+		exit(EXIT_SUCCESS);
+	}
+	return 0;
+}
+
+/*
+ * Parses the first buffered request, removes it from the input buffer and
+ * builds the complete response in c->out. Returns 0 if the response is
+ * ready to be written, -1 if the connection was handed off or should be
+ * dropped.
+ */
+static int
+conn_respond(struct event_conn *c, struct server_config *config)
+{
+	struct http_request req;
+	struct http_response resp;
+	enum HTTP_PARSE_RESULT res;
+	ssize_t used;
+	long long parsed;
+
+	memset(&req, 0, sizeof(req));
+
+	/* The head is complete (or can't be) by now; this doesn't rescan */
+	if ((used = http_parser_feed(&c->parser, c->in, c->in_len)) > 0)
+	{
+		res = http_request_from_parser(&c->parser, &req);
+	}
+	else
+	{
+		/* Malformed, or too large for the buffer: answer and close */
+		res = HTTP_PARSE_LINE_FAILURE;
+		used = (ssize_t)c->in_len;
+	}
+	http_parser_init(&c->parser);
+	parsed = metrics_clock();
+	c->started = c->received;
+
+	/* Keep any pipelined requests that follow this one */
+	if ((size_t)used < c->in_len)
+	{
+		memmove(c->in, c->in + used, c->in_len - (size_t)used);
+		c->in_len -= (size_t)used;
+		c->received = parsed;
+	}
+	else
+	{
+		c->in_len = 0;
+	}
+
+	if (++c->nreq >= config->keepalive_max)
+	{
+		req.keep_alive = 0;
+	}
+
+	/* FastCGI too: a slow responder must not stall the loop */
+	if (res == HTTP_PARSE_OK && is_cgi_request(&req, config))
+	{
+		if (conn_fork_cgi(c, config, &req, &resp) == 0)
+		{
+			return -1;
+		}
+	}
+	else
+	{
+		(void)respond_http_request(&c->out, config, res, &req, &resp);
+	}
+	c->ready = metrics_clock();
+	metrics_observe(METRICS_PARSE, c->started, parsed);
+	metrics_observe(METRICS_HANDLE, parsed, c->ready);
+	metrics_response(&resp);
+	logRequest(config, c->rip, &req, &resp);
+
+	c->keep_alive = resp.keep_alive;
+	c->state = CONN_WRITING;
+	return 0;
+}
+
+/*
+ * Writes as much of the pending response (headers, then any file body) as
+ * the socket accepts. Returns 1 when everything was written, 0 if we have
+ * to wait for writability, -1 on error.
+ */
+static int
+conn_write(struct event_conn *c)
+{
+	int rc = outbuf_send(&c->out);
+
+	c->last_active = timefmt_now();
+	return rc;
+}
+
+/*
+ * Called once a response has been written completely. Resets the
+ * connection for its next request, or returns -1 if it should be closed.
+ */
+static int
+conn_finish(struct event_conn *c)
+{
+	long long sent = metrics_clock();
+
+	metrics_observe(METRICS_SEND, c->ready, sent);
+	metrics_observe(METRICS_TOTAL, c->started, sent);
+
+	if (!c->keep_alive)
+	{
+		return -1;
+	}
+
+	c->state = CONN_READING;
+	return 0;
+}
+
+/*
+ * Answers every complete request waiting in the input buffer, for as long
+ * as the responses can be written without blocking.
+ * Returns -1 if the connection should be closed.
+ */
+static int
+conn_process(struct event_conn *c, struct server_config *config)
+{
+	while (c->state == CONN_READING && request_complete(c))
+	{
+		if (conn_respond(c, config) < 0)
+		{
+			return -1;
+		}
+
+		switch (conn_write(c))
+		{
+		case 1:
+			if (conn_finish(c) < 0)
+			{
+				return -1;
+			}
+			break;
+		case 0:
+			return poller_mod(c->fd, EV_WRITE);
+		default:
+			return -1;
+		}
+	}
+
+	/* Nothing more will arrive for a partial request */
+	if (c->state == CONN_READING && c->peer_closed)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Reads whatever is available and answers the requests that are complete.
+ * Returns -1 if the connection should be closed.
+ */
+static int
+conn_read(struct event_conn *c, struct server_config *config)
+{
+	for (;;)
+	{
+		ssize_t n;
+
+		if (c->in_len == sizeof(c->in))
+		{
+			break;
+		}
+
+		n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				break;
+			}
+			return -1;
+		}
+		if (n == 0)
+		{
+			c->peer_closed = 1;
+			break;
+		}
+		if (c->in_len == 0)
+		{
+			c->received = metrics_clock();
+		}
+		c->in_len += (size_t)n;
+		c->last_active = timefmt_now();
+	}
+
+	return conn_process(c, config);
+}
+
+/*
+ * Continues writing a response once the socket is writable, then moves on
+ * to any pipelined requests. Returns -1 if the connection should be closed.
+ */
+static int
+conn_resume(struct event_conn *c, struct server_config *config)
+{
+	switch (conn_write(c))
+	{
+	case 1:
+		if (conn_finish(c) < 0 || poller_mod(c->fd, EV_READ) < 0)
+		{
+			return -1;
+		}
+		return conn_process(c, config);
+	case 0:
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Drops connections that have made no progress within the idle timeout.
+ * Runs once a second, which is also when dead FastCGI responders of a
+ * single-process server are restarted.
+ */
+static void
+expire_connections(struct server_config *config)
+{
+	time_t now = timefmt_now();
+
+	(void)fcgi_respawn();
+
+	for (size_t i = 0; i < conns_cap; i++)
+	{
+		struct event_conn *c = conns[i];
+		if (c && now - c->last_active >= config->keepalive_timeout)
+		{
+			conn_drop(c);
+		}
+	}
+}
+
+static void
+accept_connections(void)
+{
+	for (;;)
+	{
+		struct sockaddr_storage client;
+		socklen_t length = sizeof(client);
+		int fd;
+
+		memset(&client, 0, sizeof(client));
+		if ((fd = accept(listen_fd, (struct sockaddr *)&client, &length)) < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+			{
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				perror("Accept");
+			}
+			return;
+		}
+
+		if (set_nonblocking(fd, 1) < 0 || conn_new(fd, &client) == NULL)
+		{
+			close(fd);
+			continue;
+		}
+		if (poller_add(fd, EV_READ) < 0)
+		{
+			perror("poller_add");
+			conn_free(conns[fd]);
+		}
+	}
+}
+
+#ifdef __linux__
+
+/* ----- Completion-based I/O: io_uring(7) ----- */
+
+/* Submission slots, and the provided buffers receives land in */
+#define URING_ENTRIES 256
+#define URING_NBUFS 256
+#define URING_BUFSIZE 4096
+
+/* File pieces up to this size are read into memory and sent along with
+   the head; longer ones are spliced from the file through a pipe */
+#define URING_READ_MAX 65536
+
+/* Size asked for the splice pipes */
+#define URING_PIPE_SIZE (256 * 1024)
+
+/* Completions carry the connection's descriptor and what was asked */
+#define URING_TAG(fd, op) ((uint64_t)(fd) << 8 | (op))
+
+enum URING_OP
+{
+	UR_ACCEPT,
+	UR_TIMER,
+	UR_RECV,
+	UR_READ,
+	UR_SEND,
+	UR_FILL,  /* file to pipe */
+	UR_DRAIN, /* pipe to socket */
+};
+
+static int
+ring_recv(struct event_conn *c)
+{
+	if (c->recv_armed)
+	{
+		return 0;
+	}
+	if (uring_recv(c->fd, (unsigned)(sizeof(c->in) - c->in_len),
+	               URING_TAG(c->fd, UR_RECV)) == NULL)
+	{
+		return -1;
+	}
+	c->recv_armed = 1;
+	c->ops++;
+	return 0;
+}
+
+static int
+ring_open_pipe(struct event_conn *c)
+{
+	int size;
+
+	if (pipe2(c->pipe_fd, O_CLOEXEC) < 0)
+	{
+		c->pipe_fd[0] = c->pipe_fd[1] = -1;
+		return -1;
+	}
+	/* Larger pipes take fewer round trips; the default will do too */
+	(void)fcntl(c->pipe_fd[1], F_SETPIPE_SZ, URING_PIPE_SIZE);
+	size = fcntl(c->pipe_fd[1], F_GETPIPE_SZ);
+	c->pipe_cap = size > 0 ? (size_t)size : 65536;
+	return 0;
+}
+
+/*
+ * Queues the next step of writing the response: the pending head with
+ * any short file piece (read into memory first), or a long file piece
+ * spliced through the pipe, linked behind the head before it. Returns 1
+ * if requests were queued, 0 if the response is out, -1 on error.
+ */
+static int
+ring_send(struct event_conn *c)
+{
+	struct iovec *iov;
+	struct outbuf_file_part *part;
+	struct io_uring_sqe *sqe;
+	int niov = outbuf_next(&c->out, &iov, &part);
+	int splice = part && part->left > URING_READ_MAX;
+	unsigned flags;
+	size_t len;
+
+	/* Room for the longest chain, so that it is submitted as one */
+	if (uring_reserve(3) < 0 ||
+	    (splice && c->pipe_fd[0] < 0 && ring_open_pipe(c) < 0))
+	{
+		return -1;
+	}
+
+	/* What a short send left in the pipe goes first */
+	if (c->pipe_fill > 0)
+	{
+		if (uring_splice(c->pipe_fd[0], -1, c->fd, (unsigned)c->pipe_fill,
+		                 SPLICE_F_MOVE, URING_TAG(c->fd, UR_DRAIN)) == NULL)
+		{
+			return -1;
+		}
+		c->ops++;
+		return 1;
+	}
+	if (niov == 0 && part == NULL)
+	{
+		return 0;
+	}
+
+	if (part && !splice && c->fbuf_len == 0)
+	{
+		if (c->fbuf == NULL && (c->fbuf = malloc(URING_READ_MAX)) == NULL)
+		{
+			return -1;
+		}
+		if (uring_read(c->out.file_fd, c->fbuf, (unsigned)part->left,
+		               part->off, URING_TAG(c->fd, UR_READ)) == NULL)
+		{
+			return -1;
+		}
+		c->ops++;
+		return 1;
+	}
+
+	c->send_head = 0;
+	for (int i = 0; i < niov; i++)
+	{
+		c->msg_iov[i] = iov[i];
+		c->send_head += iov[i].iov_len;
+	}
+	if (c->fbuf_len > 0)
+	{
+		c->msg_iov[niov].iov_base = c->fbuf;
+		c->msg_iov[niov].iov_len = c->fbuf_len;
+		niov++;
+	}
+	if (niov > 0)
+	{
+		memset(&c->msg, 0, sizeof(c->msg));
+		c->msg.msg_iov = c->msg_iov;
+		c->msg.msg_iovlen = (size_t)niov;
+
+		/* All or nothing, so that a linked splice can't overtake it */
+		flags = MSG_NOSIGNAL | MSG_WAITALL | (splice ? MSG_MORE : 0);
+		sqe = uring_sendmsg(c->fd, &c->msg, flags, URING_TAG(c->fd, UR_SEND));
+		if (sqe == NULL)
+		{
+			return -1;
+		}
+		c->ops++;
+		if (!splice)
+		{
+			return 1;
+		}
+		sqe->flags |= IOSQE_IO_LINK;
+	}
+
+	len = (size_t)part->left < c->pipe_cap ? (size_t)part->left : c->pipe_cap;
+	sqe = uring_splice(c->out.file_fd, part->off, c->pipe_fd[1], (unsigned)len,
+	                   SPLICE_F_MOVE, URING_TAG(c->fd, UR_FILL));
+	if (sqe == NULL)
+	{
+		return -1;
+	}
+	sqe->flags |= IOSQE_IO_LINK;
+	c->ops++;
+	flags = SPLICE_F_MOVE | ((size_t)part->left > len ? SPLICE_F_MORE : 0);
+	if (uring_splice(c->pipe_fd[0], -1, c->fd, (unsigned)len, flags,
+	                 URING_TAG(c->fd, UR_DRAIN)) == NULL)
+	{
+		return -1;
+	}
+	c->ops++;
+	return 1;
+}
+
+static void ring_process(struct event_conn *c, struct server_config *config);
+
+/* Carries on writing the response, then moves on to the next request */
+static void
+ring_write(struct event_conn *c, struct server_config *config)
+{
+	switch (ring_send(c))
+	{
+	case 1:
+		return;
+	case 0:
+		outbuf_reset(&c->out);
+		if (conn_finish(c) < 0)
+		{
+			conn_drop(c);
+			return;
+		}
+		ring_process(c, config);
+		return;
+	default:
+		conn_drop(c);
+	}
+}
+
+/*
+ * Answers the first complete buffered request, or asks for more input.
+ */
+static void
+ring_process(struct event_conn *c, struct server_config *config)
+{
+	if (request_complete(c))
+	{
+		if (conn_respond(c, config) < 0)
+		{
+			conn_drop(c);
+			return;
+		}
+		ring_write(c, config);
+		return;
+	}
+
+	/* Nothing more will arrive for a partial request */
+	if (c->peer_closed || ring_recv(c) < 0)
+	{
+		conn_drop(c);
+	}
+}
+
+/* Takes in a completion for one of the connection's requests */
+static void
+ring_complete(struct event_conn *c, int op, int res, unsigned flags,
+              struct server_config *config)
+{
+	c->ops--;
+	switch (op)
+	{
+	case UR_RECV:
+		c->recv_armed = 0;
+		if (res > 0 && (flags & IORING_CQE_F_BUFFER))
+		{
+			unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+			if (c->in_len == 0)
+			{
+				c->received = metrics_clock();
+			}
+			memcpy(c->in + c->in_len, uring_buffer(bid), (size_t)res);
+			uring_recycle(bid);
+			c->in_len += (size_t)res;
+			c->last_active = timefmt_now();
+		}
+		else if (res == 0)
+		{
+			c->peer_closed = 1;
+		}
+		else if (res != -ENOBUFS)
+		{
+			/* Out of buffers just means asking again */
+			c->failed = 1;
+		}
+		break;
+	case UR_READ:
+		if (res > 0)
+		{
+			c->fbuf_len = (size_t)res;
+		}
+		else
+		{
+			/* Error, or the file shrank underneath us */
+			c->failed = 1;
+		}
+		break;
+	case UR_SEND:
+		if (res < 0 || (size_t)res != c->send_head + c->fbuf_len)
+		{
+			c->failed = 1;
+			break;
+		}
+		if (c->send_head > 0)
+		{
+			outbuf_advance(&c->out, c->send_head);
+		}
+		if (c->fbuf_len > 0)
+		{
+			outbuf_advance(&c->out, c->fbuf_len);
+			c->fbuf_len = 0;
+		}
+		c->last_active = timefmt_now();
+		break;
+	case UR_FILL:
+		if (res > 0)
+		{
+			c->pipe_fill += (size_t)res;
+		}
+		else if (res != -ECANCELED)
+		{
+			c->failed = 1;
+		}
+		break;
+	case UR_DRAIN:
+		if (res > 0)
+		{
+			c->pipe_fill -= (size_t)res;
+			outbuf_advance(&c->out, (size_t)res);
+			c->last_active = timefmt_now();
+		}
+		else if (res != -ECANCELED)
+		{
+			c->failed = 1;
+		}
+		break;
+	}
+
+	/* A linked chain completes as a whole before we carry on */
+	if (c->ops > 0)
+	{
+		return;
+	}
+	if (c->closing || c->failed)
+	{
+		conn_free(c);
+	}
+	else if (c->state == CONN_WRITING)
+	{
+		ring_write(c, config);
+	}
+	else
+	{
+		ring_process(c, config);
+	}
+}
+
+static void
+ring_accept(int res, unsigned flags)
+{
+	if (res >= 0)
+	{
+		struct sockaddr_storage client;
+		socklen_t length = sizeof(client);
+		struct event_conn *c;
+
+		/* Multishot accepts share one address buffer; ask instead */
+		memset(&client, 0, sizeof(client));
+		(void)getpeername(res, (struct sockaddr *)&client, &length);
+		if ((c = conn_new(res, &client)) == NULL)
+		{
+			close(res);
+		}
+		else if (ring_recv(c) < 0)
+		{
+			conn_free(c);
+		}
+	}
+	else if (res != -ECONNABORTED && res != -EINTR)
+	{
+		errno = -res;
+		perror("Accept");
+	}
+
+	if (!(flags & IORING_CQE_F_MORE) &&
+	    uring_accept_multishot(listen_fd, URING_TAG(0, UR_ACCEPT)) == NULL)
+	{
+		perror("io_uring");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * The event loop over io_uring: accepts, receives and sends are all
+ * queued on the ring, and each wakeup submits the next batch of requests
+ * and collects every completion in one system call.
+ */
+static void
+ring_loop(struct server_config *config)
+{
+	static const struct __kernel_timespec tick = {1, 0};
+
+	if (uring_accept_multishot(listen_fd, URING_TAG(0, UR_ACCEPT)) == NULL ||
+	    uring_timeout(&tick, URING_TAG(0, UR_TIMER)) == NULL)
+	{
+		perror("io_uring");
+		exit(EXIT_FAILURE);
+	}
+
+	for (;;)
+	{
+		struct io_uring_cqe *cqe;
+
+		if (uring_submit(1) < 0 && errno != EINTR && errno != EAGAIN &&
+		    errno != EBUSY)
+		{
+			perror("io_uring_enter");
+		}
+
+		while ((cqe = uring_peek()) != NULL)
+		{
+			uint64_t ud = cqe->user_data;
+			int res = cqe->res;
+			unsigned flags = cqe->flags;
+			size_t fd = (size_t)(ud >> 8);
+			struct event_conn *c = fd < conns_cap ? conns[fd] : NULL;
+
+			uring_seen();
+			switch (ud & 0xff)
+			{
+			case UR_ACCEPT:
+				ring_accept(res, flags);
+				break;
+			case UR_TIMER:
+				/* Wakes us up once a second to expire idle connections */
+				expire_connections(config);
+				if (uring_timeout(&tick, URING_TAG(0, UR_TIMER)) == NULL)
+				{
+					perror("io_uring");
+				}
+				break;
+			default:
+				if (c != NULL)
+				{
+					ring_complete(c, (int)(ud & 0xff), res, flags, config);
+				}
+				else if (flags & IORING_CQE_F_BUFFER)
+				{
+					uring_recycle(flags >> IORING_CQE_BUFFER_SHIFT);
+				}
+				break;
+			}
+		}
+	}
+}
+
+#endif /* __linux__ */
+
+void
+runEventLoop(int server_sock, struct server_config *config)
+{
+	int fds[EVENT_BATCH];
+	int events[EVENT_BATCH];
+	time_t last_sweep = timefmt_now();
+
+	/* A client hanging up mid-write must not take down every connection */
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+	{
+		perror("Signal");
+		exit(EXIT_FAILURE);
+	}
+
+	listen_fd = server_sock;
+
+#ifdef __linux__
+	/* The ring waits for connections itself: the socket stays blocking */
+	if (config->use_uring)
+	{
+		if (uring_init(URING_ENTRIES, URING_NBUFS, URING_BUFSIZE) == 0)
+		{
+			use_uring = 1;
+			ring_loop(config);
+			/* NOTREACHED */
+		}
+		perror("io_uring unavailable, using epoll");
+	}
+#endif
+
+	if (set_nonblocking(listen_fd, 1) < 0)
+	{
+		perror("fcntl");
+		exit(EXIT_FAILURE);
+	}
+
+	if (poller_init() < 0 || poller_add(listen_fd, EV_READ) < 0)
+	{
+		perror("poller");
+		exit(EXIT_FAILURE);
+	}
+
+	for (;;)
+	{
+		/* Wake up at least once a second to expire idle connections */
+		int n = poller_wait(fds, events, EVENT_BATCH, 1000);
+
+		if (timefmt_now() != last_sweep)
+		{
+			last_sweep = timefmt_now();
+			expire_connections(config);
+		}
+
+		if (n < 0)
+		{
+			if (errno != EINTR)
+			{
+				perror("poller_wait");
+			}
+			continue;
+		}
+
+		for (int i = 0; i < n; i++)
+		{
+			struct event_conn *c;
+			int rc = 0;
+
+			if (fds[i] == listen_fd)
+			{
+				accept_connections();
+				continue;
+			}
+
+			if ((size_t)fds[i] >= conns_cap || (c = conns[fds[i]]) == NULL)
+			{
+				continue;
+			}
+
+			if (c->state == CONN_READING && (events[i] & EV_READ))
+			{
+				rc = conn_read(c, config);
+			}
+			else if (c->state == CONN_WRITING && (events[i] & EV_WRITE))
+			{
+				rc = conn_resume(c, config);
+			}
+
+			if (rc < 0)
+			{
+				conn_free(c);
+			}
+		}
+	}
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "server.h"
+
+/*
+ * Serves connections on the (listening) server_sock from a single process
+ * using non-blocking sockets and epoll(7) (poll(2) where epoll is not
+ * available). Each connection is driven as a small state machine: its
+ * request is read into a buffer, answered into an in-memory response and
+ * written out as the socket becomes writable. Only CGI requests fork.
+ *
+ * With config->use_uring the same state machine is driven by io_uring(7)
+ * completions instead, where the kernel supports it: accepts, receives
+ * and sends (file bodies read or spliced) are queued on one ring per
+ * process and submitted in batches.
+ *
+ * Does not return.
+ */
+void runEventLoop(int server_sock, struct server_config *config);
@@ -0,0 +1,658 @@
+#include "fcgi.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cgi.h"
+#include "metrics.h"
+#include "server.h"
+
+/* Record types and flags from the FastCGI 1.0 specification */
+#define FCGI_VERSION_1 1
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_RESPONDER 1
+#define FCGI_HEADER_LEN 8
+
+/* Every connection carries one request at a time, always with this id */
+#define FCGI_REQUEST_ID 1
+
+#define FCGI_MAX_PARAMS 8192
+
+/* Seconds to wait for a responder before giving up on the request */
+#define FCGI_TIMEOUT 30
+
+/* A responder that died sooner after starting is restarted no faster */
+#define FCGI_RESPAWN_DELAY 1
+
+struct fcgi_backend
+{
+	char script_name[PATH_MAX]; /* "/cgi-bin/<script>" */
+	char script_path[PATH_MAX];
+	struct sockaddr_un addr;
+
+	/* Kept open by the server, so that responders can be restarted */
+	int lfd;
+
+	/* Responders; a slot is 0 once its responder has died */
+	pid_t *pids;
+	time_t *started;
+	int npids;
+};
+
+/* State of the response currently being read from a responder */
+struct fcgi_reader
+{
+	int fd;
+	int type;           /* of the record being read */
+	size_t content_left; /* of the current record */
+	size_t padding_left;
+	int done; /* FCGI_END_REQUEST seen */
+};
+
+static struct fcgi_backend *backends = NULL;
+static int nbackends = 0;
+static char sock_dir[PATH_MAX];
+
+/* The process that started the responders; only it may stop them */
+static pid_t server_pid = 0;
+
+/* Set when a responder died, until it has been restarted */
+static volatile sig_atomic_t responders_died = 0;
+
+/* Starts the responder in slot i of b. Returns 0 on success, -1 on error */
+static int
+spawn_responder(struct fcgi_backend *b, int i)
+{
+	pid_t pid = fork();
+
+	if (pid < 0)
+	{
+		return -1;
+	}
+	if (pid == 0)
+	{
+		long maxfd = sysconf(_SC_OPEN_MAX);
+
+		/* FCGI_LISTENSOCK_FILENO */
+		if (dup2(b->lfd, STDIN_FILENO) < 0)
+		{
+			_exit(1);
+		}
+
+		/*
+		 * A restarted responder is forked from a running server: keep it
+		 * from holding on to listeners and client connections.
+		 */
+		for (long fd = STDERR_FILENO + 1; fd < maxfd; fd++)
+		{
+			(void)close((int)fd);
+		}
+#ifdef __linux__
+		/* Don't outlive the server */
+		(void)prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+		(void)signal(SIGCHLD, SIG_DFL);
+		(void)signal(SIGPIPE, SIG_DFL);
+
+		execl(b->script_path, b->script_path, (char *)NULL);
+		_exit(127);
+	}
+	b->pids[i] = pid;
+	b->started[i] = time(NULL);
+	return 0;
+}
+
+static int
+spawn_responders(struct fcgi_backend *b, int nprocs)
+{
+	if ((b->pids = calloc((size_t)nprocs, sizeof(*b->pids))) == NULL ||
+	    (b->started = calloc((size_t)nprocs, sizeof(*b->started))) == NULL)
+	{
+		return -1;
+	}
+
+	for (; b->npids < nprocs; b->npids++)
+	{
+		if (spawn_responder(b, b->npids) < 0)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Fills in the request and file names of 'script' in b, checking that it
+ * names an executable file in the CGI directory.
+ * Returns 0 on success, -1 (with errno set) on error.
+ */
+static int
+script_paths(const struct server_config *cfg, const char *script,
+             struct fcgi_backend *b)
+{
+	while (*script == '/')
+	{
+		script++;
+	}
+	if (cfg->cgi_dir == NULL || *script == '\0' ||
+	    strstr(script, "..") != NULL)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (snprintf(b->script_name, sizeof(b->script_name), "/cgi-bin/%s",
+	             script) >= (int)sizeof(b->script_name) ||
+	    snprintf(b->script_path, sizeof(b->script_path), "%s/%s",
+	             cfg->cgi_dir, script) >= (int)sizeof(b->script_path))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return access(b->script_path, X_OK);
+}
+
+int
+fcgi_check_script(const struct server_config *cfg, const char *script)
+{
+	struct fcgi_backend b;
+
+	return script_paths(cfg, script, &b);
+}
+
+int
+fcgi_init(const struct server_config *cfg)
+{
+	int nprocs = cfg->workers > 0 ? cfg->workers : 1;
+
+	if (cfg->nfcgi_scripts == 0)
+	{
+		return 0;
+	}
+	if (cfg->cgi_dir == NULL)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	snprintf(sock_dir, sizeof(sock_dir), "/tmp/sws-fcgi.XXXXXX");
+	if (mkdtemp(sock_dir) == NULL)
+	{
+		return -1;
+	}
+
+	if ((backends = calloc((size_t)cfg->nfcgi_scripts, sizeof(*backends))) ==
+	    NULL)
+	{
+		return -1;
+	}
+	server_pid = getpid();
+
+	for (int i = 0; i < cfg->nfcgi_scripts; i++)
+	{
+		struct fcgi_backend *b = &backends[i];
+
+		if (script_paths(cfg, cfg->fcgi_scripts[i], b) < 0)
+		{
+			return -1;
+		}
+
+		b->addr.sun_family = AF_UNIX;
+		if (snprintf(b->addr.sun_path, sizeof(b->addr.sun_path), "%s/%d.sock",
+		             sock_dir, i) >= (int)sizeof(b->addr.sun_path))
+		{
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+
+		/* Counted now, so that responders dying early are noticed */
+		nbackends++;
+
+		/* Close-on-exec: only the responders need it, as their fd 0 */
+		if ((b->lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		{
+			return -1;
+		}
+		if (fcntl(b->lfd, F_SETFD, FD_CLOEXEC) < 0 ||
+		    bind(b->lfd, (struct sockaddr *)&b->addr, sizeof(b->addr)) < 0 ||
+		    listen(b->lfd, 128) < 0 || spawn_responders(b, nprocs) < 0)
+		{
+			close(b->lfd);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void
+fcgi_shutdown(void)
+{
+	if (getpid() != server_pid)
+	{
+		return;
+	}
+	for (int i = 0; i < nbackends; i++)
+	{
+		for (int k = 0; k < backends[i].npids; k++)
+		{
+			if (backends[i].pids[k] > 0)
+			{
+				(void)kill(backends[i].pids[k], SIGTERM);
+			}
+		}
+		(void)unlink(backends[i].addr.sun_path);
+	}
+	if (nbackends > 0)
+	{
+		(void)rmdir(sock_dir);
+	}
+}
+
+void
+fcgi_reaped(pid_t pid)
+{
+	if (getpid() != server_pid)
+	{
+		return;
+	}
+	for (int i = 0; i < nbackends; i++)
+	{
+		for (int k = 0; k < backends[i].npids; k++)
+		{
+			if (backends[i].pids[k] == pid)
+			{
+				backends[i].pids[k] = 0;
+				responders_died = 1;
+				return;
+			}
+		}
+	}
+}
+
+int
+fcgi_respawn(void)
+{
+	sigset_t block, saved;
+	time_t now = time(NULL);
+	int waiting = 0;
+
+	if (!responders_died || getpid() != server_pid)
+	{
+		return 0;
+	}
+
+	/* A responder dying meanwhile must find its slot filled in */
+	sigemptyset(&block);
+	sigaddset(&block, SIGCHLD);
+	(void)sigprocmask(SIG_BLOCK, &block, &saved);
+
+	responders_died = 0;
+	for (int i = 0; i < nbackends; i++)
+	{
+		struct fcgi_backend *b = &backends[i];
+
+		for (int k = 0; k < b->npids; k++)
+		{
+			if (b->pids[k] != 0)
+			{
+				continue;
+			}
+			if (now - b->started[k] < FCGI_RESPAWN_DELAY ||
+			    spawn_responder(b, k) < 0)
+			{
+				waiting++;
+			}
+		}
+	}
+	if (waiting > 0)
+	{
+		responders_died = 1;
+	}
+
+	(void)sigprocmask(SIG_SETMASK, &saved, NULL);
+	return waiting;
+}
+
+static struct fcgi_backend *
+find_backend(const struct http_request *req, const struct server_config *cfg,
+             const char **query_string)
+{
+	char script_path[PATH_MAX];
+	char script_name[PATH_MAX];
+
+	if (nbackends == 0 ||
+	    cgi_build_script_path(req, cfg->cgi_dir, script_path,
+	                          sizeof(script_path), script_name,
+	                          sizeof(script_name), query_string) < 0)
+	{
+		return NULL;
+	}
+
+	for (int i = 0; i < nbackends; i++)
+	{
+		if (strcmp(backends[i].script_name, script_name) == 0)
+		{
+			return &backends[i];
+		}
+	}
+	return NULL;
+}
+
+int
+fcgi_handles(const struct http_request *req, const struct server_config *cfg)
+{
+	const char *query_string;
+
+	return find_backend(req, cfg, &query_string) != NULL;
+}
+
+/* Opens a fresh connection to the backend, for one request */
+static int
+connect_backend(const struct fcgi_backend *b)
+{
+	struct timeval tv = {FCGI_TIMEOUT, 0};
+	int fd;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	{
+		return -1;
+	}
+	if (connect(fd, (const struct sockaddr *)&b->addr, sizeof(b->addr)) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	(void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	(void)setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	return fd;
+}
+
+/* ----- Protocol ----- */
+
+static void
+put_header(unsigned char *p, int type, size_t len)
+{
+	p[0] = FCGI_VERSION_1;
+	p[1] = (unsigned char)type;
+	p[2] = (FCGI_REQUEST_ID >> 8) & 0xff;
+	p[3] = FCGI_REQUEST_ID & 0xff;
+	p[4] = (unsigned char)((len >> 8) & 0xff);
+	p[5] = (unsigned char)(len & 0xff);
+	p[6] = 0; /* padding */
+	p[7] = 0;
+}
+
+/* Appends one name-value pair; lengths over 127 take four bytes */
+static int
+add_param(unsigned char *buf, size_t *len, size_t cap, const char *name,
+          const char *value)
+{
+	size_t nlen = strlen(name);
+	size_t vlen = value ? strlen(value) : 0;
+	size_t lens[2] = {nlen, vlen};
+
+	if (*len + 8 + nlen + vlen > cap)
+	{
+		return -1;
+	}
+	for (int i = 0; i < 2; i++)
+	{
+		if (lens[i] < 128)
+		{
+			buf[(*len)++] = (unsigned char)lens[i];
+		}
+		else
+		{
+			buf[(*len)++] = (unsigned char)(((lens[i] >> 24) & 0x7f) | 0x80);
+			buf[(*len)++] = (unsigned char)((lens[i] >> 16) & 0xff);
+			buf[(*len)++] = (unsigned char)((lens[i] >> 8) & 0xff);
+			buf[(*len)++] = (unsigned char)(lens[i] & 0xff);
+		}
+	}
+	memcpy(buf + *len, name, nlen);
+	memcpy(buf + *len + nlen, value ? value : "", vlen);
+	*len += nlen + vlen;
+	return 0;
+}
+
+static int
+send_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	int flags = 0;
+
+#ifdef MSG_NOSIGNAL
+	/* The responder may have died and closed the connection */
+	flags = MSG_NOSIGNAL;
+#endif
+
+	while (len > 0)
+	{
+		ssize_t n = send(fd, p, len, flags);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		p += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+/*
+ * Sends BEGIN_REQUEST, the CGI variables as PARAMS and an empty STDIN
+ * (requests never have a body here) in a single write.
+ */
+static int
+send_request(int fd, const struct fcgi_backend *b,
+             const struct http_request *req, const char *query_string)
+{
+	unsigned char buf[FCGI_HEADER_LEN * 5 + FCGI_MAX_PARAMS];
+	unsigned char *params = buf + FCGI_HEADER_LEN * 3;
+	size_t plen = 0, len;
+	const char *env[] = {"REMOTE_ADDR", "SERVER_PORT", "SERVER_NAME"};
+
+	put_header(buf, FCGI_BEGIN_REQUEST, 8);
+	memset(buf + FCGI_HEADER_LEN, 0, 8);
+	buf[FCGI_HEADER_LEN + 1] = FCGI_RESPONDER;
+
+	if (add_param(params, &plen, FCGI_MAX_PARAMS, "GATEWAY_INTERFACE",
+	              "CGI/1.1") < 0 ||
+	    add_param(params, &plen, FCGI_MAX_PARAMS, "SERVER_SOFTWARE",
+	              "sws/1.0") < 0 ||
+	    add_param(params, &plen, FCGI_MAX_PARAMS, "SERVER_PROTOCOL",
+	              req->version) < 0 ||
+	    add_param(params, &plen, FCGI_MAX_PARAMS, "REQUEST_METHOD",
+	              req->method) < 0 ||
+	    add_param(params, &plen, FCGI_MAX_PARAMS, "REQUEST_URI", req->path) <
+	        0 ||
+	    add_param(params, &plen, FCGI_MAX_PARAMS, "SCRIPT_NAME",
+	              b->script_name) < 0 ||
+	    add_param(params, &plen, FCGI_MAX_PARAMS, "SCRIPT_FILENAME",
+	              b->script_path) < 0 ||
+	    add_param(params, &plen, FCGI_MAX_PARAMS, "QUERY_STRING",
+	              query_string) < 0)
+	{
+		return -1;
+	}
+	/* Per-connection variables, as exported by setRequestEnvironment */
+	for (size_t i = 0; i < sizeof(env) / sizeof(env[0]); i++)
+	{
+		const char *val = getenv(env[i]);
+		if (val && add_param(params, &plen, FCGI_MAX_PARAMS, env[i], val) < 0)
+		{
+			return -1;
+		}
+	}
+
+	put_header(buf + FCGI_HEADER_LEN * 2, FCGI_PARAMS, plen);
+	len = FCGI_HEADER_LEN * 3 + plen;
+	put_header(buf + len, FCGI_PARAMS, 0);
+	put_header(buf + len + FCGI_HEADER_LEN, FCGI_STDIN, 0);
+	len += FCGI_HEADER_LEN * 2;
+
+	return send_all(fd, buf, len);
+}
+
+static int
+read_full(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+
+	while (len > 0)
+	{
+		ssize_t n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			return -1;
+		}
+		p += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+static int
+skip_bytes(int fd, size_t len)
+{
+	char buf[512];
+
+	while (len > 0)
+	{
+		size_t n = len < sizeof(buf) ? len : sizeof(buf);
+		if (read_full(fd, buf, n) < 0)
+		{
+			return -1;
+		}
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * cgi_source reader: returns the FCGI_STDOUT stream, skipping every other
+ * record, and ends at FCGI_END_REQUEST.
+ */
+static ssize_t
+fcgi_read(void *ctx, void *buf, size_t len)
+{
+	struct fcgi_reader *r = ctx;
+
+	while (!r->done)
+	{
+		unsigned char h[FCGI_HEADER_LEN];
+		ssize_t n;
+
+		if (r->content_left > 0 && r->type == FCGI_STDOUT)
+		{
+			if (len > r->content_left)
+			{
+				len = r->content_left;
+			}
+			while ((n = read(r->fd, buf, len)) < 0 && errno == EINTR)
+				;
+			if (n <= 0)
+			{
+				return -1;
+			}
+			r->content_left -= (size_t)n;
+			return n;
+		}
+
+		/* Done with this record: skip what's left of it */
+		if (skip_bytes(r->fd, r->content_left + r->padding_left) < 0 ||
+		    read_full(r->fd, h, sizeof(h)) < 0)
+		{
+			return -1;
+		}
+		r->type = h[1];
+		r->content_left = ((size_t)h[4] << 8) | h[5];
+		r->padding_left = h[6];
+
+		if (h[0] != FCGI_VERSION_1)
+		{
+			return -1;
+		}
+		if (r->type == FCGI_END_REQUEST)
+		{
+			if (skip_bytes(r->fd, r->content_left + r->padding_left) < 0)
+			{
+				return -1;
+			}
+			r->content_left = r->padding_left = 0;
+			r->done = 1;
+		}
+		/* FCGI_STDERR and anything unknown are dropped */
+	}
+	return 0;
+}
+
+int
+fcgi_handle(struct outbuf *out, const struct http_request *req,
+            const struct server_config *cfg, int is_head,
+            struct http_response *resp)
+{
+	struct fcgi_backend *b;
+	struct fcgi_reader rd;
+	struct cgi_source src;
+	const char *query_string;
+	int ret, fd;
+
+	if ((b = find_backend(req, cfg, &query_string)) == NULL)
+	{
+		return -1;
+	}
+	metrics_fcgi_request();
+
+	if ((fd = connect_backend(b)) < 0)
+	{
+		return -1;
+	}
+	if (send_request(fd, b, req, query_string) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	memset(&rd, 0, sizeof(rd));
+	rd.fd = fd;
+	src.read = fcgi_read;
+	src.ctx = &rd;
+	src.pipe_fd = -1;
+
+	/*
+	 * Without FCGI_KEEP_CONN the responder closes the connection once the
+	 * response is complete, and so do we: a responder serving one
+	 * connection at a time is never held up by a client idling between
+	 * requests.
+	 */
+	ret = cgi_relay(out, &src, req, is_head, resp);
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include "http.h"
+
+struct server_config;
+
+/*
+ * FastCGI backends: scripts named with -f run as long-lived FastCGI
+ * responders instead of being executed for every request. Each script
+ * gets a Unix socket, handed to its responder processes as fd 0 (as
+ * FCGI_LISTENSOCK_FILENO expects). Every request gets a connection of its
+ * own, closed with the response, so a responder that serves connections
+ * one at a time is never held by a client idling between requests.
+ */
+
+/*
+ * Checks that 'script' names an executable file in cfg->cgi_dir, as
+ * fcgi_init() will, so that errors can be reported before daemonizing.
+ * Returns 0 on success, -1 (with errno set) on error.
+ */
+int fcgi_check_script(const struct server_config *cfg, const char *script);
+
+/*
+ * Starts the responders for cfg->fcgi_scripts (relative to cfg->cgi_dir).
+ * Call once in the process that will outlive the workers; responders are
+ * its children, and it keeps their listening sockets to restart them.
+ * Returns 0 on success, -1 on error.
+ */
+int fcgi_init(const struct server_config *cfg);
+
+/*
+ * Notes that the child 'pid' has been waited for. If it was a responder,
+ * it is restarted by the next fcgi_respawn(). Does nothing outside the
+ * process that called fcgi_init(). Async-signal-safe.
+ */
+void fcgi_reaped(pid_t pid);
+
+/*
+ * Restarts the responders that died, except those that died within a
+ * second of starting: they are left for a later call. Does nothing
+ * outside the process that called fcgi_init().
+ * Returns the number of responders still to be restarted.
+ */
+int fcgi_respawn(void);
+
+/*
+ * Returns non-zero if the request is for a script served by a FastCGI
+ * responder.
+ */
+int fcgi_handles(const struct http_request *req,
+                 const struct server_config *cfg);
+
+/*
+ * Forwards the request to the script's responder and relays its response
+ * (see cgi_relay).
+ * Returns 0 on success, -1 if no response could be obtained (nothing has
+ * been added to 'out' in that case).
+ */
+int fcgi_handle(struct outbuf *out, const struct http_request *req,
+                const struct server_config *cfg, int is_head,
+                struct http_response *resp);
+
+/*
+ * Terminates the responders and removes their sockets. Does nothing
+ * outside the process that called fcgi_init(). Async-signal-safe.
+ */
+void fcgi_shutdown(void);
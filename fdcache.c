@@ -0,0 +1,325 @@
+#include "fdcache.h"
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "resolve.h"
+
+/* Anything in a watched directory that may change what a path resolves to */
+#define NOTIFY_MASK                                                          \
+	(IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF | \
+	 IN_MODIFY | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO)
+
+struct fdcache_entry
+{
+	char *path; /* NULL: free */
+	uint32_t hash;
+	int want_index;
+
+	int fd; /* -1: nothing to open, failing with 'err' */
+	int err;
+	int is_index;
+	struct stat st;
+
+	long long expires; /* milliseconds, on the coarse monotonic clock */
+	int wd;            /* inotify watch on the directory, or -1 */
+};
+
+static struct fdcache_entry entries[FDCACHE_ENTRIES];
+static size_t hand; /* next entry to evict */
+
+static int ttl;
+static int notify;
+static int notify_fd = -1;
+
+void
+fdcache_init(int ttl_ms, int use_notify)
+{
+	ttl = ttl_ms;
+#ifdef __linux__
+	notify = use_notify;
+#else
+	(void)use_notify;
+#endif
+}
+
+static long long
+now_ms(void)
+{
+	struct timespec ts;
+
+	/* Millisecond precision is plenty; no system call with the vDSO */
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t
+hash_path(const char *path)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *path; path++)
+	{
+		h ^= (unsigned char)*path;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+#ifdef __linux__
+/* Removes the watch 'wd' unless another entry still relies on it */
+static void
+unwatch(int wd)
+{
+	for (size_t i = 0; i < FDCACHE_ENTRIES; i++)
+	{
+		if (entries[i].path != NULL && entries[i].wd == wd)
+		{
+			return;
+		}
+	}
+	/* EINVAL if the directory went away and took the watch with it */
+	(void)inotify_rm_watch(notify_fd, wd);
+}
+#endif
+
+static void
+drop(struct fdcache_entry *e)
+{
+	if (e->fd >= 0)
+	{
+		close(e->fd);
+	}
+	free(e->path);
+	e->path = NULL;
+#ifdef __linux__
+	if (e->wd >= 0)
+	{
+		unwatch(e->wd);
+	}
+#endif
+	e->wd = -1;
+}
+
+#ifdef __linux__
+/* Drops the entries of every directory inotify reported a change in */
+static void
+drain_notify(void)
+{
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t n;
+
+	if (notify_fd < 0)
+	{
+		/* Opened in the process that serves, as events are read once */
+		if ((notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+		{
+			notify = 0;
+		}
+		return;
+	}
+
+	while ((n = read(notify_fd, buf, sizeof(buf))) > 0)
+	{
+		for (char *p = buf; p < buf + n;)
+		{
+			const struct inotify_event *ev = (const void *)p;
+
+			for (size_t i = 0; i < FDCACHE_ENTRIES; i++)
+			{
+				if (entries[i].path != NULL &&
+				    (entries[i].wd == ev->wd || (ev->mask & IN_Q_OVERFLOW)))
+				{
+					drop(&entries[i]);
+				}
+			}
+			p += sizeof(*ev) + ev->len;
+		}
+	}
+}
+
+/* Watches the directory 'path' (if a directory itself) or its parent */
+static int
+watch_directory(const char *path, int is_dir)
+{
+	char dir[PATH_MAX];
+	char *slash;
+
+	if (notify_fd < 0 || strlen(path) >= sizeof(dir))
+	{
+		return -1;
+	}
+	strcpy(dir, path);
+	if (!is_dir && (slash = strrchr(dir, '/')) != NULL)
+	{
+		/* "/file" is watched through "/" */
+		*(slash == dir ? slash + 1 : slash) = '\0';
+	}
+	return inotify_add_watch(notify_fd, dir, NOTIFY_MASK);
+}
+#endif
+
+static int
+open_uncached(int rootfd, const char *rel, int want_index, struct stat *st,
+              int *is_index)
+{
+	const int flags = O_RDONLY | O_NONBLOCK | O_NOCTTY;
+	int fd, index_fd, err;
+	struct stat index_st;
+
+	/* Non-blocking, so a FIFO can't stall us before it is turned down */
+	if ((fd = resolve_open(rootfd, rel, flags)) < 0)
+	{
+		return -1;
+	}
+	if (fstat(fd, st) < 0)
+	{
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	*is_index = 0;
+	if (want_index && S_ISDIR(st->st_mode))
+	{
+		index_fd = resolve_open(fd, "index.html", flags);
+		if (index_fd >= 0 && fstat(index_fd, &index_st) == 0 &&
+		    S_ISREG(index_st.st_mode))
+		{
+			close(fd);
+			fd = index_fd;
+			*st = index_st;
+			*is_index = 1;
+		}
+		else if (index_fd >= 0)
+		{
+			close(index_fd);
+		}
+	}
+
+	/* Bodies are read with io_uring too, which would fail with EAGAIN */
+	if (S_ISREG(st->st_mode))
+	{
+		(void)fcntl(fd, F_SETFL, 0);
+	}
+	return fd;
+}
+
+int
+fdcache_open(int rootfd, const char *path, const char *rel, int want_index,
+             struct stat *st, int *is_index)
+{
+	struct fdcache_entry *e, *victim = NULL;
+	uint32_t hash;
+	long long now;
+	int fd, err;
+
+	if (ttl == 0)
+	{
+		return open_uncached(rootfd, rel, want_index, st, is_index);
+	}
+#ifdef __linux__
+	if (notify)
+	{
+		drain_notify();
+	}
+#endif
+
+	hash = hash_path(path);
+	now = now_ms();
+	for (size_t i = 0; i < FDCACHE_ENTRIES; i++)
+	{
+		e = &entries[i];
+		if (e->path != NULL && e->expires <= now)
+		{
+			drop(e);
+		}
+		if (e->path == NULL)
+		{
+			victim = victim ? victim : e;
+			continue;
+		}
+		if (e->hash != hash || e->want_index != want_index ||
+		    strcmp(e->path, path) != 0)
+		{
+			continue;
+		}
+
+		if (e->fd < 0)
+		{
+			errno = e->err;
+			return -1;
+		}
+		/* The offset is shared, but bodies are only read at given offsets */
+		if ((fd = fcntl(e->fd, F_DUPFD_CLOEXEC, 0)) >= 0)
+		{
+			*st = e->st;
+			*is_index = e->is_index;
+		}
+		return fd;
+	}
+
+	fd = open_uncached(rootfd, rel, want_index, st, is_index);
+	err = errno;
+	if (fd < 0 ? err != ENOENT && err != ENOTDIR : !S_ISREG(st->st_mode))
+	{
+		return fd;
+	}
+
+	if (victim == NULL)
+	{
+		victim = &entries[hand++ % FDCACHE_ENTRIES];
+		drop(victim);
+	}
+	e = victim;
+	if ((e->path = strdup(path)) == NULL)
+	{
+		errno = err;
+		return fd;
+	}
+	e->hash = hash;
+	e->want_index = want_index;
+	e->err = err;
+	e->fd = -1;
+	e->wd = -1;
+	e->is_index = 0;
+	if (fd >= 0)
+	{
+		e->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+		e->st = *st;
+		e->is_index = *is_index;
+		if (e->fd < 0)
+		{
+			drop(e);
+			errno = err;
+			return fd;
+		}
+	}
+	e->expires = now + ttl;
+#ifdef __linux__
+	if (notify)
+	{
+		e->wd = watch_directory(path, e->is_index);
+	}
+#endif
+	errno = err;
+	return fd;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <sys/stat.h>
+
+/*
+ * A per-process cache of open static files: for recently served paths it
+ * keeps the descriptor, its stat and, for directories, which index.html
+ * was chosen, so that a hot file costs no lookup, open or stat at all.
+ * Lookups that found nothing are remembered too. Entries are trusted for
+ * a short interval; with inotify(7) invalidation they are dropped as
+ * soon as their directory changes. Descriptors can't be shared across
+ * processes, so every process fills its own cache; it only pays off in
+ * the long-lived processes of the event loop (-e).
+ */
+
+/* Files kept open per process */
+#define FDCACHE_ENTRIES 128
+
+/*
+ * Keeps entries for 'ttl_ms' milliseconds (0: no caching), dropping them
+ * early on changes reported by inotify if 'notify' is set and the system
+ * supports it. Call before forking.
+ */
+void fdcache_init(int ttl_ms, int notify);
+
+/*
+ * Opens the file at the full path 'path', of which 'rel' is the tail
+ * naming it beneath the directory 'rootfd' (see resolve.h), and stores
+ * its stat in *st. With 'want_index' set, a directory holding a regular
+ * index.html resolves to that file, and *is_index is set.
+ * Regular files are returned blocking; anything else is opened
+ * non-blocking and not cached.
+ * Returns a descriptor for the caller to close, or -1 (errno set).
+ */
+int fdcache_open(int rootfd, const char *path, const char *rel,
+                 int want_index, struct stat *st, int *is_index);
@@ -3,43 +3,33 @@
 #include <sys/stat.h>
 
 #include <ctype.h>
-#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
-#include <magic.h>
-#include <pwd.h>
 #include <regex.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "autoindex.h"
+#include "cache.h"
 #include "cgi.h"
+#include "encoding.h"
+#include "fcgi.h"
+#include "fdcache.h"
+#include "manifest.h"
+#include "metrics.h"
+#include "mime.h"
+#include "outbuf.h"
+#include "pack.h"
+#include "parser.h"
+#include "range.h"
+#include "resolve.h"
 #include "server.h"
-
-static time_t
-parse_http_date(const char *s)
-{
-	struct tm tm;
-	char *end;
-
-	if (s == NULL || *s == '\0')
-	{
-		return (time_t)-1;
-	}
-
-	memset(&tm, 0, sizeof(tm));
-
-	/* RFC 1123 / HTTP-date format: "Wed, 21 Oct 2015 07:28:00 GMT" */
-	end = strptime(s, "%a, %d %b %Y %H:%M:%S GMT", &tm);
-	if (end == NULL)
-	{
-		return (time_t)-1;
-	}
-
-	/* Interpret as GMT */
-	return timegm(&tm);
-}
+#include "timefmt.h"
+#include "userdir.h"
 
 int
 validate_method(const char *method)
@@ -340,165 +330,662 @@ parse_request_line(char *line, char *method, size_t method_sz, char *path,
 	return 0;
 }
 
-enum HTTP_PARSE_RESULT
-parse_http_request(FILE *stream, struct http_request *request)
+/* Copies a slice into a fixed-size field. Returns -1 if it doesn't fit. */
+static int
+copy_slice(char *dst, size_t dstsz, const struct http_slice *s)
 {
-	char line[2048];
-	memset(request, 0, sizeof(*request));
+	if (s->len >= dstsz)
+	{
+		return -1;
+	}
+	memcpy(dst, s->p, s->len);
+	dst[s->len] = '\0';
+	return 0;
+}
+
+/* Applies the tokens of a Connection header to request->keep_alive */
+static void
+apply_connection_header(const struct http_slice *v,
+                        struct http_request *request)
+{
+	const char *p = v->p;
+	const char *end = v->p + v->len;
 
-	if (fgets(line, sizeof(line), stream) == NULL)
+	while (p < end)
 	{
-		return HTTP_PARSE_EOF;
+		struct http_slice tok;
+
+		while (p < end && (*p == ',' || *p == ' ' || *p == '\t'))
+		{
+			p++;
+		}
+		tok.p = p;
+		while (p < end && *p != ',' && *p != ' ' && *p != '\t')
+		{
+			p++;
+		}
+		tok.len = (size_t)(p - tok.p);
+
+		if (http_slice_eq(&tok, "close"))
+		{
+			request->keep_alive = 0;
+			return;
+		}
+		if (http_slice_eq(&tok, "keep-alive"))
+		{
+			request->keep_alive = 1;
+		}
 	}
+}
 
-	/* Store the original request line in the http_request struct for logging */
-	strncpy(request->request_line, line, sizeof(request->request_line) - 1);
-	request->request_line[sizeof(request->request_line) - 1] = '\0';
+enum HTTP_PARSE_RESULT
+http_request_from_parser(const struct http_parser *p,
+                         struct http_request *request)
+{
+	struct http_slice line;
+	const struct http_slice *v;
+
+	memset(request, 0, sizeof(*request));
 
-	if (parse_request_line(line, request->method, MAX_METHOD, request->path,
-	                       MAX_URI, request->version, MAX_VERSION) != 0)
+	/* The original request line, for logging */
+	line.p = p->method.p;
+	line.len = (size_t)(p->version.p + p->version.len - p->method.p);
+	if (line.len >= sizeof(request->request_line))
 	{
-		return HTTP_PARSE_LINE_FAILURE;
+		line.len = sizeof(request->request_line) - 1;
 	}
+	(void)copy_slice(request->request_line, sizeof(request->request_line),
+	                 &line);
 
-	if (validate_method(request->method) == -1)
+	if (copy_slice(request->method, MAX_METHOD, &p->method) < 0 ||
+	    validate_method(request->method) == -1)
 	{
 		return HTTP_PARSE_INVALID_METHOD;
 	}
-	if (validate_uri(request->path) == -1)
+	if (copy_slice(request->path, MAX_URI, &p->target) < 0 ||
+	    validate_uri(request->path) == -1)
 	{
 		return HTTP_PARSE_INVALID_URI;
 	}
-	if (validate_version(request->version) == -1)
+	if (copy_slice(request->version, MAX_VERSION, &p->version) < 0 ||
+	    validate_version(request->version) == -1)
 	{
 		return HTTP_PARSE_INVALID_VERSION;
 	}
 
-	request->if_modified_since[0] = '\0';
-	while (fgets(line, sizeof(line), stream) != NULL)
+	if ((v = http_parser_header(p, "If-Modified-Since")) != NULL)
+	{
+		struct http_slice ims = *v;
+		if (ims.len >= sizeof(request->if_modified_since))
+		{
+			ims.len = sizeof(request->if_modified_since) - 1;
+		}
+		(void)copy_slice(request->if_modified_since,
+		                 sizeof(request->if_modified_since), &ims);
+	}
+
+	/* Left empty if too long; the whole file is sent then */
+	if ((v = http_parser_header(p, "Range")) != NULL)
+	{
+		(void)copy_slice(request->range, sizeof(request->range), v);
+	}
+	if ((v = http_parser_header(p, "If-Range")) != NULL)
+	{
+		(void)copy_slice(request->if_range, sizeof(request->if_range), v);
+	}
+	if ((v = http_parser_header(p, "If-None-Match")) != NULL)
+	{
+		(void)copy_slice(request->if_none_match,
+		                 sizeof(request->if_none_match), v);
+	}
+	if ((v = http_parser_header(p, "Accept-Encoding")) != NULL)
+	{
+		request->accept_encoding = encoding_parse_accept(v->p, v->len);
+	}
+
+	/* HTTP/1.1 persists by default, HTTP/1.0 only when asked to */
+	request->keep_alive = (strcmp(request->version, "HTTP/1.1") == 0);
+	if ((v = http_parser_header(p, "Connection")) != NULL)
 	{
-		if (extract_header(line, "If-Modified-Since",
-		                   request->if_modified_since,
-		                   sizeof(request->if_modified_since)) == 0)
+		apply_connection_header(v, request);
+	}
+
+	return HTTP_PARSE_OK;
+}
+
+enum HTTP_PARSE_RESULT
+parse_http_request(int fd, char *buf, size_t *len, size_t *used,
+                   struct http_request *request)
+{
+	struct http_parser parser;
+	enum HTTP_PARSE_RESULT res;
+	long long received = 0;
+	ssize_t n;
+
+	memset(request, 0, sizeof(*request));
+	http_parser_init(&parser);
+	*used = 0;
+	if (*len > 0)
+	{
+		received = metrics_clock();
+	}
+
+	for (;;)
+	{
+		if ((n = http_parser_feed(&parser, buf, *len)) > 0)
+		{
+			*used = (size_t)n;
+			res = http_request_from_parser(&parser, request);
+			request->received = received;
+			return res;
+		}
+		if (n < 0 || *len == HTTP_MAX_HEAD)
+		{
+			/* Nothing sensible follows; drop what we have */
+			*used = *len;
+			return HTTP_PARSE_LINE_FAILURE;
+		}
+
+		n = read(fd, buf + *len, HTTP_MAX_HEAD - *len);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n > 0)
 		{
+			if (received == 0)
+			{
+				received = metrics_clock();
+			}
+			*len += (size_t)n;
 			continue;
 		}
 
-		if (strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0)
+		if (*len == 0)
 		{
-			break;
+			return HTTP_PARSE_EOF;
+		}
+		*used = *len;
+		if (!parser.have_request_line || *len + 2 > HTTP_MAX_HEAD)
+		{
+			return HTTP_PARSE_LINE_FAILURE;
+		}
+		/* Headers cut short by EOF: end them here */
+		memcpy(buf + *len, "\r\n", 2);
+		*len += 2;
+		*used = *len;
+		if (http_parser_feed(&parser, buf, *len) <= 0)
+		{
+			return HTTP_PARSE_LINE_FAILURE;
 		}
+		res = http_request_from_parser(&parser, request);
+		request->received = received;
+		return res;
 	}
+}
 
-	return HTTP_PARSE_OK;
+size_t
+format_entity_headers(char *buf, size_t bufsz, off_t len,
+                      const char *content_type, const char *last_modified,
+                      const char *extra)
+{
+	int n = snprintf(buf, bufsz,
+	                 "%s%s%s%sContent-Length: %lld\r\nContent-Type: %s\r\n",
+	                 last_modified ? "Last-Modified: " : "",
+	                 last_modified ? last_modified : "",
+	                 last_modified ? "\r\n" : "",
+	                 extra ? extra : "", (long long)len,
+	                 content_type ? content_type : "text/plain");
+
+	if (n < 0 || (size_t)n >= bufsz)
+	{
+		return 0;
+	}
+	return (size_t)n;
+}
+
+void
+write_http_head(struct outbuf *out, enum HTTP_STATUS_CODE status_code,
+                const char *status_text, const char *entity,
+                size_t entity_len, const struct http_response *resp)
+{
+	/* The whole head is formatted in one piece, to leave in one write */
+	(void)outbuf_printf(out,
+	                    "HTTP/1.1 %d %s\r\n"
+	                    "Date: %s\r\n"
+	                    "Server: sws/1.0\r\n"
+	                    "%.*s"
+	                    "Connection: %s\r\n"
+	                    "\r\n",
+	                    status_code, status_text, timefmt_http_now(),
+	                    (int)entity_len,
+	                    entity,
+	                    (resp && resp->keep_alive) ? "keep-alive" : "close");
+}
+
+static void
+write_http_headers(struct outbuf *out, enum HTTP_STATUS_CODE status_code,
+                   const char *status_text, off_t len,
+                   const char *content_type, const char *last_modified,
+                   const char *extra, const struct http_response *resp)
+{
+	char entity[1024];
+	size_t entity_len;
+
+	entity_len = format_entity_headers(entity, sizeof(entity), len,
+	                                   content_type, last_modified, extra);
+	if (entity_len == 0)
+	{
+		/* Absurdly long content type: drop it rather than the length */
+		entity_len = format_entity_headers(entity, sizeof(entity), len, NULL,
+		                                   last_modified, extra);
+	}
+	write_http_head(out, status_code, status_text, entity, entity_len,
+	                resp);
 }
 
 int
-craft_http_response(FILE *stream, enum HTTP_STATUS_CODE status_code,
+craft_http_response(struct outbuf *out, enum HTTP_STATUS_CODE status_code,
                     const char *status_text, const char *body,
                     const char *content_type, const char *last_modified,
                     int is_head, struct http_response *resp)
 {
-	time_t now = time(NULL);
-	struct tm gmt;
-	char date_buf[64];
 	size_t len = body ? strlen(body) : 0;
 
-	gmtime_r(&now, &gmt);
-	strftime(date_buf, sizeof(date_buf), "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+	write_http_headers(out, status_code, status_text, (off_t)len,
+	                   content_type, last_modified, NULL, resp);
+	if (!is_head && body)
+	{
+		(void)outbuf_copy(out, body, len);
+	}
 
-	fprintf(stream, "HTTP/1.0 %d %s\r\n", status_code, status_text);
-	fprintf(stream, "Date: %s\r\n", date_buf);
-	fprintf(stream, "Server: sws/1.0\r\n");
-	if (last_modified)
+	if (resp)
 	{
-		fprintf(stream, "Last-Modified: %s\r\n", last_modified);
+		resp->status_code = status_code;
+		resp->content_len = len;
 	}
-	fprintf(stream, "Content-Length: %zu\r\n", len);
-	fprintf(stream, "Content-Type: %s\r\n",
-	        content_type ? content_type : "text/plain");
-	fprintf(stream, "\r\n");
-	if (!is_head && body)
+
+	return 0;
+}
+
+int
+craft_http_file_response(struct outbuf *out, enum HTTP_STATUS_CODE status_code,
+                         const char *status_text, int fd, off_t len,
+                         const char *content_type, const char *last_modified,
+                         const char *extra, int is_head,
+                         struct http_response *resp)
+{
+	write_http_headers(out, status_code, status_text, len, content_type,
+	                   last_modified, extra, resp);
+
+	if (is_head)
 	{
-		fprintf(stream, "%s", body);
+		close(fd);
+	}
+	else
+	{
+		(void)outbuf_file(out, fd, 0, len);
 	}
 
 	if (resp)
 	{
 		resp->status_code = status_code;
-		resp->content_len = len;
+		resp->content_len = (size_t)len;
 	}
 
 	return 0;
 }
 
-static const char *
-guess_content_type(const char *path)
+/*
+ * Renders the strong entity tag of the file version 'st' into buf: inode,
+ * size and modification time in nanoseconds, so that changes within the
+ * same second still get a new tag.
+ */
+static void
+format_etag(const struct stat *st, char buf[HTTP_ETAG_LEN])
 {
-	static struct magic_set *ms = NULL;
-	const char *mime;
+	unsigned long long mtime_ns =
+		(unsigned long long)st->st_mtim.tv_sec * 1000000000ULL +
+		(unsigned long long)st->st_mtim.tv_nsec;
 
-	if (ms == NULL)
+	snprintf(buf, HTTP_ETAG_LEN, "\"%llx-%llx-%llx\"",
+	         (unsigned long long)st->st_ino, (unsigned long long)st->st_size,
+	         mtime_ns);
+}
+
+void
+http_static_headers(const struct stat *st, const char *ctype, char *etag,
+                    char *lastmod, char *extra)
+{
+	format_etag(st, etag);
+	timefmt_http(st->st_mtime, lastmod);
+	http_entity_extra(etag, ctype, NULL, extra);
+}
+
+void
+http_entity_extra(const char *etag, const char *ctype, const char *coding,
+                  char *extra)
+{
+	if (coding != NULL)
 	{
-		ms = magic_open(MAGIC_MIME_TYPE | MAGIC_ERROR);
-		if (ms == NULL)
+		snprintf(extra, HTTP_EXTRA_LEN,
+		         "ETag: %s\r\nContent-Encoding: %s\r\n"
+		         "Vary: Accept-Encoding\r\n",
+		         etag, coding);
+		return;
+	}
+	snprintf(extra, HTTP_EXTRA_LEN, "ETag: %s\r\nAccept-Ranges: bytes\r\n%s",
+	         etag, mime_compressible(ctype) ? "Vary: Accept-Encoding\r\n" : "");
+}
+
+/*
+ * Returns non-zero if the If-None-Match value 'list' ("*" or a list of
+ * entity tags) matches 'etag'. The comparison is weak: W/ is ignored.
+ */
+static int
+etag_list_matches(const char *list, const char *etag)
+{
+	size_t etag_len = strlen(etag);
+	const char *p = list;
+
+	for (;;)
+	{
+		const char *end;
+
+		while (*p == ' ' || *p == '\t' || *p == ',')
 		{
-			return "application/octet-stream";
+			p++;
 		}
-
-#if __sun
-		/* OmniOS */
-		if (magic_load(ms, "/opt/magic/share/misc/magic.mgc") != 0)
+		if (*p == '*')
 		{
-			magic_close(ms);
-			ms = NULL;
-			return "application/octet-stream";
+			return 1;
 		}
-#else
-		/* Linux/NetBSD */
-		if (magic_load(ms, NULL) != 0)
+		if (strncmp(p, "W/", 2) == 0)
 		{
-			magic_close(ms);
-			ms = NULL;
-			return "application/octet-stream";
+			p += 2;
 		}
-#endif
+		if (*p != '"' || (end = strchr(p + 1, '"')) == NULL)
+		{
+			return 0;
+		}
+		if ((size_t)(end + 1 - p) == etag_len &&
+		    memcmp(p, etag, etag_len) == 0)
+		{
+			return 1;
+		}
+		p = end + 1;
+	}
+}
+
+/*
+ * Returns non-zero if a Range header may be honoured for the file last
+ * modified at 'mtime': there is no If-Range, or it names the file's
+ * current entity tag (compared strongly) or Last-Modified date.
+ */
+static int
+range_applies(const struct http_request *req, time_t mtime, const char *etag)
+{
+	if (req->range[0] == '\0')
+	{
+		return 0;
+	}
+	if (req->if_range[0] == '\0')
+	{
+		return 1;
+	}
+	if (req->if_range[0] == '"')
+	{
+		return strcmp(req->if_range, etag) == 0;
+	}
+	return timefmt_parse_http(req->if_range) == mtime;
+}
+
+/*
+ * Answers a successful revalidation. Only the validator is repeated;
+ * there is no body, so there are no entity headers either.
+ */
+static void
+craft_http_not_modified(struct outbuf *out, const char *etag,
+                        struct http_response *resp)
+{
+	char entity[HTTP_ETAG_LEN + 16];
+	int len = snprintf(entity, sizeof(entity), "ETag: %s\r\n", etag);
+
+	write_http_head(out, HTTP_STATUS_NOT_MODIFIED, "Not Modified", entity,
+	                (size_t)len, resp);
+	resp->status_code = HTTP_STATUS_NOT_MODIFIED;
+	resp->content_len = 0;
+}
+
+/*
+ * Answers a request for byte ranges of the 'size' bytes at offset 'base'
+ * of the open file fd with 416 if none of them is satisfiable, with a
+ * single part, or with a multipart/byteranges body. Every part is sent
+ * straight from fd, which the response takes over.
+ */
+static void
+craft_http_range_response(struct outbuf *out, int fd, off_t base, off_t size,
+                          const struct byte_range *r, int n,
+                          const char *content_type, const char *last_modified,
+                          const char *extra, struct http_response *resp)
+{
+	char entity[1024];
+	char boundary[24];
+	int len;
+	long long total = 0;
+
+	if (n == 0)
+	{
+		const char *body = "416 Range Not Satisfiable\n";
+
+		close(fd);
+		len = snprintf(entity, sizeof(entity),
+		               "Content-Range: bytes */%lld\r\n"
+		               "Content-Length: %zu\r\n"
+		               "Content-Type: text/plain\r\n",
+		               (long long)size, strlen(body));
+		write_http_head(out, HTTP_STATUS_RANGE_NOT_SATISFIABLE,
+		                "Range Not Satisfiable", entity, (size_t)len, resp);
+		(void)outbuf_copy(out, body, strlen(body));
+		resp->status_code = HTTP_STATUS_RANGE_NOT_SATISFIABLE;
+		resp->content_len = strlen(body);
+		return;
+	}
+
+	if (n == 1)
+	{
+		total = (long long)(r[0].last - r[0].first + 1);
+		len = snprintf(entity, sizeof(entity),
+		               "Last-Modified: %s\r\n"
+		               "%s"
+		               "Content-Range: bytes %lld-%lld/%lld\r\n"
+		               "Content-Length: %lld\r\n"
+		               "Content-Type: %.200s\r\n",
+		               last_modified, extra, (long long)r[0].first,
+		               (long long)r[0].last, (long long)size, total,
+		               content_type);
+		write_http_head(out, HTTP_STATUS_PARTIAL_CONTENT, "Partial Content",
+		                entity, (size_t)len, resp);
+		(void)outbuf_file(out, fd, base + r[0].first, (off_t)total);
+		resp->status_code = HTTP_STATUS_PARTIAL_CONTENT;
+		resp->content_len = (size_t)total;
+		return;
+	}
+
+	/* Multipart: work out the length of the whole body first */
+	snprintf(boundary, sizeof(boundary), "%08lx%08lx",
+	         (unsigned long)random() ^ (unsigned long)getpid(),
+	         (unsigned long)random() ^ (unsigned long)timefmt_now());
+	for (int i = 0; i < n; i++)
+	{
+		total += snprintf(NULL, 0,
+		                  "\r\n--%s\r\nContent-Type: %.200s\r\n"
+		                  "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+		                  boundary, content_type, (long long)r[i].first,
+		                  (long long)r[i].last, (long long)size);
+		total += (long long)(r[i].last - r[i].first + 1);
+	}
+	total += (long long)strlen(boundary) + 8; /* "\r\n--" boundary "--\r\n" */
+
+	len = snprintf(entity, sizeof(entity),
+	               "Last-Modified: %s\r\n"
+	               "%s"
+	               "Content-Length: %lld\r\n"
+	               "Content-Type: multipart/byteranges; boundary=%s\r\n",
+	               last_modified, extra, total, boundary);
+	write_http_head(out, HTTP_STATUS_PARTIAL_CONTENT, "Partial Content",
+	                entity, (size_t)len, resp);
+	for (int i = 0; i < n; i++)
+	{
+		(void)outbuf_printf(out,
+		                    "\r\n--%s\r\nContent-Type: %.200s\r\n"
+		                    "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+		                    boundary, content_type, (long long)r[i].first,
+		                    (long long)r[i].last, (long long)size);
+		(void)outbuf_file(out, fd, base + r[i].first,
+		                  r[i].last - r[i].first + 1);
 	}
+	(void)outbuf_printf(out, "\r\n--%s--\r\n", boundary);
+	resp->status_code = HTTP_STATUS_PARTIAL_CONTENT;
+	resp->content_len = (size_t)total;
+}
 
-	mime = magic_file(ms, path);
-	if (mime == NULL)
+/*
+ * Answers with a 200 response built from a cache object. The body goes
+ * out without another copy; obj->body is consumed.
+ */
+static void
+craft_http_cached_response(struct outbuf *out, struct cache_object *obj,
+                           int is_head, struct http_response *resp)
+{
+	write_http_head(out, HTTP_STATUS_OK, "OK", obj->headers,
+	                obj->headers_len, resp);
+	if (!is_head)
+	{
+		(void)outbuf_take(out, obj->body, obj->body_len);
+	}
+	else
 	{
-		return "application/octet-stream";
+		free(obj->body);
 	}
+	obj->body = NULL;
 
-	return mime;
+	if (resp)
+	{
+		resp->status_code = HTTP_STATUS_OK;
+		resp->content_len = obj->body_len;
+	}
 }
 
-struct dir_entry
+/*
+ * Reads the whole (small) file behind fd into a new cache object.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+load_cache_object(int fd, const struct stat *st, const char *content_type,
+                  const char *last_modified, const char *extra,
+                  struct cache_object *obj)
 {
-	char *name;
-	int is_dir;
-};
+	size_t total = 0;
+
+	memset(obj, 0, sizeof(*obj));
+	obj->headers_len =
+		format_entity_headers(obj->headers, sizeof(obj->headers), st->st_size,
+	                          content_type, last_modified, extra);
+	if (obj->headers_len == 0)
+	{
+		return -1;
+	}
+	strncpy(obj->content_type, content_type, sizeof(obj->content_type) - 1);
+	strncpy(obj->last_modified, last_modified,
+	        sizeof(obj->last_modified) - 1);
+
+	if ((obj->body = malloc((size_t)st->st_size + 1)) == NULL)
+	{
+		return -1;
+	}
+
+	while (total < (size_t)st->st_size)
+	{
+		ssize_t n = pread(fd, obj->body + total, (size_t)st->st_size - total,
+		                  (off_t)total);
+		if (n <= 0)
+		{
+			/* Changed underneath us; let the caller fall back */
+			free(obj->body);
+			obj->body = NULL;
+			return -1;
+		}
+		total += (size_t)n;
+	}
+	obj->body_len = total;
+	return 0;
+}
 
+/*
+ * Answers with the generated index of the directory 'path', open as 'fd'
+ * (which is closed) and described by 'st'. Listings are kept in the
+ * shared cache under the directory's version, so they are only rendered
+ * again once it changes.
+ */
 static int
-dir_entry_cmp(const void *a, const void *b)
+serve_autoindex(struct outbuf *out, int fd, const char *path,
+                const struct stat *st, const char *uri, int is_head,
+                struct http_response *resp)
 {
-	const struct dir_entry *ea = a;
-	const struct dir_entry *eb = b;
-	return strcmp(ea->name, eb->name);
+	struct cache_object obj;
+	char key[CACHE_MAX_KEY];
+	char lastmod[HTTP_DATE_LEN + 1];
+	int cacheable;
+
+	/* The URI is part of the key: it names the page and anchors the links */
+	cacheable = cache_enabled() &&
+	            snprintf(key, sizeof(key), "%s\n%s", path, uri) <
+	                (int)sizeof(key);
+	if (cacheable && cache_lookup(key, st, &obj) == 0)
+	{
+		close(fd);
+		craft_http_cached_response(out, &obj, is_head, resp);
+		return 0;
+	}
+
+	memset(&obj, 0, sizeof(obj));
+	if (autoindex_render(fd, uri, &obj.body, &obj.body_len) < 0)
+	{
+		int nomem = (errno == ENOMEM);
+		const char *body = nomem ? "500 Internal Server Error\n"
+		                         : "403 Forbidden\n";
+		craft_http_response(out,
+		                    nomem ? HTTP_STATUS_INTERNAL_SERVER_ERROR
+		                          : HTTP_STATUS_FORBIDDEN,
+		                    nomem ? "Internal Server Error" : "Forbidden",
+		                    body, "text/plain", NULL, is_head, resp);
+		return -1;
+	}
+
+	/* Last-Modified from directory's mtime */
+	timefmt_http(st->st_mtime, lastmod);
+	obj.headers_len = format_entity_headers(
+		obj.headers, sizeof(obj.headers), (off_t)obj.body_len, "text/html",
+		lastmod, NULL);
+	strcpy(obj.content_type, "text/html");
+	strcpy(obj.last_modified, lastmod);
+	if (cacheable)
+	{
+		(void)cache_store(key, st, &obj);
+	}
+	craft_http_cached_response(out, &obj, is_head, resp);
+	return 0;
 }
 
 static int
-serve_static_file(FILE *stream, const struct http_request *req,
+serve_static_file(struct outbuf *out, const struct http_request *req,
                   const struct server_config *cfg, int is_head,
                   struct http_response *resp)
 {
 	char fullpath[PATH_MAX];
 	struct stat st;
-	int fd;
-	char *buf;
-	ssize_t nread;
-	size_t total = 0;
+	int rootfd, fd, is_index;
 
 	const char *uri = req->path;
 	const char *base = NULL;    /* docroot or user sws dir */
@@ -512,7 +999,7 @@ serve_static_file(FILE *stream, const struct http_request *req,
 		/* /~user[/... ] → /home/user/sws[/...] */
 		const char *user_start = uri + 2;
 		const char *slash = strchr(user_start, '/');
-		char username[64];
+		char username[USERDIR_MAX_NAME];
 
 		if (slash)
 		{
@@ -520,7 +1007,7 @@ serve_static_file(FILE *stream, const struct http_request *req,
 			if (ulen == 0 || ulen >= sizeof(username))
 			{
 				const char *body = "404 Not Found\n";
-				craft_http_response(stream, HTTP_STATUS_NOT_FOUND, "Not Found",
+				craft_http_response(out, HTTP_STATUS_NOT_FOUND, "Not Found",
 				                    body, "text/plain", NULL, is_head, resp);
 				return -1;
 			}
@@ -535,7 +1022,7 @@ serve_static_file(FILE *stream, const struct http_request *req,
 			if (ulen == 0 || ulen >= sizeof(username))
 			{
 				const char *body = "404 Not Found\n";
-				craft_http_response(stream, HTTP_STATUS_NOT_FOUND, "Not Found",
+				craft_http_response(out, HTTP_STATUS_NOT_FOUND, "Not Found",
 				                    body, "text/plain", NULL, is_head, resp);
 				return -1;
 			}
@@ -543,24 +1030,22 @@ serve_static_file(FILE *stream, const struct http_request *req,
 			subpath = "/"; /* inside ~/sws */
 		}
 
-		struct passwd *pw = getpwnam(username);
-		if (!pw)
+		/* Answered from the cache of user lookups, if enabled */
+		if (userdir_root(username, user_root, sizeof(user_root)) < 0)
 		{
+			if (errno == ENAMETOOLONG)
+			{
+				const char *body = "500 Internal Server Error\n";
+				craft_http_response(out, HTTP_STATUS_INTERNAL_SERVER_ERROR,
+				                    "Internal Server Error", body,
+				                    "text/plain", NULL, is_head, resp);
+				return -1;
+			}
 			const char *body = "404 Not Found\n";
-			craft_http_response(stream, HTTP_STATUS_NOT_FOUND, "Not Found",
+			craft_http_response(out, HTTP_STATUS_NOT_FOUND, "Not Found",
 			                    body, "text/plain", NULL, is_head, resp);
 			return -1;
 		}
-
-		if (snprintf(user_root, sizeof(user_root), "%s/sws", pw->pw_dir) >=
-		    (int)sizeof(user_root))
-		{
-			const char *body = "500 Internal Server Error\n";
-			craft_http_response(stream, HTTP_STATUS_INTERNAL_SERVER_ERROR,
-			                    "Internal Server Error", body, "text/plain",
-			                    NULL, is_head, resp);
-			return -1;
-		}
 		base = user_root;
 	}
 	else
@@ -572,49 +1057,66 @@ serve_static_file(FILE *stream, const struct http_request *req,
 	if (base == NULL)
 	{
 		const char *body = "500 Internal Server Error\n";
-		craft_http_response(stream, HTTP_STATUS_INTERNAL_SERVER_ERROR,
+		craft_http_response(out, HTTP_STATUS_INTERNAL_SERVER_ERROR,
 		                    "Internal Server Error", body, "text/plain", NULL,
 		                    is_head, resp);
 		return -1;
 	}
 
-	/* Build full path: base + subpath */
+	/*
+	 * The full path (base + subpath) names the file in cache keys and for
+	 * its type; the file itself is looked up beneath the root's descriptor.
+	 */
 	if (snprintf(fullpath, sizeof(fullpath), "%s%s", base, subpath) >=
 	    (int)sizeof(fullpath))
 	{
 		const char *body = "414 Request-URI Too Long\n";
-		craft_http_response(stream, HTTP_STATUS_BAD_REQUEST, "Bad Request",
+		craft_http_response(out, HTTP_STATUS_BAD_REQUEST, "Bad Request",
 		                    body, "text/plain", NULL, is_head, resp);
 		return -1;
 	}
 
-	if (stat(fullpath, &st) == -1)
+	/* A directory comes back as its index.html, if it has one */
+	fd = -1;
+	if ((rootfd = resolve_root(base)) >= 0)
 	{
+		fd = fdcache_open(rootfd, fullpath, subpath, 1, &st, &is_index);
+	}
+	if (fd < 0)
+	{
+		if (errno == EACCES)
+		{
+			const char *body = "403 Forbidden\n";
+			craft_http_response(out, HTTP_STATUS_FORBIDDEN, "Forbidden",
+			                    body, "text/plain", NULL, is_head, resp);
+			return -1;
+		}
 		const char *body = "404 Not Found\n";
-		craft_http_response(stream, HTTP_STATUS_NOT_FOUND, "Not Found", body,
+		craft_http_response(out, HTTP_STATUS_NOT_FOUND, "Not Found", body,
 		                    "text/plain", NULL, is_head, resp);
 		return -1;
 	}
 
+	/* If-None-Match takes precedence over If-Modified-Since */
 	time_t ims = (time_t)-1;
-	if (req->if_modified_since[0] != '\0')
+	if (req->if_modified_since[0] != '\0' && req->if_none_match[0] == '\0')
 	{
-		ims = parse_http_date(req->if_modified_since);
+		ims = timefmt_parse_http(req->if_modified_since);
 	}
 
 	/* ----- Directory handling (index.html or auto index) ----- */
 
-	if (S_ISDIR(st.st_mode))
+	if (is_index || S_ISDIR(st.st_mode))
 	{
 		char indexpath[PATH_MAX];
-		struct stat st_index;
 
 		if (snprintf(indexpath, sizeof(indexpath), "%s%s%s", base, subpath,
 		             (subpath[strlen(subpath) - 1] == '/') ? "" : "/") >=
 		    (int)sizeof(indexpath))
 		{
+			close(fd);
 			const char *body = "400 Bad Request\n";
-			craft_http_response(stream, HTTP_STATUS_BAD_REQUEST, "Bad Request",
+			craft_http_response(out, HTTP_STATUS_BAD_REQUEST, "Bad Request",
 			                    body, "text/plain", NULL, is_head, resp);
 			return -1;
 		}
@@ -622,239 +1124,310 @@ serve_static_file(FILE *stream, const struct http_request *req,
 		strncat(indexpath, "index.html",
 		        sizeof(indexpath) - strlen(indexpath) - 1);
 
-		/* If index.html exists and is a regular file, serve that */
-		if (stat(indexpath, &st_index) == 0 && S_ISREG(st_index.st_mode))
+		/* fd and st are those of index.html, if it was found */
+		if (is_index)
 		{
 			strncpy(fullpath, indexpath, sizeof(fullpath));
 			fullpath[sizeof(fullpath) - 1] = '\0';
-			st = st_index; /* use index's st for Last-Modified */
 		}
 		else
 		{
 			/* No index.html: conditional 304 based on directory mtime */
 			if (ims != (time_t)-1 && st.st_mtime <= ims)
 			{
-				craft_http_response(stream, HTTP_STATUS_NOT_MODIFIED,
+				close(fd);
+				craft_http_response(out, HTTP_STATUS_NOT_MODIFIED,
 				                    "Not Modified", NULL, NULL, NULL, is_head,
 				                    resp);
 				return 0;
 			}
 
 			/* No index.html: generate a directory index */
-			DIR *dir = opendir(fullpath);
-			if (!dir)
-			{
-				const char *body = "403 Forbidden\n";
-				craft_http_response(stream, HTTP_STATUS_FORBIDDEN, "Forbidden",
-				                    body, "text/plain", NULL, is_head, resp);
-				return -1;
-			}
-
-			struct dir_entry *entries = NULL;
-			size_t nent = 0, cap = 0;
-			struct dirent *de;
-
-			while ((de = readdir(dir)) != NULL)
-			{
-				const char *name = de->d_name;
-				if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
-				{
-					continue;
-				}
-				if (name[0] == '.')
-				{
-					/* hidden files ignored */
-					continue;
-				}
+			return serve_autoindex(out, fd, fullpath, &st, req->path,
+			                       is_head, resp);
+		}
+	}
 
-				if (nent == cap)
-				{
-					size_t newcap = cap ? cap * 2 : 16;
-					struct dir_entry *tmp =
-						realloc(entries, newcap * sizeof(*entries));
-					if (!tmp)
-					{
-						closedir(dir);
-						free(entries);
-						const char *body = "500 Internal Server Error\n";
-						craft_http_response(stream,
-						                    HTTP_STATUS_INTERNAL_SERVER_ERROR,
-						                    "Internal Server Error", body,
-						                    "text/plain", NULL, is_head, resp);
-						return -1;
-					}
-					entries = tmp;
-					cap = newcap;
-				}
+	/* ----- Regular file serving ----- */
 
-				entries[nent].name = strdup(name);
-				if (!entries[nent].name)
-				{
-					closedir(dir);
-					for (size_t i = 0; i < nent; i++)
-					{
-						free(entries[i].name);
-					}
-					free(entries);
-					const char *body = "500 Internal Server Error\n";
-					craft_http_response(stream,
-					                    HTTP_STATUS_INTERNAL_SERVER_ERROR,
-					                    "Internal Server Error", body,
-					                    "text/plain", NULL, is_head, resp);
-					return -1;
-				}
+	if (!S_ISREG(st.st_mode))
+	{
+		close(fd);
+		const char *body = "403 Forbidden\n";
+		craft_http_response(out, HTTP_STATUS_FORBIDDEN, "Forbidden", body,
+		                    "text/plain", NULL, is_head, resp);
+		return -1;
+	}
 
-				/* Determine if this entry is a directory */
-				char pathbuf[PATH_MAX];
-				entries[nent].is_dir = 0;
-				if (snprintf(pathbuf, sizeof(pathbuf), "%s/%s", fullpath,
-				             name) < (int)sizeof(pathbuf) &&
-				    stat(pathbuf, &st_index) == 0 && S_ISDIR(st_index.st_mode))
-				{
-					entries[nent].is_dir = 1;
-				}
+	/* Files entered at startup come with their type and headers ready */
+	const struct manifest_entry *known = manifest_lookup(fullpath, &st);
+	char etag[HTTP_ETAG_LEN];
+	if (known != NULL)
+	{
+		strcpy(etag, known->etag);
+	}
+	else
+	{
+		format_etag(&st, etag);
+	}
 
-				nent++;
-			}
-			closedir(dir);
+	/* Ranges are only defined for GET */
+	int want_ranges = !is_head && range_applies(req, st.st_mtime, etag);
 
-			qsort(entries, nent, sizeof(*entries), dir_entry_cmp);
+	/*
+	 * Send a precompressed sidecar in place of the file if the client
+	 * takes its coding. Ranges are always of the identity representation.
+	 * The type is only looked up (maybe sniffed) once there is a sidecar.
+	 */
+	const char *served = fullpath;
+	const char *coding = NULL;
+	const char *ctype = known ? known->content_type : NULL;
+	char sidecar[PATH_MAX];
 
-			/* Build HTML body */
-			size_t body_cap = 8192;
-			char *body = malloc(body_cap);
-			if (!body)
-			{
-				for (size_t i = 0; i < nent; i++)
-				{
-					free(entries[i].name);
-				}
-				free(entries);
-				const char *msg = "500 Internal Server Error\n";
-				craft_http_response(stream, HTTP_STATUS_INTERNAL_SERVER_ERROR,
-				                    "Internal Server Error", msg, "text/plain",
-				                    NULL, is_head, resp);
-				return -1;
-			}
-			body[0] = '\0';
+	if (!want_ranges && req->accept_encoding != 0)
+	{
+		struct stat sidecar_st;
+		int sidecar_fd;
 
-			snprintf(body, body_cap,
-			         "<html><head><title>Index of %s</title></head><body>\n"
-			         "<h1>Index of %s</h1>\n<ul>\n",
-			         req->path, req->path);
+		coding = encoding_sidecar(rootfd, fullpath, fullpath + strlen(base),
+		                          &st, req->accept_encoding, sidecar,
+		                          sizeof(sidecar), &sidecar_fd, &sidecar_st);
+		if (coding != NULL && ctype == NULL)
+		{
+			ctype = mime_type(fullpath, &st);
+		}
+		if (coding != NULL && mime_compressible(ctype))
+		{
+			close(fd);
+			fd = sidecar_fd;
+			served = sidecar;
+			st = sidecar_st;
+			format_etag(&st, etag);
+		}
+		else if (coding != NULL)
+		{
+			close(sidecar_fd);
+			coding = NULL;
+		}
+	}
 
-			for (size_t i = 0; i < nent; i++)
-			{
-				char line[PATH_MAX + 64];
-				const char *slash = entries[i].is_dir ? "/" : "";
-				snprintf(line, sizeof(line),
-				         "<li><a href=\"%s%s\">%s%s</a></li>\n",
-				         entries[i].name, slash, entries[i].name, slash);
-				if (strlen(body) + strlen(line) + 1 < body_cap)
-				{
-					strcat(body, line);
-				}
-			}
+	/* Revalidation is answered from the metadata alone */
+	if (req->if_none_match[0] != '\0'
+	        ? etag_list_matches(req->if_none_match, etag)
+	        : ims != (time_t)-1 && st.st_mtime <= ims)
+	{
+		close(fd);
+		craft_http_not_modified(out, etag, resp);
+		return 0;
+	}
 
-			strncat(body, "</ul>\n</body></html>\n",
-			        body_cap - strlen(body) - 1);
+	/* Hot small files come straight out of the shared cache */
+	if (!want_ranges && cache_enabled() && st.st_size <= CACHE_MAX_OBJECT)
+	{
+		struct cache_object obj;
+		if (cache_lookup(served, &st, &obj) == 0)
+		{
+			close(fd);
+			craft_http_cached_response(out, &obj, is_head, resp);
+			return 0;
+		}
+	}
 
-			/* Last-Modified from directory's mtime */
-			char lastmod[64];
-			struct tm gmt;
-			gmtime_r(&st.st_mtime, &gmt);
-			strftime(lastmod, sizeof(lastmod), "%a, %d %b %Y %H:%M:%S GMT",
-			         &gmt);
+	/* Validators and the rest of the headers, for what was opened */
+	char lastmod_buf[HTTP_DATE_LEN + 1];
+	char extra_buf[HTTP_EXTRA_LEN];
+	const char *lastmod = lastmod_buf;
+	const char *extra = extra_buf;
 
-			craft_http_response(stream, HTTP_STATUS_OK, "OK", body, "text/html",
-			                    lastmod, is_head, resp);
+	if (ctype == NULL)
+	{
+		ctype = mime_type(fullpath, &st);
+	}
+	if (coding != NULL)
+	{
+		timefmt_http(st.st_mtime, lastmod_buf);
+		http_entity_extra(etag, ctype, coding, extra_buf);
+	}
+	else if (known != NULL)
+	{
+		lastmod = known->last_modified;
+		extra = known->extra;
+	}
+	else
+	{
+		http_static_headers(&st, ctype, etag, lastmod_buf, extra_buf);
+	}
 
-			for (size_t i = 0; i < nent; i++)
-			{
-				free(entries[i].name);
-			}
-			free(entries);
-			free(body);
+	/* Parts of the file go out straight from fd, like the whole file */
+	if (want_ranges)
+	{
+		struct byte_range ranges[HTTP_MAX_RANGES];
+		int n = http_parse_range(req->range, st.st_size, ranges,
+		                         HTTP_MAX_RANGES);
+		if (n >= 0)
+		{
+			craft_http_range_response(out, fd, 0, st.st_size, ranges, n,
+			                          ctype, lastmod, extra, resp);
 			return 0;
 		}
 	}
 
-	/* ----- Regular file serving ----- */
-
-	/* For regular files, possibly return 304 instead of body */
-	if (ims != (time_t)-1 && st.st_mtime <= ims)
+	if (cache_enabled() && st.st_size <= CACHE_MAX_OBJECT)
 	{
-		craft_http_response(stream, HTTP_STATUS_NOT_MODIFIED, "Not Modified",
-		                    NULL, NULL, NULL, is_head, resp);
-		return 0;
+		struct cache_object obj;
+		if (load_cache_object(fd, &st, ctype, lastmod, extra, &obj) == 0)
+		{
+			close(fd);
+			(void)cache_store(served, &st, &obj);
+			craft_http_cached_response(out, &obj, is_head, resp);
+			return 0;
+		}
 	}
 
-	if (!S_ISREG(st.st_mode))
+	/* The body goes out straight from fd, after the headers */
+	craft_http_file_response(out, HTTP_STATUS_OK, "OK", fd, st.st_size,
+	                         ctype, lastmod, extra, is_head, resp);
+	return 0;
+}
+
+/*
+ * Answers from the site pack (-A): the entry for the request path holds
+ * its validators and headers, so nothing on disk is looked at.
+ */
+static int
+serve_packed_file(struct outbuf *out, const struct http_request *req,
+                  int is_head, struct http_response *resp)
+{
+	const struct pack_entry *e = pack_lookup(req->path);
+	const struct pack_span *headers, *body;
+	const char *etag;
+	int fd = -1;
+
+	if (e == NULL)
 	{
-		const char *body = "403 Forbidden\n";
-		craft_http_response(stream, HTTP_STATUS_FORBIDDEN, "Forbidden", body,
+		const char *body = "404 Not Found\n";
+		craft_http_response(out, HTTP_STATUS_NOT_FOUND, "Not Found", body,
 		                    "text/plain", NULL, is_head, resp);
 		return -1;
 	}
 
-	fd = open(fullpath, O_RDONLY);
-	if (fd == -1)
+	/* Ranges are of the identity representation, as for files */
+	etag = pack_at(e->etag);
+	int want_ranges = !is_head && range_applies(req, (time_t)e->mtime, etag);
+	int coded = !want_ranges && (req->accept_encoding & ENC_GZIP) &&
+	            e->gz_body.len > 0;
+
+	headers = coded ? &e->gz_headers : &e->headers;
+	body = coded ? &e->gz_body : &e->body;
+	if (coded)
 	{
-		const char *body = "403 Forbidden\n";
-		craft_http_response(stream, HTTP_STATUS_FORBIDDEN, "Forbidden", body,
-		                    "text/plain", NULL, is_head, resp);
-		return -1;
+		etag = pack_at(e->gz_etag);
 	}
 
-	buf = malloc(st.st_size + 1);
-	if (!buf)
+	/* If-None-Match takes precedence over If-Modified-Since */
+	time_t ims = (time_t)-1;
+	if (req->if_modified_since[0] != '\0' && req->if_none_match[0] == '\0')
+	{
+		ims = timefmt_parse_http(req->if_modified_since);
+	}
+	if (req->if_none_match[0] != '\0'
+	        ? etag_list_matches(req->if_none_match, etag)
+	        : ims != (time_t)-1 && (time_t)e->mtime <= ims)
+	{
+		craft_http_not_modified(out, etag, resp);
+		return 0;
+	}
+
+	/*
+	 * Larger bodies go out from a descriptor of their own pack, which
+	 * stays readable even if the pack is replaced before they are sent.
+	 */
+	if ((want_ranges || (!is_head && body->len > PACK_COPY_MAX)) &&
+	    (fd = fcntl(pack_fd(), F_DUPFD_CLOEXEC, 0)) < 0)
 	{
-		close(fd);
 		const char *body = "500 Internal Server Error\n";
-		craft_http_response(stream, HTTP_STATUS_INTERNAL_SERVER_ERROR,
+		craft_http_response(out, HTTP_STATUS_INTERNAL_SERVER_ERROR,
 		                    "Internal Server Error", body, "text/plain", NULL,
 		                    is_head, resp);
 		return -1;
 	}
 
-	while ((nread = read(fd, buf + total, st.st_size - total)) > 0)
+	if (want_ranges)
 	{
-		total += (size_t)nread;
+		struct byte_range ranges[HTTP_MAX_RANGES];
+		int n = http_parse_range(req->range, (off_t)e->body.len, ranges,
+		                         HTTP_MAX_RANGES);
+		if (n >= 0)
+		{
+			craft_http_range_response(out, fd, (off_t)e->body.off,
+			                          (off_t)e->body.len, ranges, n,
+			                          pack_at(e->content_type),
+			                          pack_at(e->last_modified),
+			                          pack_at(e->extra), resp);
+			return 0;
+		}
 	}
-	close(fd);
-	buf[total] = '\0';
 
-	const char *ctype = guess_content_type(fullpath);
+	write_http_head(out, HTTP_STATUS_OK, "OK", pack_at(*headers),
+	                (size_t)headers->len, resp);
+	if (fd >= 0)
+	{
+		(void)outbuf_file(out, fd, (off_t)body->off, (off_t)body->len);
+	}
+	else if (!is_head)
+	{
+		(void)outbuf_copy(out, pack_at(*body), (size_t)body->len);
+	}
+	resp->status_code = HTTP_STATUS_OK;
+	resp->content_len = (size_t)body->len;
+	return 0;
+}
 
-	/* Last-Modified for this file */
-	char lastmod[64];
-	struct tm gmt;
-	gmtime_r(&st.st_mtime, &gmt);
-	strftime(lastmod, sizeof(lastmod), "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+int
+is_cgi_request(const struct http_request *req, const struct server_config *cfg)
+{
+	char norm[PATH_MAX];
+
+	if (cfg == NULL || cfg->cgi_dir == NULL)
+	{
+		return 0;
+	}
+	if (normalize_path(req->path, norm, sizeof(norm)) < 0)
+	{
+		return 0;
+	}
+	return strncmp(norm, "/cgi-bin/", 9) == 0;
+}
 
-	craft_http_response(stream, HTTP_STATUS_OK, "OK", buf, ctype, lastmod,
-	                    is_head, resp);
+/* Answers /server-status with the live metrics (-s) */
+static int
+serve_status_page(struct outbuf *out, int is_head, struct http_response *resp)
+{
+	char *text = metrics_render();
 
-	free(buf);
+	if (text == NULL)
+	{
+		const char *body = "500 Internal Server Error\n";
+		craft_http_response(out, HTTP_STATUS_INTERNAL_SERVER_ERROR,
+		                    "Internal Server Error", body, "text/plain", NULL,
+		                    is_head, resp);
+		return -1;
+	}
+	craft_http_response(out, HTTP_STATUS_OK, "OK", text,
+	                    "text/plain; version=0.0.4", NULL, is_head, resp);
+	free(text);
 	return 0;
 }
 
 int
-handle_http_connection(FILE *stream, const struct server_config *cfg,
-                       struct http_request *req, struct http_response *resp)
+respond_http_request(struct outbuf *out, const struct server_config *cfg,
+                     enum HTTP_PARSE_RESULT res, struct http_request *req,
+                     struct http_response *resp)
 {
-	enum HTTP_PARSE_RESULT res;
 	int is_head = 0;
 
-	memset(req, 0, sizeof(*req));
 	memset(resp, 0, sizeof(*resp));
 
-	res = parse_http_request(stream, req);
-
-#ifdef __sun
-	fseek(stream, 0, SEEK_SET);
-#endif
-
 	if (res != HTTP_PARSE_OK)
 	{
 		enum HTTP_STATUS_CODE status;
@@ -885,19 +1458,21 @@ handle_http_connection(FILE *stream, const struct server_config *cfg,
 			break;
 		}
 
-		craft_http_response(stream, status, text, body, "text/plain", NULL, 0,
+		/* We don't know where this request ends; don't read past it */
+		craft_http_response(out, status, text, body, "text/plain", NULL, 0,
 		                    resp);
 		return -1;
 	}
 
 	is_head = (strcmp(req->method, "HEAD") == 0);
+	resp->keep_alive = req->keep_alive;
 
 	/* Normalize path (forbid traversal, canonicalize segments) */
 	char norm[PATH_MAX];
 	if (normalize_path(req->path, norm, sizeof(norm)) < 0)
 	{
 		const char *body = "400 Bad Request\n";
-		craft_http_response(stream, HTTP_STATUS_BAD_REQUEST, "Bad Request",
+		craft_http_response(out, HTTP_STATUS_BAD_REQUEST, "Bad Request",
 		                    body, "text/plain", NULL, is_head, resp);
 		return -1;
 	}
@@ -906,26 +1481,38 @@ handle_http_connection(FILE *stream, const struct server_config *cfg,
 	strncpy(req->path, norm, sizeof(req->path));
 	req->path[sizeof(req->path) - 1] = '\0';
 
+	if (cfg && cfg->status_page && strcmp(req->path, "/server-status") == 0)
+	{
+		return serve_status_page(out, is_head, resp);
+	}
+
 	/* CGI: /cgi-bin/... and cgi_dir configured */
 	if (cfg && cfg->cgi_dir && strncmp(req->path, "/cgi-bin/", 9) == 0)
 	{
-		fflush(stream); /* flush any buffered input/output */
-
-		if (cgi_handle(stream, req, cfg->cgi_dir, is_head, resp) < 0)
+		int rc = fcgi_handles(req, cfg)
+		             ? fcgi_handle(out, req, cfg, is_head, resp)
+		             : cgi_handle(out, req, cfg->cgi_dir, is_head, resp);
+		if (rc < 0)
 		{
 			const char *body = "500 Internal Server Error\n";
-			craft_http_response(stream, HTTP_STATUS_INTERNAL_SERVER_ERROR,
+			craft_http_response(out, HTTP_STATUS_INTERNAL_SERVER_ERROR,
 			                    "Internal Server Error", body, "text/plain",
 			                    NULL, is_head, resp);
 			return -1;
 		}
-		/* cgi_handle already sent a full HTTP response and filled resp */
+		/* The handler has built a full HTTP response and filled resp */
 		return 0;
 	}
 
+	/* The site pack answers for everything but the users' pages */
+	if (cfg && cfg->pack && strncmp(req->path, "/~", 2) != 0)
+	{
+		return serve_packed_file(out, req, is_head, resp);
+	}
+
 	/* HEAD: we can still reuse serve_static_file, then ignore body later if
 	   needed. */
-	if (serve_static_file(stream, req, cfg, is_head, resp) < 0)
+	if (serve_static_file(out, req, cfg, is_head, resp) < 0)
 	{
 		/* serve_static_file already sent an error */
 		return -1;
@@ -933,4 +1520,3 @@ handle_http_connection(FILE *stream, const struct server_config *cfg,
 
 	return 0;
 }
-
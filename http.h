@@ -1,5 +1,8 @@
 #pragma once
 
+#include <sys/stat.h>
+#include <sys/types.h>
+
 #include <stdio.h>
 
 #define MAX_METHOD 16
@@ -7,22 +10,54 @@
 #define MAX_VERSION 16
 #define MAX_HEADER_VALUE 256
 
+/* A quoted entity tag and its NUL */
+#define HTTP_ETAG_LEN 56
+
+/* Header lines sent along with a static file besides its length and type */
+#define HTTP_EXTRA_LEN 192
+
 struct http_request
 {
 	char method[MAX_METHOD];
 	char path[MAX_URI];
 	char version[MAX_VERSION];
 	char if_modified_since[MAX_HEADER_VALUE];
+
+	/* Range and If-Range; empty if absent (or too long to honour) */
+	char range[MAX_HEADER_VALUE];
+	char if_range[MAX_HEADER_VALUE];
+
+	/* Entity tags of If-None-Match; empty if absent (or too long) */
+	char if_none_match[MAX_HEADER_VALUE];
+
+	/* ENC_* content codings named by Accept-Encoding */
+	int accept_encoding;
 	char request_line[MAX_URI + MAX_METHOD + MAX_VERSION + 4];
+
+	/*
+	 * Non-zero if the client allows the connection to persist after this
+	 * request (HTTP/1.1 without "Connection: close", or HTTP/1.0 with
+	 * "Connection: keep-alive"). Callers may clear it before responding,
+	 * e.g. once a connection has served its maximum number of requests.
+	 */
+	int keep_alive;
+
+	/* metrics_clock() when the request's first byte was in hand (or 0) */
+	long long received;
 };
 
 struct http_response
 {
 	int status_code;
 	size_t content_len;
+
+	/* Non-zero if the response announced "Connection: keep-alive" */
+	int keep_alive;
 };
 
 struct server_config;
+struct http_parser;
+struct outbuf;
 
 enum HTTP_PARSE_RESULT
 {
@@ -40,6 +75,7 @@ enum HTTP_STATUS_CODE
 	HTTP_STATUS_CREATED = 201,
 	HTTP_STATUS_ACCEPTED = 202,
 	HTTP_STATUS_NO_CONTENT = 204,
+	HTTP_STATUS_PARTIAL_CONTENT = 206,
 	HTTP_STATUS_MOVED_PERMANENTLY = 301,
 	HTTP_STATUS_MOVED_TEMPORARILY = 302,
 	HTTP_STATUS_NOT_MODIFIED = 304,
@@ -47,6 +83,7 @@ enum HTTP_STATUS_CODE
 	HTTP_STATUS_UNAUTHORIZED = 401,
 	HTTP_STATUS_FORBIDDEN = 403,
 	HTTP_STATUS_NOT_FOUND = 404,
+	HTTP_STATUS_RANGE_NOT_SATISFIABLE = 416,
 	HTTP_STATUS_INTERNAL_SERVER_ERROR = 500,
 	HTTP_STATUS_NOT_IMPLEMENTED = 501,
 	HTTP_STATUS_BAD_GATEWAY = 502,
@@ -99,26 +136,96 @@ int parse_request_line(char *line, char *method, size_t method_sz, char *path,
                        size_t path_sz, char *version, size_t version_sz);
 
 /*
- * Parses an HTTP request from the given stream into the http_request struct.
+ * Fills the http_request struct from a complete request head.
+ * Returns an HTTP_PARSE_RESULT indicating success or type of failure.
+ */
+enum HTTP_PARSE_RESULT http_request_from_parser(const struct http_parser *p,
+                                                struct http_request *request);
+
+/*
+ * Reads the next HTTP request from fd into the http_request struct.
+ * buf (HTTP_MAX_HEAD bytes) holds *len bytes already received, e.g. a
+ * pipelined request; reading stops once the head is complete. *used is
+ * set to the number of bytes the request took up (everything on
+ * failure), which the caller drops from buf before the next call.
  * Returns an HTTP_PARSE_RESULT indicating success or type of failure.
  */
-enum HTTP_PARSE_RESULT parse_http_request(FILE *stream,
+enum HTTP_PARSE_RESULT parse_http_request(int fd, char *buf, size_t *len,
+                                          size_t *used,
                                           struct http_request *request);
 /*
- * Crafts and writes an HTTP response to the given stream.
+ * Crafts an HTTP response into the given output buffer.
  * If is_head is non-zero, the body will not be included in the response.
  * Returns 0 on success.
  */
-int craft_http_response(FILE *stream, enum HTTP_STATUS_CODE status_code,
+int craft_http_response(struct outbuf *out, enum HTTP_STATUS_CODE status_code,
                         const char *status_text, const char *body,
                         const char *content_type, const char *last_modified,
                         int is_head, struct http_response *resp);
 
 /*
- * Handles a single HTTP connection on the given stream.
- * Uses server_config (docroot, cgi_dir, etc.) to route the request.
+ * Writes the status line, the general headers, the given (pre-rendered)
+ * header block 'entity' and the blank line ending the response head.
+ * The Connection header follows resp->keep_alive.
+ */
+void write_http_head(struct outbuf *out, enum HTTP_STATUS_CODE status_code,
+                     const char *status_text, const char *entity,
+                     size_t entity_len, const struct http_response *resp);
+
+/*
+ * Returns non-zero if the request would be routed to a CGI script.
+ */
+int is_cgi_request(const struct http_request *req,
+                   const struct server_config *cfg);
+
+/*
+ * Builds the response for an already parsed request in 'out'; the caller
+ * sends it with outbuf_send().
+ * 'res' is the result parse_http_request returned for 'req'.
  * Returns 0 on success, -1 on error.
  */
-int handle_http_connection(FILE *stream, const struct server_config *cfg,
-                           struct http_request *req,
-                           struct http_response *resp);
+int respond_http_request(struct outbuf *out, const struct server_config *cfg,
+                         enum HTTP_PARSE_RESULT res, struct http_request *req,
+                         struct http_response *resp);
+
+/*
+ * Crafts an HTTP response whose body is the first 'len' bytes of the open
+ * file 'fd'. The body is not copied: fd is handed to 'out', which sends it
+ * with sendfile after the headers. For HEAD requests fd is closed.
+ * 'extra' holds further CRLF-terminated header lines, or is NULL.
+ * Returns 0 on success.
+ */
+int craft_http_file_response(struct outbuf *out,
+                             enum HTTP_STATUS_CODE status_code,
+                             const char *status_text, int fd, off_t len,
+                             const char *content_type,
+                             const char *last_modified, const char *extra,
+                             int is_head, struct http_response *resp);
+
+/*
+ * Renders the headers describing a body of 'len' bytes into buf, followed
+ * by the header lines in 'extra' (CRLF-terminated; may be NULL).
+ * Returns the length written, or 0 if buf is too small.
+ */
+size_t format_entity_headers(char *buf, size_t bufsz, off_t len,
+                             const char *content_type,
+                             const char *last_modified, const char *extra);
+
+/*
+ * Renders the validators of the static file version 'st' of type 'ctype',
+ * as sent with its identity representation: the entity tag into etag
+ * (HTTP_ETAG_LEN bytes), the Last-Modified date into lastmod
+ * (HTTP_DATE_LEN + 1 bytes) and the extra header lines (ETag,
+ * Accept-Ranges and, for compressible types, Vary) into extra
+ * (HTTP_EXTRA_LEN bytes).
+ */
+void http_static_headers(const struct stat *st, const char *ctype,
+                         char *etag, char *lastmod, char *extra);
+
+/*
+ * Renders the extra header lines of a representation tagged 'etag' into
+ * extra (HTTP_EXTRA_LEN bytes): those of the identity one of type 'ctype'
+ * if 'coding' is NULL, else those of one in that content coding.
+ */
+void http_entity_extra(const char *etag, const char *ctype,
+                       const char *coding, char *extra);
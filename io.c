@@ -0,0 +1,131 @@
+#include "io.h"
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+ssize_t
+send_file_range(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+	if (count > IO_CHUNK)
+	{
+		count = IO_CHUNK;
+	}
+
+#ifdef __linux__
+	return sendfile(out_fd, in_fd, offset, count);
+#else
+	/* No portable sendfile(2): bounce through a small buffer */
+	char buf[65536];
+	ssize_t nread, nwritten;
+
+	if (count > sizeof(buf))
+	{
+		count = sizeof(buf);
+	}
+
+	if ((nread = pread(in_fd, buf, count, *offset)) <= 0)
+	{
+		return nread;
+	}
+
+	if ((nwritten = write(out_fd, buf, (size_t)nread)) < 0)
+	{
+		return -1;
+	}
+	*offset += nwritten;
+	return nwritten;
+#endif
+}
+
+int
+write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len > 0)
+	{
+		ssize_t n = write(fd, p, len);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		p += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+long long
+relay_pipe(int out_fd, int in_fd, long long limit)
+{
+	long long total = 0;
+
+	while (limit < 0 || total < limit)
+	{
+		size_t want = 65536;
+		ssize_t n;
+
+		if (limit >= 0 && (long long)want > limit - total)
+		{
+			want = (size_t)(limit - total);
+		}
+
+#ifdef __linux__
+		n = splice(in_fd, NULL, out_fd, NULL, want, SPLICE_F_MOVE);
+		if (n < 0 && errno == EINVAL)
+		{
+			/* out_fd doesn't support splicing; bounce instead */
+			goto bounce;
+		}
+#else
+		goto bounce;
+#endif
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		if (n == 0)
+		{
+			break;
+		}
+		total += n;
+		continue;
+
+	bounce:
+		{
+			char buf[65536];
+
+			if ((n = read(in_fd, buf, want)) < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				return -1;
+			}
+			if (n == 0)
+			{
+				break;
+			}
+			if (write_all(out_fd, buf, (size_t)n) < 0)
+			{
+				return -1;
+			}
+			total += n;
+		}
+	}
+	return total;
+}
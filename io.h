@@ -0,0 +1,28 @@
+#pragma once
+
+#include <sys/types.h>
+
+/* Largest chunk handed to the kernel (or bounced through us) at a time */
+#define IO_CHUNK (1 << 20)
+
+/*
+ * Copies up to 'count' bytes starting at *offset of in_fd to out_fd,
+ * using sendfile(2) where available so the data never passes through
+ * userspace. *offset is advanced by the number of bytes sent.
+ * Returns the number of bytes sent (0 at end of file), or -1 on error;
+ * on non-blocking sockets errno may be EAGAIN after a partial send.
+ */
+ssize_t send_file_range(int out_fd, int in_fd, off_t *offset, size_t count);
+
+/*
+ * Writes all 'len' bytes of buf to the blocking descriptor fd, retrying
+ * partial writes. Returns 0 on success, -1 on error.
+ */
+int write_all(int fd, const void *buf, size_t len);
+
+/*
+ * Copies data from the pipe in_fd to out_fd until end of file or until
+ * 'limit' bytes have been copied (limit < 0: no limit), using splice(2)
+ * where available. Returns the number of bytes copied, or -1 on error.
+ */
+long long relay_pipe(int out_fd, int in_fd, long long limit);
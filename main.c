@@ -2,10 +2,12 @@
 
 #include <arpa/inet.h>
 #include <getopt.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "accesslog.h"
 #include "server.h"
 
 static void
@@ -13,13 +15,51 @@ usage()
 {
 	printf("Usage: sws [options]\n");
 	printf("Options:\n");
+	printf("  -A pack     Serve the site pack made by swspack from the given "
+	       "file\n              instead of a document root.\n");
+	printf("  -a          Pin each worker (see -w) to its own CPU.\n");
+	printf("  -b backlog  Listen queue length (default: 5).\n");
+	printf("  -C size     Cache up to size bytes (suffix k, m or g) of small "
+	       "static\n              files in shared memory (default: off).\n");
 	printf("  -c dir      Allow execution of CGIs from the given directory.\n");
 	printf("  -d          Enter debugging mode.\n");
+	printf("  -e          Serve connections from a single event loop instead "
+	       "of\n              forking for each connection.\n");
+	printf("  -F msec     With -e, keep static files open for reuse for "
+	       "msec\n              milliseconds after use (default: off).\n");
+	printf("  -f script   Run the given script in the CGI directory as a "
+	       "persistent\n              FastCGI responder (may be repeated).\n");
 	printf("  -h          Print this usage summary and exit.\n");
+	printf("  -I          With -F, also reuse files until inotify reports a "
+	       "change\n              to their directory.\n");
 	printf("  -i address  Bind to the given IPv4 or IPv6 address (default: "
 	       "all).\n");
+	printf("  -k max      Serve at most max requests per persistent "
+	       "connection\n              (default: 100; 1 disables keep-alive).\n");
+	printf("  -L msec     Write the log in batches every msec milliseconds "
+	       "(default: 100).\n");
 	printf("  -l file     Log all requests to the given file.\n");
+	printf("  -M threads  Enter the docroot's files, with their types and "
+	       "headers, in\n              a manifest at startup, walking it "
+	       "with the given number\n              of threads.\n");
+	printf("  -P          With -U, look up all users with pages at startup.\n");
 	printf("  -p port     Listen on the given port (default: 8080).\n");
+	printf("  -R size     With -M, also read files of up to size bytes "
+	       "(suffix k, m\n              or g) into the page cache.\n");
+	printf("  -s          Serve live metrics in the Prometheus text format "
+	       "at\n              /server-status.\n");
+	printf("  -T file     Read extra MIME types from the given mime.types "
+	       "file.\n");
+	printf("  -t timeout  Close persistent connections idle for timeout "
+	       "seconds\n              (default: 5).\n");
+	printf("  -U seconds  Remember /~user lookups (and unknown users) for "
+	       "the given\n              number of seconds (default: off).\n");
+	printf("  -u          Drive the event loop (-e) through io_uring where "
+	       "the kernel\n              supports it, else epoll.\n");
+	printf("  -w workers  Pre-fork the given number of worker processes, each "
+	       "with\n              its own listening socket.\n");
+	printf("  -z          Precompress compressible static files into .gz "
+	       "sidecars\n              at startup.\n");
 }
 
 /*
@@ -40,6 +80,65 @@ validate_port(const char *port_str)
 	return htons((in_port_t)port);
 }
 
+/*
+ * Validate and convert a numeric option argument within [min, max].
+ */
+int
+validate_number(const char *str, const char *what, long min, long max)
+{
+	char *endptr;
+	long val = strtol(str, &endptr, 10);
+
+	if (*str == '\0' || *endptr != '\0' || val < min || val > max)
+	{
+		fprintf(stderr, "Invalid %s: %s\n", what, str);
+		exit(1);
+	}
+
+	return (int)val;
+}
+
+/*
+ * Validate and convert a size argument with an optional k/m/g suffix.
+ */
+size_t
+validate_size(const char *str, const char *what)
+{
+	char *endptr;
+	unsigned long long val = strtoull(str, &endptr, 10);
+	unsigned long long mult = 1;
+
+	switch (*endptr)
+	{
+	case 'k':
+	case 'K':
+		mult = 1024ULL;
+		endptr++;
+		break;
+	case 'm':
+	case 'M':
+		mult = 1024ULL * 1024;
+		endptr++;
+		break;
+	case 'g':
+	case 'G':
+		mult = 1024ULL * 1024 * 1024;
+		endptr++;
+		break;
+	default:
+		break;
+	}
+
+	if (*str == '\0' || *str == '-' || *endptr != '\0' ||
+	    val > (unsigned long long)SIZE_MAX / mult)
+	{
+		fprintf(stderr, "Invalid %s: %s\n", what, str);
+		exit(1);
+	}
+
+	return (size_t)(val * mult);
+}
+
 /*
  * Validate and convert IPv4/IPv6 address from string to binary form.
  */
@@ -116,6 +215,7 @@ main(int argc, char *argv[])
 {
 	char *cgi_dir = NULL;
 	int debug_mode = 0;
+	int event_mode = 0;
 	struct sockaddr_storage bind_addr;
 	socklen_t bind_addrlen = 0;
 	int have_bind_address = 0;
@@ -125,22 +225,63 @@ main(int argc, char *argv[])
 	struct server_config config;
 
 	memset(&config, 0, sizeof(config));
+	config.keepalive_timeout = 5;
+	config.keepalive_max = 100;
+	config.log_flush_ms = ALOG_FLUSH_MS;
 
 	char *docroot = NULL;
 
 	int option;
 
 
-	while ((option = getopt(argc, argv, "c:di:l:p:h")) != -1)
+	while ((option = getopt(argc, argv,
+	                        "A:ab:C:c:deF:f:Ii:k:L:l:M:Pp:R:sT:t:U:uw:z"
+	                        "h")) != -1)
 	{
 		switch (option)
 		{
+		case 'A':
+			config.pack = optarg;
+			break;
+		case 'a':
+			config.pin_workers = 1;
+			break;
+		case 'b':
+			config.backlog = validate_number(optarg, "backlog", 1, 65535);
+			break;
+		case 'C':
+			config.cache_budget = validate_size(optarg, "cache size");
+			break;
 		case 'c':
 			cgi_dir = optarg;
 			break;
 		case 'd':
 			debug_mode = 1;
 			break;
+		case 'e':
+			event_mode = 1;
+			break;
+		case 'F':
+			config.fd_cache_ms =
+				validate_number(optarg, "reuse interval", 0, 3600000);
+			break;
+		case 'f':
+		{
+			char **scripts =
+				realloc(config.fcgi_scripts, ((size_t)config.nfcgi_scripts + 1) *
+				                                 sizeof(*scripts));
+			if (scripts == NULL)
+			{
+				perror("realloc");
+				exit(1);
+			}
+			scripts[config.nfcgi_scripts++] = optarg;
+			config.fcgi_scripts = scripts;
+			break;
+		}
+		case 'I':
+			config.fd_cache_notify = 1;
+			break;
 		case 'i':
 			validate_address(optarg, &bind_addr);
 			have_bind_address = 1;
@@ -148,12 +289,54 @@ main(int argc, char *argv[])
 			                   ? sizeof(struct sockaddr_in)
 			                   : sizeof(struct sockaddr_in6);
 			break;
+		case 'k':
+			config.keepalive_max =
+				validate_number(optarg, "request limit", 1, 1000000);
+			break;
+		case 'L':
+			config.log_flush_ms =
+				validate_number(optarg, "flush interval", 1, 60000);
+			break;
 		case 'l':
 			log_file = optarg;
 			break;
+		case 'M':
+			config.prewarm_threads =
+				validate_number(optarg, "thread count", 1, 64);
+			break;
+		case 'P':
+			config.userdir_preload = 1;
+			break;
 		case 'p':
 			port = validate_port(optarg);
 			break;
+		case 'R':
+			config.readahead_max = validate_size(optarg, "readahead size");
+			break;
+		case 's':
+			config.status_page = 1;
+			break;
+		case 'T':
+			config.mime_types = optarg;
+			break;
+		case 't':
+			config.keepalive_timeout =
+				validate_number(optarg, "timeout", 1, 86400);
+			break;
+		case 'U':
+			config.userdir_ttl =
+				validate_number(optarg, "lookup lifetime", 0, 86400);
+			break;
+		case 'u':
+			config.use_uring = 1;
+			event_mode = 1;
+			break;
+		case 'w':
+			config.workers = validate_number(optarg, "worker count", 1, 1024);
+			break;
+		case 'z':
+			config.precompress = 1;
+			break;
 		case 'h':
 			usage();
 			exit(0);
@@ -167,7 +350,7 @@ main(int argc, char *argv[])
 	{
 		docroot = argv[optind];
 	}
-	else
+	else if (config.pack == NULL)
 	{
 		fprintf(stderr, "Missing required document root directory argument!\n");
 		usage();
@@ -175,12 +358,37 @@ main(int argc, char *argv[])
 	}
 
 
+	if (config.nfcgi_scripts > 0 && cgi_dir == NULL)
+	{
+		fprintf(stderr, "FastCGI scripts (-f) require a CGI directory (-c).\n");
+		exit(1);
+	}
+
+	if (config.fd_cache_notify && config.fd_cache_ms <= 0)
+	{
+		fprintf(stderr, "Watching for changes (-I) requires -F.\n");
+		usage();
+		exit(1);
+	}
+
+	/*
+	 * Open files are cached per process: a child forked for a single
+	 * connection would start with an empty cache and exit with it.
+	 */
+	if ((config.fd_cache_ms > 0 || config.fd_cache_notify) && !event_mode)
+	{
+		fprintf(stderr, "Keeping files open (-F, -I) requires the event "
+		                "loop (-e).\n");
+		exit(1);
+	}
+
 	print_options(cgi_dir, debug_mode, &bind_addr, bind_addrlen,
 	              have_bind_address, log_file, port);
 
 	/* Build the config struct */
 	config.cgi_dir = cgi_dir;
 	config.debug_mode = debug_mode;
+	config.event_mode = event_mode;
 	config.bind_addr = bind_addr;
 	config.bind_addrlen = bind_addrlen;
 	config.have_bind_address = have_bind_address;
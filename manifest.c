@@ -0,0 +1,367 @@
+#include "manifest.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mime.h"
+
+/* Threads walking the tree at most */
+#define MANIFEST_MAX_THREADS 64
+
+/* State shared by the threads of one walk */
+struct walk
+{
+	const char *root;
+	int rootfd;
+	off_t readahead_max;
+
+	/* Directories (relative to root) waiting to be read, and the entries */
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	char **queue;
+	size_t nqueue;
+	size_t queue_cap;
+	int busy; /* threads reading a directory, which may queue more */
+
+	/* mime_type() keeps state (and libmagic) of its own */
+	pthread_mutex_t mime_lock;
+};
+
+static struct manifest_entry *entries = NULL;
+static size_t nentries = 0;
+static size_t entries_cap = 0;
+
+/* Open-addressed hash index: entry number + 1, or 0 for an empty slot */
+static uint32_t *slots = NULL;
+static size_t slots_mask;
+
+static uint32_t
+hash_path(const char *path)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *path; path++)
+	{
+		h ^= (unsigned char)*path;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* Queues directory 'rel'; called with w->lock held */
+static void
+push_directory(struct walk *w, const char *rel)
+{
+	char *copy;
+
+	if (w->nqueue == w->queue_cap)
+	{
+		size_t cap = w->queue_cap ? w->queue_cap * 2 : 64;
+		char **queue = realloc(w->queue, cap * sizeof(*queue));
+
+		if (queue == NULL)
+		{
+			return;
+		}
+		w->queue = queue;
+		w->queue_cap = cap;
+	}
+	if ((copy = strdup(rel)) != NULL)
+	{
+		w->queue[w->nqueue++] = copy;
+		pthread_cond_signal(&w->changed);
+	}
+}
+
+static void
+free_entry(struct manifest_entry *e)
+{
+	free(e->path);
+	free(e->content_type);
+	free(e->extra);
+}
+
+/* Enters the regular file 'name' of the directory dirfd, at 'rel' */
+static void
+enter_file(struct walk *w, int dirfd, const char *name, const char *rel,
+           const struct stat *st)
+{
+	struct manifest_entry e;
+	char path[PATH_MAX];
+	char extra[HTTP_EXTRA_LEN];
+
+	/* The form serve_static_file() gives it: docroot + request path */
+	if (snprintf(path, sizeof(path), "%s/%s", w->root, rel) >=
+	    (int)sizeof(path))
+	{
+		return;
+	}
+
+	if (w->readahead_max > 0 && st->st_size > 0 &&
+	    st->st_size <= w->readahead_max)
+	{
+		int fd = openat(dirfd, name,
+		                O_RDONLY | O_NONBLOCK | O_NOCTTY | O_NOFOLLOW |
+		                    O_CLOEXEC);
+
+		if (fd >= 0)
+		{
+			(void)posix_fadvise(fd, 0, st->st_size, POSIX_FADV_WILLNEED);
+			close(fd);
+		}
+	}
+
+	memset(&e, 0, sizeof(e));
+	pthread_mutex_lock(&w->mime_lock);
+	e.content_type = strdup(mime_type(path, st));
+	pthread_mutex_unlock(&w->mime_lock);
+	if (e.content_type == NULL)
+	{
+		return;
+	}
+
+	http_static_headers(st, e.content_type, e.etag, e.last_modified, extra);
+	e.extra = strdup(extra);
+	e.path = strdup(path);
+	e.hash = hash_path(path);
+	e.dev = st->st_dev;
+	e.ino = st->st_ino;
+	e.size = st->st_size;
+	e.mtime = st->st_mtim;
+	if (e.extra == NULL || e.path == NULL)
+	{
+		free_entry(&e);
+		return;
+	}
+
+	pthread_mutex_lock(&w->lock);
+	if (nentries == entries_cap && nentries < MANIFEST_MAX_FILES)
+	{
+		size_t cap = entries_cap ? entries_cap * 2 : 1024;
+		struct manifest_entry *tmp = realloc(entries, cap * sizeof(*tmp));
+
+		if (tmp != NULL)
+		{
+			entries = tmp;
+			entries_cap = cap;
+		}
+	}
+	if (nentries < entries_cap)
+	{
+		entries[nentries++] = e;
+	}
+	else
+	{
+		free_entry(&e);
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Enters the files of directory 'rel' and queues its subdirectories */
+static void
+walk_directory(struct walk *w, const char *rel)
+{
+	struct dirent *de;
+	DIR *dir;
+	int fd;
+
+	fd = openat(w->rootfd, *rel ? rel : ".",
+	            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return;
+	}
+	if ((dir = fdopendir(fd)) == NULL)
+	{
+		close(fd);
+		return;
+	}
+
+	while ((de = readdir(dir)) != NULL)
+	{
+		char child[PATH_MAX];
+		struct stat st;
+		int is_dir = (de->d_type == DT_DIR);
+
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+		{
+			continue;
+		}
+		if (snprintf(child, sizeof(child), "%s%s%s", rel, *rel ? "/" : "",
+		             de->d_name) >= (int)sizeof(child))
+		{
+			continue;
+		}
+
+		/* The type is usually known without a stat */
+		if (de->d_type == DT_REG || de->d_type == DT_UNKNOWN)
+		{
+			if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+			{
+				continue;
+			}
+			if (S_ISREG(st.st_mode))
+			{
+				enter_file(w, fd, de->d_name, child, &st);
+			}
+			is_dir = S_ISDIR(st.st_mode);
+		}
+		if (is_dir)
+		{
+			pthread_mutex_lock(&w->lock);
+			push_directory(w, child);
+			pthread_mutex_unlock(&w->lock);
+		}
+	}
+	closedir(dir);
+}
+
+static void *
+walk_thread(void *arg)
+{
+	struct walk *w = arg;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;)
+	{
+		char *rel;
+
+		/* Done once nothing is queued and nobody can queue more */
+		while (w->nqueue == 0 && w->busy > 0)
+		{
+			pthread_cond_wait(&w->changed, &w->lock);
+		}
+		if (w->nqueue == 0)
+		{
+			break;
+		}
+		rel = w->queue[--w->nqueue];
+		w->busy++;
+		pthread_mutex_unlock(&w->lock);
+
+		walk_directory(w, rel);
+		free(rel);
+
+		pthread_mutex_lock(&w->lock);
+		w->busy--;
+	}
+	pthread_cond_broadcast(&w->changed);
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+/* Builds the hash index over all entries */
+static int
+build_index(void)
+{
+	size_t size = 16;
+
+	while (size < nentries * 2)
+	{
+		size *= 2;
+	}
+	if ((slots = calloc(size, sizeof(*slots))) == NULL)
+	{
+		return -1;
+	}
+	slots_mask = size - 1;
+
+	for (size_t i = 0; i < nentries; i++)
+	{
+		size_t j = entries[i].hash & slots_mask;
+
+		while (slots[j] != 0)
+		{
+			j = (j + 1) & slots_mask;
+		}
+		slots[j] = (uint32_t)(i + 1);
+	}
+	return 0;
+}
+
+int
+manifest_build(const char *root, int threads, off_t readahead_max)
+{
+	pthread_t tids[MANIFEST_MAX_THREADS];
+	struct walk w;
+	int started = 0;
+
+	memset(&w, 0, sizeof(w));
+	w.root = root;
+	w.readahead_max = readahead_max;
+	if ((w.rootfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+	{
+		return -1;
+	}
+	pthread_mutex_init(&w.lock, NULL);
+	pthread_cond_init(&w.changed, NULL);
+	pthread_mutex_init(&w.mime_lock, NULL);
+	push_directory(&w, "");
+
+	if (threads > MANIFEST_MAX_THREADS)
+	{
+		threads = MANIFEST_MAX_THREADS;
+	}
+	while (started < threads &&
+	       pthread_create(&tids[started], NULL, walk_thread, &w) == 0)
+	{
+		started++;
+	}
+	if (started == 0)
+	{
+		(void)walk_thread(&w);
+	}
+	for (int i = 0; i < started; i++)
+	{
+		pthread_join(tids[i], NULL);
+	}
+
+	pthread_mutex_destroy(&w.mime_lock);
+	pthread_cond_destroy(&w.changed);
+	pthread_mutex_destroy(&w.lock);
+	free(w.queue);
+	close(w.rootfd);
+
+	if (build_index() < 0)
+	{
+		return -1;
+	}
+	return (int)nentries;
+}
+
+const struct manifest_entry *
+manifest_lookup(const char *path, const struct stat *st)
+{
+	uint32_t hash;
+
+	if (slots == NULL)
+	{
+		return NULL;
+	}
+	hash = hash_path(path);
+	for (size_t j = hash & slots_mask; slots[j] != 0;
+	     j = (j + 1) & slots_mask)
+	{
+		const struct manifest_entry *e = &entries[slots[j] - 1];
+
+		if (e->hash != hash || strcmp(e->path, path) != 0)
+		{
+			continue;
+		}
+		if (e->dev == st->st_dev && e->ino == st->st_ino &&
+		    e->size == st->st_size &&
+		    e->mtime.tv_sec == st->st_mtim.tv_sec &&
+		    e->mtime.tv_nsec == st->st_mtim.tv_nsec)
+		{
+			return e;
+		}
+		return NULL;
+	}
+	return NULL;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <stdint.h>
+
+#include "http.h"
+#include "timefmt.h"
+
+/*
+ * A manifest of the docroot's regular files, built once at startup (and
+ * so shared with every process forked later): for each file its version,
+ * its MIME type and the headers of its identity response. Serving a file
+ * listed at the version just opened skips type detection (libmagic
+ * included) and header formatting; a file changed since is simply looked
+ * at anew. Symbolic links are not followed while building.
+ */
+
+/* Files entered at most; any others are served as if not listed */
+#define MANIFEST_MAX_FILES (1 << 20)
+
+struct manifest_entry
+{
+	char *path; /* full path, as formed from the docroot and request path */
+	uint32_t hash;
+
+	/* File version the entry was made for */
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+
+	char *content_type;
+	char etag[HTTP_ETAG_LEN];
+	char last_modified[HTTP_DATE_LEN + 1];
+	char *extra; /* header lines, see http_static_headers() */
+};
+
+/*
+ * Walks the directory tree 'root' with 'threads' threads and enters every
+ * regular file. Files of up to 'readahead_max' bytes (if not 0) are read
+ * ahead into the page cache as well. Needs the MIME table; call before
+ * forking.
+ * Returns the number of files entered, or -1 if root can't be read.
+ */
+int manifest_build(const char *root, int threads, off_t readahead_max);
+
+/*
+ * Returns the entry for the file at 'path' if it was entered at the
+ * version 'st', else NULL.
+ */
+const struct manifest_entry *manifest_lookup(const char *path,
+                                             const struct stat *st);
@@ -0,0 +1,277 @@
+#include "metrics.h"
+
+#include <sys/mman.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "accesslog.h"
+#include "cache.h"
+
+/* Status codes are counted individually in this range, others together */
+#define STATUS_MIN 100
+#define STATUS_MAX 599
+
+struct histogram
+{
+	unsigned long long buckets[METRICS_BUCKETS];
+	unsigned long long count;
+	unsigned long long sum_ns;
+};
+
+struct metrics
+{
+	unsigned long long connections;
+	long long in_flight;
+	unsigned long long status[STATUS_MAX - STATUS_MIN + 2]; /* last: other */
+	unsigned long long body_bytes;
+	unsigned long long cgi_spawns;
+	unsigned long long fcgi_requests;
+	struct histogram phases[METRICS_NPHASES];
+};
+
+static const char *const phase_names[METRICS_NPHASES] = {
+	"parse",
+	"handle",
+	"send",
+	"total",
+};
+
+static struct metrics *m = NULL;
+
+#define ADD(field, n) __atomic_add_fetch(&(field), (n), __ATOMIC_RELAXED)
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+int
+metrics_init(void)
+{
+	void *base = mmap(NULL, sizeof(*m), PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_ANON, -1, 0);
+
+	if (base == MAP_FAILED)
+	{
+		return -1;
+	}
+	m = base;
+	return 0;
+}
+
+long long
+metrics_clock(void)
+{
+	struct timespec ts;
+
+	if (m == NULL)
+	{
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void
+metrics_connection_opened(void)
+{
+	if (m != NULL)
+	{
+		ADD(m->connections, 1);
+		ADD(m->in_flight, 1);
+	}
+}
+
+void
+metrics_connection_closed(void)
+{
+	if (m != NULL)
+	{
+		ADD(m->in_flight, -1);
+	}
+}
+
+void
+metrics_observe(enum metrics_phase phase, long long start, long long end)
+{
+	unsigned long long us;
+	struct histogram *h;
+	int i = 0;
+
+	if (m == NULL || start == 0 || end == 0 || end < start)
+	{
+		return;
+	}
+	h = &m->phases[phase];
+
+	/* Smallest i with us <= 2^i */
+	us = (unsigned long long)(end - start) / 1000;
+	if (us > 1)
+	{
+		i = 64 - __builtin_clzll(us - 1);
+	}
+	if (i > METRICS_BUCKETS - 1)
+	{
+		i = METRICS_BUCKETS - 1;
+	}
+
+	ADD(h->buckets[i], 1);
+	ADD(h->count, 1);
+	ADD(h->sum_ns, (unsigned long long)(end - start));
+}
+
+void
+metrics_response(const struct http_response *resp)
+{
+	int code = resp->status_code;
+
+	if (m == NULL)
+	{
+		return;
+	}
+	if (code < STATUS_MIN || code > STATUS_MAX)
+	{
+		code = STATUS_MAX + 1;
+	}
+	ADD(m->status[code - STATUS_MIN], 1);
+	ADD(m->body_bytes, (unsigned long long)resp->content_len);
+}
+
+void
+metrics_cgi_spawn(void)
+{
+	if (m != NULL)
+	{
+		ADD(m->cgi_spawns, 1);
+	}
+}
+
+void
+metrics_fcgi_request(void)
+{
+	if (m != NULL)
+	{
+		ADD(m->fcgi_requests, 1);
+	}
+}
+
+static void
+render_counter(FILE *f, const char *name, const char *help,
+               unsigned long long value)
+{
+	fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name,
+	        name, value);
+}
+
+char *
+metrics_render(void)
+{
+	char *text = NULL;
+	size_t len = 0;
+	FILE *f;
+
+	if (m == NULL || (f = open_memstream(&text, &len)) == NULL)
+	{
+		return NULL;
+	}
+
+	render_counter(f, "sws_connections_total", "Connections accepted.",
+	               LOAD(m->connections));
+	fprintf(f,
+	        "# HELP sws_connections_in_flight Connections currently open.\n"
+	        "# TYPE sws_connections_in_flight gauge\n"
+	        "sws_connections_in_flight %lld\n",
+	        LOAD(m->in_flight));
+
+	fprintf(f, "# HELP sws_responses_total Responses by status code.\n"
+	           "# TYPE sws_responses_total counter\n");
+	for (int i = 0; i <= STATUS_MAX - STATUS_MIN + 1; i++)
+	{
+		unsigned long long n = LOAD(m->status[i]);
+
+		if (n == 0)
+		{
+			continue;
+		}
+		if (i <= STATUS_MAX - STATUS_MIN)
+		{
+			fprintf(f, "sws_responses_total{code=\"%d\"} %llu\n",
+			        i + STATUS_MIN, n);
+		}
+		else
+		{
+			fprintf(f, "sws_responses_total{code=\"other\"} %llu\n", n);
+		}
+	}
+
+	render_counter(f, "sws_response_body_bytes_total",
+	               "Bytes of response bodies sent.", LOAD(m->body_bytes));
+	render_counter(f, "sws_cgi_spawns_total", "CGI scripts started.",
+	               LOAD(m->cgi_spawns));
+	render_counter(f, "sws_fastcgi_requests_total",
+	               "Requests passed to FastCGI responders.",
+	               LOAD(m->fcgi_requests));
+
+	fprintf(f, "# HELP sws_request_duration_seconds Time spent in each "
+	           "phase of a request.\n"
+	           "# TYPE sws_request_duration_seconds histogram\n");
+	for (int p = 0; p < METRICS_NPHASES; p++)
+	{
+		struct histogram *h = &m->phases[p];
+		unsigned long long cumulative = 0;
+
+		for (int i = 0; i < METRICS_BUCKETS - 1; i++)
+		{
+			cumulative += LOAD(h->buckets[i]);
+			fprintf(f,
+			        "sws_request_duration_seconds_bucket{phase=\"%s\","
+			        "le=\"%g\"} %llu\n",
+			        phase_names[p], (double)(1ULL << i) / 1e6, cumulative);
+		}
+		cumulative += LOAD(h->buckets[METRICS_BUCKETS - 1]);
+		fprintf(f,
+		        "sws_request_duration_seconds_bucket{phase=\"%s\","
+		        "le=\"+Inf\"} %llu\n"
+		        "sws_request_duration_seconds_sum{phase=\"%s\"} %.9f\n"
+		        "sws_request_duration_seconds_count{phase=\"%s\"} %llu\n",
+		        phase_names[p], cumulative, phase_names[p],
+		        (double)LOAD(h->sum_ns) / 1e9, phase_names[p], cumulative);
+	}
+
+	if (cache_enabled())
+	{
+		struct cache_stats cs;
+
+		cache_get_stats(&cs);
+		render_counter(f, "sws_cache_hits_total", "File cache hits.",
+		               cs.hits);
+		render_counter(f, "sws_cache_misses_total", "File cache misses.",
+		               cs.misses);
+		render_counter(f, "sws_cache_evictions_total",
+		               "File cache entries evicted.", cs.evictions);
+		fprintf(f,
+		        "# HELP sws_cache_bytes File cache bytes in use.\n"
+		        "# TYPE sws_cache_bytes gauge\n"
+		        "sws_cache_bytes %zu\n"
+		        "# HELP sws_cache_budget_bytes File cache size.\n"
+		        "# TYPE sws_cache_budget_bytes gauge\n"
+		        "sws_cache_budget_bytes %zu\n",
+		        cs.bytes_used, cs.budget);
+	}
+
+	{
+		struct alog_stats ls;
+
+		alog_get_stats(&ls);
+		render_counter(f, "sws_log_records_written_total",
+		               "Access log records written.", ls.written);
+		render_counter(f, "sws_log_records_dropped_total",
+		               "Access log records lost to a full ring.", ls.dropped);
+	}
+
+	if (fclose(f) != 0)
+	{
+		free(text);
+		return NULL;
+	}
+	return text;
+}
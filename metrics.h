@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "http.h"
+
+/*
+ * Server metrics, kept in shared memory so that the counters of every
+ * process (workers and short-lived connection children alike) add up.
+ * All updates are lock-free atomic increments. Until metrics_init() has
+ * been called every update is a no-op.
+ */
+
+/* Phases of a request whose durations are recorded */
+enum metrics_phase
+{
+	METRICS_PARSE,  /* first byte of the request until its head is parsed */
+	METRICS_HANDLE, /* parsed head until the response is ready to send */
+	METRICS_SEND,   /* response ready until it has been written */
+	METRICS_TOTAL,  /* first byte of the request until the response is out */
+	METRICS_NPHASES
+};
+
+/*
+ * Latency histogram buckets: bucket i counts durations of up to 2^i
+ * microseconds, the last one everything longer.
+ */
+#define METRICS_BUCKETS 26
+
+/*
+ * Sets up the shared region. Call before forking.
+ * Returns 0 on success, -1 on error.
+ */
+int metrics_init(void);
+
+/*
+ * Returns a monotonic timestamp in nanoseconds, or 0 if metrics are off.
+ */
+long long metrics_clock(void);
+
+/*
+ * Counts a connection being accepted (or closed).
+ */
+void metrics_connection_opened(void);
+void metrics_connection_closed(void);
+
+/*
+ * Records that a phase of a request ran from 'start' to 'end' (as given
+ * by metrics_clock()). Ignored if either is 0.
+ */
+void metrics_observe(enum metrics_phase phase, long long start,
+                     long long end);
+
+/*
+ * Counts a response by status code, and its body bytes.
+ */
+void metrics_response(const struct http_response *resp);
+
+/*
+ * Counts a CGI script started, or a request passed to FastCGI.
+ */
+void metrics_cgi_spawn(void);
+void metrics_fcgi_request(void);
+
+/*
+ * Renders all metrics, including those of the file cache and the access
+ * log, in the Prometheus text exposition format.
+ * Returns a malloc'd string, or NULL on error.
+ */
+char *metrics_render(void);
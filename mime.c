@@ -0,0 +1,368 @@
+#include "mime.h"
+
+#include <ctype.h>
+#include <magic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define MIME_MAX_EXT 16
+#define MIME_MAX_TYPE 128
+
+/* Direct-mapped memo of libmagic results, indexed by inode */
+#define MIME_MEMO_SLOTS 256
+
+#define MIME_DEFAULT "application/octet-stream"
+
+struct mime_entry
+{
+	char ext[MIME_MAX_EXT];
+	const char *type;
+	size_t seq; /* insertion order, so later definitions win */
+};
+
+struct mime_default
+{
+	const char *ext;
+	const char *type;
+};
+
+struct mime_memo
+{
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	char type[MIME_MAX_TYPE];
+};
+
+static const struct mime_default builtin_types[] = {
+	{"7z", "application/x-7z-compressed"},
+	{"avif", "image/avif"},
+	{"bmp", "image/bmp"},
+	{"bz2", "application/x-bzip2"},
+	{"c", "text/x-c"},
+	{"css", "text/css"},
+	{"csv", "text/csv"},
+	{"doc", "application/msword"},
+	{"eot", "application/vnd.ms-fontobject"},
+	{"epub", "application/epub+zip"},
+	{"flac", "audio/flac"},
+	{"gif", "image/gif"},
+	{"gz", "application/gzip"},
+	{"h", "text/x-c"},
+	{"htm", "text/html"},
+	{"html", "text/html"},
+	{"ico", "image/vnd.microsoft.icon"},
+	{"jar", "application/java-archive"},
+	{"jpeg", "image/jpeg"},
+	{"jpg", "image/jpeg"},
+	{"js", "text/javascript"},
+	{"json", "application/json"},
+	{"jsonld", "application/ld+json"},
+	{"m4a", "audio/mp4"},
+	{"md", "text/markdown"},
+	{"mjs", "text/javascript"},
+	{"mkv", "video/x-matroska"},
+	{"mov", "video/quicktime"},
+	{"mp3", "audio/mpeg"},
+	{"mp4", "video/mp4"},
+	{"mpeg", "video/mpeg"},
+	{"oga", "audio/ogg"},
+	{"ogg", "audio/ogg"},
+	{"ogv", "video/ogg"},
+	{"otf", "font/otf"},
+	{"pdf", "application/pdf"},
+	{"png", "image/png"},
+	{"ps", "application/postscript"},
+	{"rss", "application/rss+xml"},
+	{"rtf", "application/rtf"},
+	{"sh", "application/x-sh"},
+	{"svg", "image/svg+xml"},
+	{"tar", "application/x-tar"},
+	{"tgz", "application/gzip"},
+	{"tif", "image/tiff"},
+	{"tiff", "image/tiff"},
+	{"ts", "video/mp2t"},
+	{"ttf", "font/ttf"},
+	{"txt", "text/plain"},
+	{"wasm", "application/wasm"},
+	{"wav", "audio/wav"},
+	{"weba", "audio/webm"},
+	{"webm", "video/webm"},
+	{"webmanifest", "application/manifest+json"},
+	{"webp", "image/webp"},
+	{"woff", "font/woff"},
+	{"woff2", "font/woff2"},
+	{"xhtml", "application/xhtml+xml"},
+	{"xml", "application/xml"},
+	{"xz", "application/x-xz"},
+	{"zip", "application/zip"},
+	{"zst", "application/zstd"},
+};
+
+/* Sorted by extension; built once by mime_init() */
+static struct mime_entry *table = NULL;
+static size_t table_len = 0;
+
+static struct magic_set *ms = NULL;
+static struct mime_memo memo[MIME_MEMO_SLOTS];
+
+static int
+mime_entry_cmp(const void *a, const void *b)
+{
+	const struct mime_entry *ea = a;
+	const struct mime_entry *eb = b;
+	return strcmp(ea->ext, eb->ext);
+}
+
+static int
+mime_entry_seq_cmp(const void *a, const void *b)
+{
+	const struct mime_entry *ea = a;
+	const struct mime_entry *eb = b;
+	int c = strcmp(ea->ext, eb->ext);
+
+	if (c != 0)
+	{
+		return c;
+	}
+	return (ea->seq > eb->seq) - (ea->seq < eb->seq);
+}
+
+static void
+load_magic(void)
+{
+	ms = magic_open(MAGIC_MIME_TYPE | MAGIC_ERROR);
+	if (ms == NULL)
+	{
+		return;
+	}
+
+#if __sun
+	/* OmniOS */
+	if (magic_load(ms, "/opt/magic/share/misc/magic.mgc") != 0)
+#else
+	/* Linux/NetBSD */
+	if (magic_load(ms, NULL) != 0)
+#endif
+	{
+		magic_close(ms);
+		ms = NULL;
+	}
+}
+
+/*
+ * Appends ext -> type. Entries added later win over earlier ones with the
+ * same extension (see mime_init).
+ */
+static int
+table_add(size_t *cap, const char *ext, const char *type)
+{
+	size_t len = strlen(ext);
+
+	if (len == 0 || len >= MIME_MAX_EXT)
+	{
+		return 0;
+	}
+
+	if (table_len == *cap)
+	{
+		size_t newcap = *cap ? *cap * 2 : 128;
+		struct mime_entry *tmp = realloc(table, newcap * sizeof(*table));
+		if (!tmp)
+		{
+			return -1;
+		}
+		table = tmp;
+		*cap = newcap;
+	}
+
+	for (size_t i = 0; i <= len; i++)
+	{
+		table[table_len].ext[i] = (char)tolower((unsigned char)ext[i]);
+	}
+	table[table_len].type = type;
+	table[table_len].seq = table_len;
+	table_len++;
+	return 0;
+}
+
+/* Reads "type ext ext ..." lines; '#' starts a comment */
+static int
+load_types_file(const char *path, size_t *cap)
+{
+	FILE *fp;
+	char line[1024];
+
+	if ((fp = fopen(path, "r")) == NULL)
+	{
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		char *saveptr = NULL;
+		char *hash = strchr(line, '#');
+		char *type, *ext;
+
+		if (hash)
+		{
+			*hash = '\0';
+		}
+
+		if ((type = strtok_r(line, " \t\r\n", &saveptr)) == NULL)
+		{
+			continue;
+		}
+		if (strlen(type) >= MIME_MAX_TYPE || (type = strdup(type)) == NULL)
+		{
+			continue;
+		}
+
+		while ((ext = strtok_r(NULL, " \t\r\n", &saveptr)) != NULL)
+		{
+			if (table_add(cap, ext, type) < 0)
+			{
+				fclose(fp);
+				return -1;
+			}
+		}
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+int
+mime_init(const char *types_file)
+{
+	size_t cap = 0;
+	size_t out = 0;
+
+	for (size_t i = 0; i < sizeof(builtin_types) / sizeof(builtin_types[0]);
+	     i++)
+	{
+		if (table_add(&cap, builtin_types[i].ext, builtin_types[i].type) < 0)
+		{
+			return -1;
+		}
+	}
+
+	if (types_file && load_types_file(types_file, &cap) < 0)
+	{
+		return -1;
+	}
+
+	/* Sort, then keep only the last definition of each extension */
+	qsort(table, table_len, sizeof(*table), mime_entry_seq_cmp);
+	for (size_t i = 0; i < table_len; i++)
+	{
+		if (i + 1 < table_len && strcmp(table[i].ext, table[i + 1].ext) == 0)
+		{
+			continue;
+		}
+		table[out++] = table[i];
+	}
+	table_len = out;
+
+	load_magic();
+	return 0;
+}
+
+static const char *
+lookup_extension(const char *path)
+{
+	const char *base = strrchr(path, '/');
+	const char *dot;
+	struct mime_entry key;
+	struct mime_entry *found;
+	size_t len;
+
+	base = base ? base + 1 : path;
+	if ((dot = strrchr(base, '.')) == NULL || dot == base)
+	{
+		/* No extension (dotfiles don't count) */
+		return NULL;
+	}
+
+	len = strlen(dot + 1);
+	if (len == 0 || len >= MIME_MAX_EXT)
+	{
+		return NULL;
+	}
+	for (size_t i = 0; i <= len; i++)
+	{
+		key.ext[i] = (char)tolower((unsigned char)dot[1 + i]);
+	}
+
+	found = bsearch(&key, table, table_len, sizeof(*table), mime_entry_cmp);
+	return found ? found->type : NULL;
+}
+
+const char *
+mime_type(const char *path, const struct stat *st)
+{
+	const char *type;
+	struct mime_memo *m;
+
+	if ((type = lookup_extension(path)) != NULL)
+	{
+		return type;
+	}
+
+	m = &memo[(size_t)st->st_ino % MIME_MEMO_SLOTS];
+	if (m->type[0] != '\0' && m->dev == st->st_dev && m->ino == st->st_ino &&
+	    m->mtime == st->st_mtime)
+	{
+		return m->type;
+	}
+
+	/* Extensionless or unknown: sniff the contents, once per inode */
+	type = ms ? magic_file(ms, path) : NULL;
+	if (type == NULL)
+	{
+		return MIME_DEFAULT;
+	}
+
+	m->dev = st->st_dev;
+	m->ino = st->st_ino;
+	m->mtime = st->st_mtime;
+	strncpy(m->type, type, sizeof(m->type) - 1);
+	m->type[sizeof(m->type) - 1] = '\0';
+	return m->type;
+}
+
+int
+mime_compressible(const char *type)
+{
+	static const char *const types[] = {
+		"application/javascript",   "application/json",
+		"application/postscript",   "application/rtf",
+		"application/wasm",         "application/x-sh",
+		"application/xml",          "application/vnd.ms-fontobject",
+		"font/otf",                 "font/ttf",
+		"image/bmp",                "image/svg+xml",
+		"image/vnd.microsoft.icon",
+	};
+	size_t len = strcspn(type, "; \t");
+
+	if (strncasecmp(type, "text/", 5) == 0)
+	{
+		return 1;
+	}
+	/* application/ld+json, application/xhtml+xml and friends */
+	if ((len > 5 && strncasecmp(type + len - 5, "+json", 5) == 0) ||
+	    (len > 4 && strncasecmp(type + len - 4, "+xml", 4) == 0))
+	{
+		return 1;
+	}
+	for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+	{
+		if (strlen(types[i]) == len && strncasecmp(type, types[i], len) == 0)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
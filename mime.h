@@ -0,0 +1,27 @@
+#pragma once
+
+#include <sys/stat.h>
+
+/*
+ * Builds the extension to MIME type table from the built-in defaults and,
+ * if types_file is not NULL, a mime.types(5)-style file whose entries take
+ * precedence. Also loads the libmagic database, so call this before
+ * forking to share the work with every child.
+ * Returns 0 on success, -1 if types_file could not be read.
+ */
+int mime_init(const char *types_file);
+
+/*
+ * Returns the MIME type for the file at 'path' (described by 'st').
+ * The type comes from the file's extension; only files whose extension is
+ * missing or unknown are sniffed with libmagic, and those results are
+ * remembered per inode. The returned string stays valid until the
+ * next call.
+ */
+const char *mime_type(const char *path, const struct stat *st);
+
+/*
+ * Returns non-zero if content of the given MIME type is worth compressing
+ * (text, and structured or uncompressed binary formats).
+ */
+int mime_compressible(const char *type);
@@ -0,0 +1,431 @@
+#include "outbuf.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "io.h"
+
+/* Initial size of the spill segment */
+#define OUTBUF_SPILL_MIN 16384
+
+#if defined(TCP_CORK)
+#define OUTBUF_CORK TCP_CORK
+#elif defined(TCP_NOPUSH)
+#define OUTBUF_CORK TCP_NOPUSH
+#endif
+
+void
+outbuf_init(struct outbuf *ob, int fd, int blocking)
+{
+	ob->fd = fd;
+	ob->blocking = blocking;
+	ob->iov_first = ob->iov_cnt = 0;
+	ob->nowned = 0;
+	ob->spill = NULL;
+	ob->spill_cap = 0;
+	ob->spill_iov = -1;
+	ob->file_fd = -1;
+	ob->file_first = ob->nfiles = 0;
+	ob->corked = 0;
+	ob->arena_len = 0;
+}
+
+static void
+set_cork(struct outbuf *ob, int on)
+{
+#ifdef OUTBUF_CORK
+	if (ob->corked != on)
+	{
+		/* Fails harmlessly on anything but TCP sockets */
+		(void)setsockopt(ob->fd, IPPROTO_TCP, OUTBUF_CORK, &on, sizeof(on));
+		ob->corked = on;
+	}
+#else
+	(void)ob;
+	(void)on;
+#endif
+}
+
+static int
+add_segment(struct outbuf *ob, const void *base, size_t len)
+{
+	if (ob->iov_cnt == OUTBUF_IOV)
+	{
+		return -1;
+	}
+	ob->iov[ob->iov_cnt].iov_base = (void *)(uintptr_t)base;
+	ob->iov[ob->iov_cnt].iov_len = len;
+	ob->iov_cnt++;
+	return 0;
+}
+
+/* Appends to the spill segment, which is always the last one */
+static int
+spill_append(struct outbuf *ob, const void *data, size_t len)
+{
+	struct iovec *v;
+
+	if (ob->spill_iov < 0)
+	{
+		size_t cap = len > OUTBUF_SPILL_MIN ? len : OUTBUF_SPILL_MIN;
+
+		if (ob->nowned == OUTBUF_IOV || ob->iov_cnt == OUTBUF_IOV ||
+		    (ob->spill = malloc(cap)) == NULL)
+		{
+			return -1;
+		}
+		ob->spill_cap = cap;
+		ob->owned[ob->nowned++] = ob->spill;
+		ob->spill_iov = ob->iov_cnt;
+		(void)add_segment(ob, ob->spill, 0);
+	}
+
+	v = &ob->iov[ob->spill_iov];
+	if (v->iov_len + len > ob->spill_cap)
+	{
+		size_t cap = ob->spill_cap * 2;
+		size_t sent = (size_t)((char *)v->iov_base - ob->spill);
+		char *tmp;
+
+		while (cap < sent + v->iov_len + len)
+		{
+			cap *= 2;
+		}
+		if ((tmp = realloc(ob->spill, cap)) == NULL)
+		{
+			return -1;
+		}
+		for (int i = 0; i < ob->nowned; i++)
+		{
+			if (ob->owned[i] == ob->spill)
+			{
+				ob->owned[i] = tmp;
+			}
+		}
+		ob->spill = tmp;
+		ob->spill_cap = cap;
+		v->iov_base = tmp + sent;
+	}
+	memcpy((char *)v->iov_base + v->iov_len, data, len);
+	v->iov_len += len;
+	return 0;
+}
+
+/* Claims the next 'len' bytes of the arena, already filled in */
+static int
+arena_commit(struct outbuf *ob, size_t len)
+{
+	struct iovec *last = ob->iov_cnt > 0 ? &ob->iov[ob->iov_cnt - 1] : NULL;
+	char *dst = ob->arena + ob->arena_len;
+
+	ob->arena_len += len;
+
+	/* Grow the previous segment if it ends right here, and no file piece
+	   has to go out in between */
+	if (last && (char *)last->iov_base + last->iov_len == dst &&
+	    (ob->nfiles == 0 || ob->files[ob->nfiles - 1].iov_at < ob->iov_cnt))
+	{
+		last->iov_len += len;
+		return 0;
+	}
+	return add_segment(ob, dst, len);
+}
+
+int
+outbuf_copy(struct outbuf *ob, const void *data, size_t len)
+{
+	if (len == 0)
+	{
+		return 0;
+	}
+	if (ob->spill_iov >= 0 || len > sizeof(ob->arena) - ob->arena_len)
+	{
+		return spill_append(ob, data, len);
+	}
+
+	memcpy(ob->arena + ob->arena_len, data, len);
+	return arena_commit(ob, len);
+}
+
+int
+outbuf_printf(struct outbuf *ob, const char *fmt, ...)
+{
+	size_t avail = sizeof(ob->arena) - ob->arena_len;
+	va_list ap;
+	int n;
+
+	if (ob->spill_iov < 0)
+	{
+		va_start(ap, fmt);
+		n = vsnprintf(ob->arena + ob->arena_len, avail, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+		{
+			return -1;
+		}
+		if ((size_t)n < avail)
+		{
+			return arena_commit(ob, (size_t)n);
+		}
+	}
+
+	/* Doesn't fit: format on the heap */
+	{
+		char *buf;
+		int rc;
+
+		va_start(ap, fmt);
+		n = vsnprintf(NULL, 0, fmt, ap);
+		va_end(ap);
+		if (n < 0 || (buf = malloc((size_t)n + 1)) == NULL)
+		{
+			return -1;
+		}
+		va_start(ap, fmt);
+		(void)vsnprintf(buf, (size_t)n + 1, fmt, ap);
+		va_end(ap);
+		rc = outbuf_copy(ob, buf, (size_t)n);
+		free(buf);
+		return rc;
+	}
+}
+
+int
+outbuf_take(struct outbuf *ob, void *data, size_t len)
+{
+	if (ob->nowned == OUTBUF_IOV || add_segment(ob, data, len) < 0)
+	{
+		int rc = outbuf_copy(ob, data, len);
+		free(data);
+		return rc;
+	}
+	ob->owned[ob->nowned++] = data;
+
+	/* The spill segment is no longer last; later copies start a new one */
+	ob->spill_iov = -1;
+	return 0;
+}
+
+int
+outbuf_ref(struct outbuf *ob, const void *data, size_t len)
+{
+	if (add_segment(ob, data, len) < 0)
+	{
+		return outbuf_copy(ob, data, len);
+	}
+	ob->spill_iov = -1;
+	return 0;
+}
+
+int
+outbuf_file(struct outbuf *ob, int fd, off_t offset, off_t len)
+{
+	struct outbuf_file_part *part;
+
+	if (ob->file_fd != fd)
+	{
+		if (ob->file_fd >= 0)
+		{
+			close(ob->file_fd);
+		}
+		ob->file_fd = fd;
+	}
+	if (ob->nfiles == OUTBUF_FILES)
+	{
+		return -1;
+	}
+
+	part = &ob->files[ob->nfiles++];
+	part->iov_at = ob->iov_cnt;
+	part->off = offset;
+	part->left = len;
+
+	/* Later output goes after the piece, never into an earlier segment */
+	ob->spill_iov = -1;
+	return 0;
+}
+
+int
+outbuf_pending(const struct outbuf *ob)
+{
+	return ob->iov_first < ob->iov_cnt || ob->file_first < ob->nfiles;
+}
+
+/* Skips 'n' sent bytes, possibly ending inside a segment before 'end' */
+static void
+skip_segments(struct outbuf *ob, size_t n, int end)
+{
+	while (n > 0)
+	{
+		struct iovec *v = &ob->iov[ob->iov_first];
+
+		if (n < v->iov_len)
+		{
+			v->iov_base = (char *)v->iov_base + n;
+			v->iov_len -= n;
+			break;
+		}
+		n -= v->iov_len;
+		v->iov_len = 0;
+		ob->iov_first++;
+	}
+	while (ob->iov_first < end && ob->iov[ob->iov_first].iov_len == 0)
+	{
+		ob->iov_first++;
+	}
+}
+
+/* Writes the memory segments before index 'end' */
+static int
+send_segments(struct outbuf *ob, int end)
+{
+	while (ob->iov_first < end)
+	{
+		ssize_t n = writev(ob->fd, ob->iov + ob->iov_first,
+		                   end - ob->iov_first);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		}
+
+		skip_segments(ob, (size_t)n, end);
+	}
+	return 1;
+}
+
+/* Sends a piece of the file body */
+static int
+send_file_part(struct outbuf *ob, struct outbuf_file_part *part)
+{
+	while (part->left > 0)
+	{
+		size_t chunk = part->left > IO_CHUNK ? IO_CHUNK : (size_t)part->left;
+		ssize_t n = send_file_range(ob->fd, ob->file_fd, &part->off, chunk);
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		}
+		if (n == 0)
+		{
+			/* File shrank underneath us */
+			return -1;
+		}
+		part->left -= n;
+	}
+	return 1;
+}
+
+int
+outbuf_send(struct outbuf *ob)
+{
+	int rc;
+
+	/* Let the text share packets with the file data around it */
+	if (ob->file_first < ob->nfiles && ob->iov_first < ob->iov_cnt)
+	{
+		set_cork(ob, 1);
+	}
+
+	for (; ob->file_first < ob->nfiles; ob->file_first++)
+	{
+		struct outbuf_file_part *part = &ob->files[ob->file_first];
+
+		if ((rc = send_segments(ob, part->iov_at)) <= 0 ||
+		    (rc = send_file_part(ob, part)) <= 0)
+		{
+			return rc;
+		}
+	}
+	if ((rc = send_segments(ob, ob->iov_cnt)) <= 0)
+	{
+		return rc;
+	}
+
+	/* All gone: make room for more */
+	outbuf_reset(ob);
+	return 1;
+}
+
+/* Index of the first segment that goes after the current file piece */
+static int
+segments_end(const struct outbuf *ob)
+{
+	return ob->file_first < ob->nfiles ? ob->files[ob->file_first].iov_at
+	                                   : ob->iov_cnt;
+}
+
+int
+outbuf_next(struct outbuf *ob, struct iovec **iov,
+            struct outbuf_file_part **part)
+{
+	int end;
+
+	while (ob->file_first < ob->nfiles && ob->files[ob->file_first].left == 0)
+	{
+		ob->file_first++;
+	}
+	end = segments_end(ob);
+	while (ob->iov_first < end && ob->iov[ob->iov_first].iov_len == 0)
+	{
+		ob->iov_first++;
+	}
+
+	*iov = &ob->iov[ob->iov_first];
+	*part = ob->file_first < ob->nfiles ? &ob->files[ob->file_first] : NULL;
+	return end - ob->iov_first;
+}
+
+void
+outbuf_advance(struct outbuf *ob, size_t n)
+{
+	int end = segments_end(ob);
+
+	if (ob->iov_first < end)
+	{
+		skip_segments(ob, n, end);
+	}
+	else if (ob->file_first < ob->nfiles)
+	{
+		struct outbuf_file_part *part = &ob->files[ob->file_first];
+
+		part->off += (off_t)n;
+		part->left -= (off_t)n;
+		if (part->left <= 0)
+		{
+			ob->file_first++;
+		}
+	}
+}
+
+void
+outbuf_reset(struct outbuf *ob)
+{
+	for (int i = 0; i < ob->nowned; i++)
+	{
+		free(ob->owned[i]);
+	}
+	if (ob->file_fd >= 0)
+	{
+		close(ob->file_fd);
+	}
+	set_cork(ob, 0);
+	outbuf_init(ob, ob->fd, ob->blocking);
+}
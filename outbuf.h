@@ -0,0 +1,131 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stddef.h>
+
+/* Bytes of response head (and small bodies) formatted in place */
+#define OUTBUF_ARENA 8192
+
+/* Memory segments a response may consist of */
+#define OUTBUF_IOV 16
+
+/* Pieces of the file body (e.g. byte ranges) a response may consist of */
+#define OUTBUF_FILES 16
+
+/* A piece of the file body, sent after the first 'iov_at' segments */
+struct outbuf_file_part
+{
+	int iov_at;
+	off_t off;
+	off_t left;
+};
+
+/*
+ * A response on its way to the client: memory segments sent with writev(2)
+ * and pieces of a file sent with sendfile(2), in the order they were
+ * added. Text is formatted into a preallocated arena, so a typical
+ * response is built without allocating and leaves in one system call (two
+ * with a file body, corked into the same packets).
+ */
+struct outbuf
+{
+	int fd;
+	int blocking; /* outbuf_send() finishes before returning */
+
+	struct iovec iov[OUTBUF_IOV];
+	int iov_first; /* first segment not completely sent */
+	int iov_cnt;
+
+	/* Heap memory released once the response is gone */
+	void *owned[OUTBUF_IOV];
+	int nowned;
+
+	/* Growable tail segment for output that outgrows the arena */
+	char *spill;
+	size_t spill_cap;
+	int spill_iov; /* its index in iov, or -1 */
+
+	/* File the body pieces come from; owned */
+	int file_fd;
+	struct outbuf_file_part files[OUTBUF_FILES];
+	int file_first; /* first piece not completely sent */
+	int nfiles;
+
+	int corked;
+
+	size_t arena_len;
+	char arena[OUTBUF_ARENA];
+};
+
+/*
+ * Prepares ob for responses to the client socket fd. With 'blocking' set,
+ * outbuf_send() returns only once everything was written.
+ */
+void outbuf_init(struct outbuf *ob, int fd, int blocking);
+
+/*
+ * Appends formatted text. Returns 0 on success, -1 on error.
+ */
+int outbuf_printf(struct outbuf *ob, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/*
+ * Appends a copy of 'len' bytes of data. Returns 0 on success, -1 on error.
+ */
+int outbuf_copy(struct outbuf *ob, const void *data, size_t len);
+
+/*
+ * Appends 'len' bytes of malloc'd memory without copying; ob frees it.
+ * Returns 0 on success, -1 on error (data is freed either way).
+ */
+int outbuf_take(struct outbuf *ob, void *data, size_t len);
+
+/*
+ * Appends 'len' bytes of data without copying. The memory must stay valid
+ * until the next outbuf_send() has returned 1.
+ * Returns 0 on success, -1 on error.
+ */
+int outbuf_ref(struct outbuf *ob, const void *data, size_t len);
+
+/*
+ * Appends 'len' bytes of the open file fd from 'offset'. ob owns fd from
+ * now on; further pieces of the same fd may follow, with other output in
+ * between.
+ * Returns 0 on success, -1 if ob has no room for another piece.
+ */
+int outbuf_file(struct outbuf *ob, int fd, off_t offset, off_t len);
+
+/*
+ * Returns non-zero if anything is waiting to be sent.
+ */
+int outbuf_pending(const struct outbuf *ob);
+
+/*
+ * Writes as much as the socket accepts. Returns 1 once everything was
+ * sent (ob is then empty again, as after outbuf_reset), 0 if a
+ * non-blocking socket is full, -1 on error.
+ */
+int outbuf_send(struct outbuf *ob);
+
+/*
+ * For senders other than outbuf_send(), e.g. over io_uring(7): returns the
+ * number of memory segments due before the next file piece and points
+ * *iov at them. *part is set to that file piece, or NULL if there is
+ * none left. Returns 0 with *part NULL once everything was sent.
+ */
+int outbuf_next(struct outbuf *ob, struct iovec **iov,
+                struct outbuf_file_part **part);
+
+/*
+ * Marks 'n' bytes as sent: of the segments outbuf_next() returned if there
+ * were any, else of its file piece.
+ */
+void outbuf_advance(struct outbuf *ob, size_t n);
+
+/*
+ * Drops whatever is left, releasing owned memory and the file body, so
+ * ob can take the next response.
+ */
+void outbuf_reset(struct outbuf *ob);
@@ -0,0 +1,248 @@
+#include "pack.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct pack
+{
+	int fd;
+	const char *base;
+	size_t size;
+	const struct pack_header *hdr;
+	const struct pack_entry *entries;
+	const uint32_t *slots;
+
+	/* File the mapping was made from, to notice a redeploy */
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+};
+
+static struct pack cur = {.fd = -1};
+static const char *pack_path;
+static time_t checked; /* last look for a redeploy, monotonic seconds */
+
+uint32_t
+pack_hash(const char *path)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *path; path++)
+	{
+		h ^= (unsigned char)*path;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* Checks that a span lies within the pack, followed by a NUL if 'str' */
+static int
+span_ok(const struct pack *p, struct pack_span s, int str)
+{
+	return s.off <= p->size && s.len <= p->size - s.off &&
+	       (!str || (s.len < p->size - s.off && p->base[s.off + s.len] == 0));
+}
+
+static int
+entries_ok(const struct pack *p)
+{
+	for (uint32_t i = 0; i < p->hdr->nentries; i++)
+	{
+		const struct pack_entry *e = &p->entries[i];
+		int coded = e->gz_body.len > 0;
+
+		if (!span_ok(p, e->path, 1) || !span_ok(p, e->content_type, 1) ||
+		    !span_ok(p, e->etag, 1) || !span_ok(p, e->last_modified, 1) ||
+		    !span_ok(p, e->extra, 1) || !span_ok(p, e->headers, 0) ||
+		    !span_ok(p, e->body, 0) || !span_ok(p, e->gz_etag, coded) ||
+		    !span_ok(p, e->gz_headers, 0) || !span_ok(p, e->gz_body, 0))
+		{
+			return 0;
+		}
+	}
+	for (uint32_t i = 0; i < p->hdr->nslots; i++)
+	{
+		if (p->slots[i] > p->hdr->nentries)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void
+unload(struct pack *p)
+{
+	if (p->base != NULL)
+	{
+		munmap((void *)p->base, p->size);
+		p->base = NULL;
+	}
+	if (p->fd >= 0)
+	{
+		close(p->fd);
+		p->fd = -1;
+	}
+}
+
+static int
+load(const char *path, struct pack *p)
+{
+	const struct pack_header *h;
+	struct stat st;
+	void *base;
+
+	memset(p, 0, sizeof(*p));
+	if ((p->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+	{
+		return -1;
+	}
+	if (fstat(p->fd, &st) < 0)
+	{
+		goto fail;
+	}
+	if (!S_ISREG(st.st_mode) || st.st_size < (off_t)sizeof(*h))
+	{
+		errno = EINVAL;
+		goto fail;
+	}
+	base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, p->fd, 0);
+	if (base == MAP_FAILED)
+	{
+		goto fail;
+	}
+	p->base = base;
+	p->size = (size_t)st.st_size;
+	p->dev = st.st_dev;
+	p->ino = st.st_ino;
+	p->mtime = st.st_mtim;
+
+	h = p->hdr = base;
+	if (memcmp(h->magic, PACK_MAGIC, sizeof(PACK_MAGIC)) != 0 ||
+	    h->version != PACK_VERSION || h->size != p->size ||
+	    h->nslots == 0 || (h->nslots & (h->nslots - 1)) != 0 ||
+	    h->nslots < h->nentries || h->entries_off % 8 != 0 ||
+	    h->entries_off > p->size ||
+	    (p->size - h->entries_off) / sizeof(struct pack_entry) <
+	        h->nentries ||
+	    h->slots_off % 4 != 0 || h->slots_off > p->size ||
+	    (p->size - h->slots_off) / sizeof(uint32_t) < h->nslots)
+	{
+		errno = EINVAL;
+		goto fail;
+	}
+	p->entries = (const struct pack_entry *)(p->base + h->entries_off);
+	p->slots = (const uint32_t *)(p->base + h->slots_off);
+	if (!entries_ok(p))
+	{
+		errno = EINVAL;
+		goto fail;
+	}
+	return 0;
+
+fail:
+	{
+		int saved = errno;
+		unload(p);
+		errno = saved;
+	}
+	return -1;
+}
+
+int
+pack_open(const char *path)
+{
+	struct timespec ts;
+
+	if (load(path, &cur) < 0)
+	{
+		return -1;
+	}
+	pack_path = path;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	checked = ts.tv_sec;
+	return 0;
+}
+
+void
+pack_refresh(void)
+{
+	struct timespec ts;
+	struct pack next;
+	struct stat st;
+
+	if (cur.base == NULL)
+	{
+		return;
+	}
+
+	/* Coarse enough for a second, and no system call with the vDSO */
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	if (ts.tv_sec == checked)
+	{
+		return;
+	}
+	checked = ts.tv_sec;
+
+	if (stat(pack_path, &st) < 0 ||
+	    (st.st_dev == cur.dev && st.st_ino == cur.ino &&
+	     st.st_mtim.tv_sec == cur.mtime.tv_sec &&
+	     st.st_mtim.tv_nsec == cur.mtime.tv_nsec))
+	{
+		return;
+	}
+	/* A broken pack leaves the old one in service */
+	if (load(pack_path, &next) == 0)
+	{
+		unload(&cur);
+		cur = next;
+	}
+}
+
+const struct pack_entry *
+pack_lookup(const char *path)
+{
+	uint32_t hash, mask;
+
+	if (cur.base == NULL)
+	{
+		return NULL;
+	}
+	pack_refresh();
+
+	hash = pack_hash(path);
+	mask = cur.hdr->nslots - 1;
+	for (uint32_t i = hash & mask, n = 0; n < cur.hdr->nslots && cur.slots[i];
+	     i = (i + 1) & mask, n++)
+	{
+		const struct pack_entry *e = &cur.entries[cur.slots[i] - 1];
+
+		if (e->hash == hash && strcmp(pack_at(e->path), path) == 0)
+		{
+			return e;
+		}
+	}
+	return NULL;
+}
+
+const char *
+pack_at(struct pack_span span)
+{
+	return cur.base + span.off;
+}
+
+int
+pack_fd(void)
+{
+	return cur.fd;
+}
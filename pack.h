@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Site packs: a whole docroot in one read-only file, made by swspack(1)
+ * and served with -A without any per-request stat, open or type lookup.
+ * Every entry holds its body (and maybe a gzip-coded variant) together
+ * with the entity headers of its responses, ready to be sent.
+ *
+ * Layout, in the byte order of the machine that packed it:
+ *
+ *   struct pack_header
+ *   bodies and strings (strings are NUL-terminated; spans exclude it)
+ *   struct pack_entry[nentries]
+ *   uint32_t slots[nslots]  (open-addressed by path hash: entry + 1, or 0)
+ *
+ * Entries are keyed by request path as normalize_path() leaves it, so a
+ * directory is "/dir" (or "/"), answered with its index.html or a listing.
+ */
+
+#define PACK_MAGIC "SWSPACK"
+#define PACK_VERSION 1
+
+/*
+ * Bodies up to this size are copied out of the mapping; larger ones are
+ * sent from the pack's descriptor.
+ */
+#define PACK_COPY_MAX (16 * 1024)
+
+/* 'len' bytes at 'off' from the start of the pack */
+struct pack_span
+{
+	uint64_t off;
+	uint64_t len;
+};
+
+struct pack_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t nentries;
+	uint64_t entries_off;
+	uint64_t slots_off;
+	uint32_t nslots; /* power of two */
+	uint32_t reserved;
+	uint64_t size; /* of the whole pack */
+};
+
+struct pack_entry
+{
+	struct pack_span path;
+	uint32_t hash; /* pack_hash() of path */
+	uint32_t reserved;
+	int64_t mtime;
+
+	/* The identity representation */
+	struct pack_span content_type;
+	struct pack_span etag;
+	struct pack_span last_modified;
+	struct pack_span extra;   /* header lines, see http_static_headers() */
+	struct pack_span headers; /* all entity headers of a 200 response */
+	struct pack_span body;
+
+	/* The gzip-coded one, if it is smaller (gz_body.len 0: none) */
+	struct pack_span gz_etag;
+	struct pack_span gz_headers;
+	struct pack_span gz_body;
+};
+
+/*
+ * Returns the hash pack entries are indexed by.
+ */
+uint32_t pack_hash(const char *path);
+
+/*
+ * Maps the pack at 'path' to serve from, checking its layout. Call before
+ * forking. Once a second at most, pack_lookup() looks whether another
+ * pack was renamed to 'path' (as swspack does) and switches to it.
+ * Returns 0 on success, -1 (with errno set) on error.
+ */
+int pack_open(const char *path);
+
+/*
+ * Switches to a pack renamed over ours since the last look, as
+ * pack_lookup() does. A process forking for each connection calls it
+ * before forking, so that its children inherit the current mapping
+ * instead of each loading the new pack.
+ */
+void pack_refresh(void);
+
+/*
+ * Returns the entry for the request path 'path', or NULL if there is
+ * none. The entry, and what pack_at() returns for it, stay valid until
+ * the next lookup.
+ */
+const struct pack_entry *pack_lookup(const char *path);
+
+/*
+ * Returns the bytes of a span of the current pack.
+ */
+const char *pack_at(struct pack_span span);
+
+/*
+ * Returns a descriptor of the current pack, to send bodies from at their
+ * offsets.
+ */
+int pack_fd(void);
@@ -0,0 +1,199 @@
+#include "parser.h"
+
+#include <string.h>
+#include <strings.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Returns the first occurrence of c in [p, end), or NULL. Lines are found
+ * 32 or 16 bytes at a time where the CPU allows it.
+ */
+static const char *
+find_char(const char *p, const char *end, char c)
+{
+#if defined(__AVX2__)
+	const __m256i needle32 = _mm256_set1_epi8(c);
+
+	while (end - p >= 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(const void *)p);
+		unsigned int m =
+			(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle32));
+		if (m != 0)
+		{
+			return p + __builtin_ctz(m);
+		}
+		p += 32;
+	}
+#endif
+#if defined(__SSE2__)
+	const __m128i needle16 = _mm_set1_epi8(c);
+
+	while (end - p >= 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(const void *)p);
+		unsigned int m =
+			(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, needle16));
+		if (m != 0)
+		{
+			return p + __builtin_ctz(m);
+		}
+		p += 16;
+	}
+#endif
+	for (; p < end; p++)
+	{
+		if (*p == c)
+		{
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static int
+is_ows(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+void
+http_parser_init(struct http_parser *p)
+{
+	memset(p, 0, sizeof(*p));
+}
+
+/* "METHOD SP target SP version"; the line excludes the CRLF */
+static int
+parse_request_line_slices(struct http_parser *p, const char *line,
+                          const char *end)
+{
+	const char *sp1, *sp2;
+
+	if ((sp1 = find_char(line, end, ' ')) == NULL ||
+	    (sp2 = find_char(sp1 + 1, end, ' ')) == NULL)
+	{
+		return -1;
+	}
+
+	p->method.p = line;
+	p->method.len = (size_t)(sp1 - line);
+	p->target.p = sp1 + 1;
+	p->target.len = (size_t)(sp2 - sp1 - 1);
+	p->version.p = sp2 + 1;
+	p->version.len = (size_t)(end - sp2 - 1);
+	return 0;
+}
+
+static void
+parse_header_line(struct http_parser *p, const char *line, const char *end)
+{
+	const char *colon = find_char(line, end, ':');
+	const char *v;
+	struct http_header *h;
+
+	/* Malformed lines and headers we have no room for are skipped */
+	if (colon == NULL || colon == line || p->nheaders == HTTP_MAX_HEADERS)
+	{
+		return;
+	}
+
+	for (v = colon + 1; v < end && is_ows(*v); v++)
+		;
+	while (end > v && is_ows(end[-1]))
+	{
+		end--;
+	}
+
+	h = &p->headers[p->nheaders++];
+	h->name.p = line;
+	h->name.len = (size_t)(colon - line);
+	h->value.p = v;
+	h->value.len = (size_t)(end - v);
+}
+
+ssize_t
+http_parser_feed(struct http_parser *p, const char *buf, size_t len)
+{
+	if (p->done)
+	{
+		return (ssize_t)p->done;
+	}
+	if (p->buf != buf)
+	{
+		/* New (or moved) buffer: start over */
+		http_parser_init(p);
+		p->buf = buf;
+	}
+
+	for (;;)
+	{
+		const char *line = buf + p->line_start;
+		const char *lf = find_char(buf + p->scanned, buf + len, '\n');
+		const char *end;
+
+		if (lf == NULL)
+		{
+			p->scanned = len;
+			return 0;
+		}
+
+		end = lf;
+		if (end > line && end[-1] == '\r')
+		{
+			end--;
+		}
+
+		if (!p->have_request_line)
+		{
+			if (end == line)
+			{
+				/* Stray empty lines before a request are ignored */
+			}
+			else if (end == lf || parse_request_line_slices(p, line, end) < 0)
+			{
+				/* The request line must end in CRLF */
+				return -1;
+			}
+			else
+			{
+				p->have_request_line = 1;
+			}
+		}
+		else if (end == line)
+		{
+			p->done = (size_t)(lf + 1 - buf);
+			return (ssize_t)p->done;
+		}
+		else
+		{
+			parse_header_line(p, line, end);
+		}
+
+		p->line_start = p->scanned = (size_t)(lf + 1 - buf);
+	}
+}
+
+int
+http_slice_eq(const struct http_slice *s, const char *str)
+{
+	size_t n = strlen(str);
+
+	return s->len == n && strncasecmp(s->p, str, n) == 0;
+}
+
+const struct http_slice *
+http_parser_header(const struct http_parser *p, const char *name)
+{
+	for (size_t i = 0; i < p->nheaders; i++)
+	{
+		if (http_slice_eq(&p->headers[i].name, name))
+		{
+			return &p->headers[i].value;
+		}
+	}
+	return NULL;
+}
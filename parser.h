@@ -0,0 +1,72 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <stddef.h>
+
+/* Headers beyond this many are parsed but not recorded */
+#define HTTP_MAX_HEADERS 64
+
+/* Largest request head (request line and headers) we accept */
+#define HTTP_MAX_HEAD 8192
+
+/* A piece of the caller's buffer; not NUL-terminated */
+struct http_slice
+{
+	const char *p;
+	size_t len;
+};
+
+struct http_header
+{
+	struct http_slice name;
+	struct http_slice value; /* without surrounding whitespace */
+};
+
+/*
+ * Incremental request head parser. It never copies or allocates: results
+ * point into the buffer being parsed, which must stay in place (it may
+ * grow) between calls until the head is complete.
+ */
+struct http_parser
+{
+	struct http_slice method;
+	struct http_slice target;
+	struct http_slice version;
+
+	struct http_header headers[HTTP_MAX_HEADERS];
+	size_t nheaders;
+
+	/* Resume state */
+	const char *buf;
+	size_t line_start; /* offset of the line being parsed */
+	size_t scanned;    /* bytes of that line already searched for LF */
+	int have_request_line;
+	size_t done; /* head length once complete */
+};
+
+/*
+ * Prepares p for a new request.
+ */
+void http_parser_init(struct http_parser *p);
+
+/*
+ * Parses as much of buf[0, len) as possible, picking up where the previous
+ * call on the same buffer stopped.
+ * Returns the length of the request head (including the blank line) once
+ * it is complete, 0 if more data is needed, or -1 if the request line is
+ * malformed. Once complete, further calls return the same length.
+ */
+ssize_t http_parser_feed(struct http_parser *p, const char *buf, size_t len);
+
+/*
+ * Returns the value of the first header called 'name' (compared without
+ * regard to case), or NULL if the request has no such header.
+ */
+const struct http_slice *http_parser_header(const struct http_parser *p,
+                                            const char *name);
+
+/*
+ * Returns non-zero if the slice equals 'str', ignoring case.
+ */
+int http_slice_eq(const struct http_slice *s, const char *str);
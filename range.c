@@ -0,0 +1,173 @@
+#include "range.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <strings.h>
+
+static const char *
+skip_ows(const char *p)
+{
+	while (*p == ' ' || *p == '\t')
+	{
+		p++;
+	}
+	return p;
+}
+
+/* Reads a decimal number; returns the end of it, or NULL */
+static const char *
+parse_pos(const char *p, off_t *val)
+{
+	long long v = 0;
+
+	if (*p < '0' || *p > '9')
+	{
+		return NULL;
+	}
+	for (; *p >= '0' && *p <= '9'; p++)
+	{
+		if (v > (INT64_MAX - (*p - '0')) / 10)
+		{
+			return NULL;
+		}
+		v = v * 10 + (*p - '0');
+	}
+	*val = (off_t)v;
+	return p;
+}
+
+/* Sorts by first byte and merges ranges that overlap or touch */
+static int
+coalesce(struct byte_range *r, int n)
+{
+	int out = 0;
+
+	for (int i = 1; i < n; i++)
+	{
+		struct byte_range cur = r[i];
+		int k = i - 1;
+
+		while (k >= 0 && r[k].first > cur.first)
+		{
+			r[k + 1] = r[k];
+			k--;
+		}
+		r[k + 1] = cur;
+	}
+
+	for (int i = 0; i < n; i++)
+	{
+		if (out > 0 && r[i].first <= r[out - 1].last + 1)
+		{
+			if (r[i].last > r[out - 1].last)
+			{
+				r[out - 1].last = r[i].last;
+			}
+			continue;
+		}
+		r[out++] = r[i];
+	}
+	return out;
+}
+
+int
+http_parse_range(const char *spec, off_t size, struct byte_range *ranges,
+                 int max)
+{
+	const char *p = skip_ows(spec);
+	int n = 0, seen = 0;
+
+	if (strncasecmp(p, "bytes=", 6) != 0)
+	{
+		return -1;
+	}
+	p += 6;
+
+	for (;;)
+	{
+		off_t first, last;
+		int suffix = 0, open = 0;
+
+		p = skip_ows(p);
+		if (*p == ',')
+		{
+			/* Empty list elements are allowed */
+			p++;
+			continue;
+		}
+		if (*p == '\0')
+		{
+			break;
+		}
+		seen = 1;
+
+		if (*p == '-')
+		{
+			suffix = 1;
+			if ((p = parse_pos(p + 1, &last)) == NULL)
+			{
+				return -1;
+			}
+		}
+		else
+		{
+			if ((p = parse_pos(p, &first)) == NULL || *p++ != '-')
+			{
+				return -1;
+			}
+			if (*p >= '0' && *p <= '9')
+			{
+				if ((p = parse_pos(p, &last)) == NULL || last < first)
+				{
+					return -1;
+				}
+			}
+			else
+			{
+				open = 1;
+			}
+		}
+
+		p = skip_ows(p);
+		if (*p != ',' && *p != '\0')
+		{
+			return -1;
+		}
+
+		/* Keep the satisfiable ones, clipped to the representation */
+		if (suffix)
+		{
+			if (last == 0 || size == 0)
+			{
+				continue;
+			}
+			first = last >= size ? 0 : size - last;
+			last = size - 1;
+		}
+		else
+		{
+			if (first >= size)
+			{
+				continue;
+			}
+			if (open || last >= size)
+			{
+				last = size - 1;
+			}
+		}
+
+		if (n == max)
+		{
+			return -1;
+		}
+		ranges[n].first = first;
+		ranges[n].last = last;
+		n++;
+	}
+
+	if (!seen)
+	{
+		return -1;
+	}
+	return coalesce(ranges, n);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <sys/types.h>
+
+/* Ranges served per request; more than that and the whole file is sent */
+#define HTTP_MAX_RANGES 8
+
+/* A satisfiable byte range; 'last' is inclusive */
+struct byte_range
+{
+	off_t first;
+	off_t last;
+};
+
+/*
+ * Parses a Range header value ("bytes=0-99,200-,-50") against a
+ * representation of 'size' bytes. The satisfiable ranges are stored in
+ * 'ranges' in ascending order, with overlapping and adjacent ones merged.
+ * Returns the number of ranges stored, 0 if none of them is satisfiable
+ * (416), or -1 if the header is to be ignored because it is malformed,
+ * not about bytes or asks for more than 'max' ranges.
+ */
+int http_parse_range(const char *spec, off_t size, struct byte_range *ranges,
+                     int max);
@@ -0,0 +1,115 @@
+#include "resolve.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+
+#include <linux/openat2.h>
+#endif
+
+/* The docroot and the ~user roots recently served */
+#define RESOLVE_ROOTS 32
+
+/* Opened only to be looked up beneath, never read */
+#ifdef O_PATH
+#define ROOT_FLAGS (O_PATH | O_DIRECTORY | O_CLOEXEC)
+#else
+#define ROOT_FLAGS (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+#endif
+
+struct root
+{
+	char *dir;
+	int fd;
+};
+
+static struct root roots[RESOLVE_ROOTS];
+static size_t nroots;
+static size_t next_victim;
+
+int
+resolve_root(const char *dir)
+{
+	struct root *r;
+	char *copy;
+	int fd;
+
+	for (size_t i = 0; i < nroots; i++)
+	{
+		if (strcmp(roots[i].dir, dir) == 0)
+		{
+			return roots[i].fd;
+		}
+	}
+
+	if ((fd = open(dir, ROOT_FLAGS)) < 0)
+	{
+		return -1;
+	}
+	if ((copy = strdup(dir)) == NULL)
+	{
+		close(fd);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* Once full, replace entries in turn; slot 0, the docroot, is kept */
+	if (nroots < RESOLVE_ROOTS)
+	{
+		r = &roots[nroots++];
+	}
+	else
+	{
+		r = &roots[1 + next_victim++ % (RESOLVE_ROOTS - 1)];
+		close(r->fd);
+		free(r->dir);
+	}
+	r->dir = copy;
+	r->fd = fd;
+	return fd;
+}
+
+int
+resolve_open(int rootfd, const char *path, int flags)
+{
+#ifdef __linux__
+	static int no_openat2 = 0;
+#endif
+
+	while (*path == '/')
+	{
+		path++;
+	}
+	if (*path == '\0')
+	{
+		path = ".";
+	}
+
+#ifdef __linux__
+	if (!no_openat2)
+	{
+		struct open_how how;
+		int fd;
+
+		memset(&how, 0, sizeof(how));
+		how.flags = (unsigned long long)(flags | O_CLOEXEC);
+		how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+		fd = (int)syscall(SYS_openat2, rootfd, path, &how, sizeof(how));
+		if (fd >= 0 || errno != ENOSYS)
+		{
+			return fd;
+		}
+		/* Before Linux 5.6 */
+		no_openat2 = 1;
+	}
+#endif
+	return openat(rootfd, path, flags | O_CLOEXEC);
+}
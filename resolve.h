@@ -0,0 +1,28 @@
+#pragma once
+
+/*
+ * Lookups of request paths beneath a served root (the docroot or a
+ * ~user/sws directory). Each root is opened once as a directory
+ * descriptor, and paths are opened relative to it: the kernel walks only
+ * the components below the root, and on Linux (openat2(2) with
+ * RESOLVE_BENEATH) refuses any lookup that would leave it, be it through
+ * "..", an absolute path or a symbolic link.
+ */
+
+/*
+ * Returns the descriptor of the root directory 'dir', opening it on first
+ * use. Descriptors are remembered per process by path and stay open; open
+ * the docroot before forking so that every process shares it.
+ * Returns -1 (with errno set) on error.
+ */
+int resolve_root(const char *dir);
+
+/*
+ * Opens 'path' (leading slashes ignored; "" or "/" name the root itself)
+ * beneath the directory 'rootfd' with open(2) 'flags'. Where the kernel
+ * can't confine the lookup, falls back to openat(2) and relies on the
+ * path having been normalized.
+ * Returns the new descriptor, or -1 (with errno set; EXDEV for an escape
+ * attempt) on error.
+ */
+int resolve_open(int rootfd, const char *path, int flags);
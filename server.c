@@ -1,5 +1,9 @@
 #include "server.h"
 
+#ifdef __linux__
+#include <sched.h>
+#endif
+
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -15,7 +19,22 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "accesslog.h"
+#include "cache.h"
+#include "encoding.h"
+#include "event.h"
+#include "fcgi.h"
+#include "fdcache.h"
 #include "http.h"
+#include "manifest.h"
+#include "metrics.h"
+#include "mime.h"
+#include "outbuf.h"
+#include "pack.h"
+#include "parser.h"
+#include "resolve.h"
+#include "timefmt.h"
+#include "userdir.h"
 
 
 #define BACKLOG 5
@@ -26,30 +45,16 @@ void
 logRequest(struct server_config *config, const char *clientIP,
            struct http_request *req, struct http_response *resp)
 {
-	time_t now = time(NULL);
-	struct tm gmt;
-	gmtime_r(&now, &gmt);
-
-	char timebuf[64];
-	strftime(timebuf, sizeof(timebuf), "%Y-%m-%dT%H:%M:%SZ", &gmt);
-
-	char logbuf[4096];
-	snprintf(logbuf, sizeof(logbuf), "%s %s \"%s %s %s\" %d %zu", clientIP,
-	         timebuf, req->method, req->path, req->version, resp->status_code,
-	         resp->content_len);
-
 	if (config->debug_mode)
 	{
-		printf("%s\n", logbuf);
+		printf("%s %s \"%s %s %s\" %d %zu\n", clientIP, timefmt_iso_now(),
+		       req->method, req->path, req->version, resp->status_code,
+		       resp->content_len);
 	}
 	else
 	{
-		FILE *fp = config->logfp;
-		if (fp)
-		{
-			fprintf(fp, "%s\n", logbuf);
-			fflush(fp);
-		}
+		/* Written out by the log writer, off the request path */
+		alog_record(clientIP, req, resp);
 	}
 }
 
@@ -119,6 +124,21 @@ createSocket(struct server_config *config)
 		}
 	}
 
+#ifdef SO_REUSEPORT
+	/* Workers each bind their own listener; the kernel balances among them */
+	if (config->workers > 0)
+	{
+		int yes = 1;
+		if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (void *)&yes,
+		               sizeof(yes)) < 0)
+		{
+			perror("setsockopt SO_REUSEPORT");
+			exit(EXIT_FAILURE);
+			/* NOTREACHED */
+		}
+	}
+#endif
+
 	if (bind(sock, (struct sockaddr *)&server, length) != 0)
 	{
 		perror("Binding stream socket");
@@ -142,7 +162,7 @@ createSocket(struct server_config *config)
 		(void)printf("Socket has port #%d\n", ntohs(sin6->sin6_port));
 	}
 
-	if (listen(sock, BACKLOG) < 0)
+	if (listen(sock, config->backlog > 0 ? config->backlog : BACKLOG) < 0)
 	{
 		perror("listening");
 		exit(EXIT_FAILURE);
@@ -152,37 +172,33 @@ createSocket(struct server_config *config)
 	return sock;
 }
 
-void
-handleConnection(int fd, struct sockaddr_storage client,
-                 struct server_config *config)
+const char *
+clientAddress(const struct sockaddr_storage *client, char *buf, size_t len)
 {
-	int res;
 	const char *rip;
-	char addrbuf[INET6_ADDRSTRLEN];
-	struct http_request req;
-	struct http_response resp;
 
 	/* Convert client address to string */
-	if (client.ss_family == AF_INET)
+	if (client->ss_family == AF_INET)
 	{
-		struct sockaddr_in *sin = (struct sockaddr_in *)&client;
-		rip = inet_ntop(AF_INET, &sin->sin_addr, addrbuf, sizeof(addrbuf));
+		const struct sockaddr_in *sin = (const struct sockaddr_in *)client;
+		rip = inet_ntop(AF_INET, &sin->sin_addr, buf, len);
 	}
-	else if (client.ss_family == AF_INET6)
+	else if (client->ss_family == AF_INET6)
 	{
-		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&client;
-		rip = inet_ntop(AF_INET6, &sin6->sin6_addr, addrbuf, sizeof(addrbuf));
+		const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)client;
+		rip = inet_ntop(AF_INET6, &sin6->sin6_addr, buf, len);
 	}
 	else
 	{
-		rip = "unknown";
+		rip = NULL;
 	}
 
-	if (config->debug_mode)
-	{
-		printf("Client connected from %s\n", rip);
-	}
+	return rip ? rip : "unknown";
+}
 
+void
+setRequestEnvironment(const char *rip, struct server_config *config)
+{
 	if (setenv("REMOTE_ADDR", rip, 1) == -1)
 	{
 		/* ignore */
@@ -202,28 +218,113 @@ handleConnection(int fd, struct sockaddr_storage client,
 			setenv("SERVER_NAME", hostbuf, 1);
 		}
 	}
+}
+
+void
+handleConnection(int fd, struct sockaddr_storage client,
+                 struct server_config *config)
+{
+	int res;
+	const char *rip;
+	char addrbuf[INET6_ADDRSTRLEN];
+	struct http_request req;
+	struct http_response resp;
+
+	/*
+	 * A client hanging up mid-response must not kill us before the
+	 * request is logged and the connection counted as closed
+	 */
+	(void)signal(SIGPIPE, SIG_IGN);
+
+	rip = clientAddress(&client, addrbuf, sizeof(addrbuf));
+	metrics_connection_opened();
+
+	if (config->debug_mode)
+	{
+		printf("Client connected from %s\n", rip);
+	}
+
+	setRequestEnvironment(rip, config);
+
+	/* Requests pipelined behind the current one wait in 'in' */
+	char in[HTTP_MAX_HEAD];
+	size_t in_len = 0, used;
+	struct outbuf out;
 
-	FILE *stream = fdopen(fd, "r+");
-	if (stream == NULL)
+	outbuf_init(&out, fd, 1);
+
+	/* Idle persistent connections are dropped after the timeout */
+	if (config->keepalive_timeout > 0)
 	{
-		perror("fdopen");
-		close(fd);
-		exit(EXIT_FAILURE);
+		struct timeval tv;
+		tv.tv_sec = config->keepalive_timeout;
+		tv.tv_usec = 0;
+		(void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 	}
 
-	if ((res = handle_http_connection(stream, config, &req, &resp)) < 0)
+	for (int served = 0;; served++)
 	{
-		if (config->debug_mode)
+		enum HTTP_PARSE_RESULT pres =
+			parse_http_request(fd, in, &in_len, &used, &req);
+		long long parsed = metrics_clock(), ready, sent;
+
+		/* Client closed (or idled out) between requests */
+		if (pres == HTTP_PARSE_EOF && served > 0)
 		{
-			printf("Bad request\n");
+			break;
 		}
-	}
 
+		if (served + 1 >= config->keepalive_max)
+		{
+			req.keep_alive = 0;
+		}
 
-	logRequest(config, rip, &req, &resp);
+		if ((res = respond_http_request(&out, config, pres, &req, &resp)) < 0)
+		{
+			if (config->debug_mode)
+			{
+				printf("Bad request\n");
+			}
+		}
+		ready = metrics_clock();
+
+		if (outbuf_send(&out) != 1)
+		{
+			if (config->debug_mode)
+			{
+				printf("Failed to send response\n");
+			}
+			outbuf_reset(&out);
+			resp.keep_alive = 0;
+		}
+		sent = metrics_clock();
+
+		metrics_observe(METRICS_PARSE, req.received, parsed);
+		metrics_observe(METRICS_HANDLE, parsed, ready);
+		metrics_observe(METRICS_SEND, ready, sent);
+		metrics_observe(METRICS_TOTAL, req.received, sent);
+		metrics_response(&resp);
+		logRequest(config, rip, &req, &resp);
+
+		if (config->debug_mode && cache_enabled())
+		{
+			struct cache_stats cs;
+			cache_get_stats(&cs);
+			printf("Cache: %llu hits, %llu misses, %llu evictions, "
+			       "%zu/%zu bytes\n",
+			       cs.hits, cs.misses, cs.evictions, cs.bytes_used, cs.budget);
+		}
 
+		if (!resp.keep_alive)
+		{
+			break;
+		}
+		in_len -= used;
+		memmove(in, in + used, in_len);
+	}
 
-	fclose(stream);
+	metrics_connection_closed();
+	close(fd);
 	exit(EXIT_SUCCESS);
 }
 
@@ -251,6 +352,12 @@ handleSocket(int server_sock, struct server_config *config)
 		/* NOTREACHED */
 	}
 
+	/* Children start out with the current pack, see pack_refresh() */
+	if (config->pack != NULL)
+	{
+		pack_refresh();
+	}
+
 	if ((pid = fork()) < 0)
 	{
 		perror("fork");
@@ -270,19 +377,300 @@ handleSocket(int server_sock, struct server_config *config)
 	return;
 }
 
-/* Signal handler that reaps children */
+/* Signal handler that reaps children, FastCGI responders included */
 void
 reap(int sig)
 {
+	int saved = errno;
+	pid_t pid;
+
 	(void)sig;
-	while (waitpid(-1, NULL, WNOHANG) > 0)
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+	{
+		fcgi_reaped(pid);
+	}
+	errno = saved;
+}
+
+/*
+ * Accepts connections on server_sock forever, either from the event loop
+ * or by forking a child per connection.
+ */
+static void
+acceptLoop(int server_sock, struct server_config *config)
+{
+	/* Event-driven mode: one process multiplexes all connections */
+	if (config->event_mode)
+	{
+		runEventLoop(server_sock, config);
+		/* NOTREACHED */
+	}
+
+	for (;;)
+	{
+		fd_set ready;
+		struct timeval timeout;
+
+		/*
+		 * SIGCHLD interrupts select(), so dead responders restart soon;
+		 * those that died too quickly are retried a second later.
+		 */
+		int respawning = fcgi_respawn();
+
+		FD_ZERO(&ready);
+		FD_SET(server_sock, &ready);
+
+		timeout.tv_sec = respawning ? 1 : SLEEP;
+		timeout.tv_usec = 0;
+
+		if (select(server_sock + 1, &ready, 0, 0, &timeout) < 0)
+		{
+			if (errno != EINTR)
+			{
+				perror("select");
+			}
+			continue;
+		}
+
+		if (FD_ISSET(server_sock, &ready))
+		{
+			handleSocket(server_sock, config);
+		}
+		else
+		{
+			(void)printf("Idly sitting here, waiting for connections...\n");
+		}
+	}
+}
+
+/* Pins the calling worker to one CPU, round-robin over the online CPUs */
+static void
+pinWorker(int idx)
+{
+#ifdef __linux__
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t set;
+
+	if (ncpu < 1)
+	{
+		return;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(idx % ncpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) < 0)
+	{
+		perror("sched_setaffinity");
+	}
+#else
+	(void)idx;
+#endif
+}
+
+static volatile sig_atomic_t stopping = 0;
+
+static void
+stopWorkers(int sig)
+{
+	(void)sig;
+	stopping = 1;
+}
+
+/*
+ * Forks worker number idx. The worker keeps only its own listening socket
+ * and never returns. Returns the worker's pid in the parent, -1 on error.
+ */
+static pid_t
+spawnWorker(int idx, int *socks, int nsocks, struct server_config *config)
+{
+	pid_t pid;
+	int sock = socks[idx % nsocks];
+
+	if ((pid = fork()) != 0)
+	{
+		if (pid < 0)
+		{
+			perror("fork");
+		}
+		return pid;
+	}
+
+	for (int i = 0; i < nsocks; i++)
+	{
+		if (socks[i] != sock)
+		{
+			close(socks[i]);
+		}
+	}
+
+	(void)signal(SIGTERM, SIG_DFL);
+	(void)signal(SIGINT, SIG_DFL);
+	if (signal(SIGCHLD, reap) == SIG_ERR)
+	{
+		perror("Signal");
+		exit(EXIT_FAILURE);
+	}
+
+	if (config->pin_workers)
+	{
+		pinWorker(idx);
+	}
+
+	acceptLoop(sock, config);
+	exit(EXIT_SUCCESS);
+}
+
+/*
+ * Starts config->workers long-lived workers and respawns any that exit,
+ * as well as any FastCGI responders that die.
+ * The listening sockets stay open in the supervisor, so connections queued
+ * on a dying worker's listener are picked up by its replacement.
+ * Returns once SIGTERM or SIGINT has been received and all workers are gone.
+ */
+static void
+superviseWorkers(int *socks, int nsocks, struct server_config *config)
+{
+	int nworkers = config->workers;
+	pid_t *pids;
+	time_t *started;
+	struct sigaction sa;
+
+	if ((pids = calloc((size_t)nworkers, sizeof(*pids))) == NULL ||
+	    (started = calloc((size_t)nworkers, sizeof(*started))) == NULL)
+	{
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	 * The supervisor waits for its workers itself. No SA_RESTART, so a
+	 * termination signal interrupts waitpid().
+	 */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stopWorkers;
+	sigemptyset(&sa.sa_mask);
+	if (signal(SIGCHLD, SIG_DFL) == SIG_ERR ||
+	    sigaction(SIGTERM, &sa, NULL) < 0 || sigaction(SIGINT, &sa, NULL) < 0)
+	{
+		perror("Signal");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < nworkers; i++)
+	{
+		pids[i] = -1;
+	}
+
+	while (!stopping)
+	{
+		int status;
+		pid_t pid;
+
+		for (int i = 0; i < nworkers; i++)
+		{
+			if (pids[i] != -1)
+			{
+				continue;
+			}
+
+			/* Back off if the worker died right after it was started */
+			if (started[i] != 0 && time(NULL) - started[i] < 1)
+			{
+				sleep(1);
+			}
+			started[i] = time(NULL);
+			pids[i] = spawnWorker(i, socks, nsocks, config);
+		}
+
+		/* FastCGI responders are our children too */
+		if (fcgi_respawn() > 0)
+		{
+			sleep(1);
+			continue;
+		}
+
+		if ((pid = waitpid(-1, &status, 0)) < 0)
+		{
+			if (errno == ECHILD)
+			{
+				sleep(1);
+			}
+			continue;
+		}
+
+		for (int i = 0; i < nworkers; i++)
+		{
+			if (pids[i] == pid)
+			{
+				pids[i] = -1;
+			}
+		}
+		fcgi_reaped(pid);
+	}
+
+	for (int i = 0; i < nworkers; i++)
+	{
+		if (pids[i] > 0)
+		{
+			(void)kill(pids[i], SIGTERM);
+		}
+	}
+	fcgi_shutdown();
+
+	/* The log writer goes last, with the workers' final records */
+	for (int i = 0; i < nworkers; i++)
+	{
+		while (pids[i] > 0 && waitpid(pids[i], NULL, 0) < 0 && errno == EINTR)
+			;
+	}
+	alog_shutdown();
+	while (waitpid(-1, NULL, 0) > 0 || errno == EINTR)
 		;
+
+	free(pids);
+	free(started);
+}
+
+/* Stops the FastCGI responders and the log writer, then dies of sig */
+static void
+stopBackends(int sig)
+{
+	fcgi_shutdown();
+	alog_shutdown();
+	(void)signal(sig, SIG_DFL);
+	(void)raise(sig);
+}
+
+static void
+startBackends(struct server_config *config)
+{
+	if (fcgi_init(config) < 0)
+	{
+		perror("fcgi_init");
+		exit(EXIT_FAILURE);
+	}
+	if (config->logfp && !config->debug_mode &&
+	    alog_init(fileno(config->logfp), config->log_flush_ms) < 0)
+	{
+		perror("alog_init");
+		exit(EXIT_FAILURE);
+	}
+
+	/* The worker supervisor cleans up on its own */
+	if ((config->nfcgi_scripts > 0 || config->logfp) &&
+	    config->workers == 0)
+	{
+		(void)signal(SIGTERM, stopBackends);
+		(void)signal(SIGINT, stopBackends);
+	}
 }
 
 void
 runServer(struct server_config *config)
 {
 	int server_sock;
+	int *socks;
+	int nsocks = 1;
 
 	if (signal(SIGCHLD, reap) == SIG_ERR)
 	{
@@ -290,7 +678,94 @@ runServer(struct server_config *config)
 		exit(EXIT_FAILURE);
 	}
 
-	server_sock = createSocket(config);
+#ifdef SO_REUSEPORT
+	/* One listener per worker */
+	if (config->workers > 0)
+	{
+		nsocks = config->workers;
+	}
+#endif
+
+	if ((socks = calloc((size_t)nsocks, sizeof(*socks))) == NULL)
+	{
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < nsocks; i++)
+	{
+		socks[i] = createSocket(config);
+	}
+	server_sock = socks[0];
+
+	/* Shared between all workers and children, so set up before forking */
+	if (cache_init(config->cache_budget) < 0)
+	{
+		perror("cache_init");
+		exit(EXIT_FAILURE);
+	}
+	if (config->status_page && metrics_init() < 0)
+	{
+		perror("metrics_init");
+		exit(EXIT_FAILURE);
+	}
+	if (mime_init(config->mime_types) < 0)
+	{
+		perror(config->mime_types);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Responders start after daemon(), where errors would go unseen */
+	for (int i = 0; i < config->nfcgi_scripts; i++)
+	{
+		if (fcgi_check_script(config, config->fcgi_scripts[i]) < 0)
+		{
+			perror(config->fcgi_scripts[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* Mapped once, and shared with every process */
+	if (config->pack != NULL && pack_open(config->pack) < 0)
+	{
+		perror(config->pack);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Every process looks up files beneath this one descriptor */
+	if (config->docroot != NULL && resolve_root(config->docroot) < 0)
+	{
+		perror(config->docroot);
+		exit(EXIT_FAILURE);
+	}
+	fdcache_init(config->fd_cache_ms, config->fd_cache_notify);
+
+	/* Before forking, so that every process starts out with the users */
+	userdir_init(config->userdir_ttl);
+	if (config->userdir_preload)
+	{
+		printf("Users with pages: %d\n", userdir_preload());
+	}
+
+	/* Needs the MIME table to pick the files worth compressing */
+	if (config->precompress && config->docroot != NULL &&
+	    encoding_build_sidecars(config->docroot) < 0)
+	{
+		perror(config->docroot);
+		exit(EXIT_FAILURE);
+	}
+
+	/* After the sidecars, which are entered too */
+	if (config->prewarm_threads > 0 && config->docroot != NULL)
+	{
+		int n = manifest_build(config->docroot, config->prewarm_threads,
+		                       (off_t)config->readahead_max);
+		if (n < 0)
+		{
+			perror(config->docroot);
+			exit(EXIT_FAILURE);
+		}
+		printf("Manifest: %d files\n", n);
+	}
 
 	/* Logging */
 	if (config->logfile && !config->debug_mode)
@@ -310,6 +785,7 @@ runServer(struct server_config *config)
 	if (config->debug_mode)
 	{
 		printf("Server running in debug mode.\n");
+		startBackends(config);
 		handleSocket(server_sock, config);
 		printf("Debug mode exiting.\n");
 		return;
@@ -322,34 +798,16 @@ runServer(struct server_config *config)
 		exit(EXIT_FAILURE);
 	}
 
-	/* In normal mode */
-	for (;;)
-	{
-		fd_set ready;
-		struct timeval timeout;
-
-		FD_ZERO(&ready);
-		FD_SET(server_sock, &ready);
-
-		timeout.tv_sec = SLEEP;
-		timeout.tv_usec = 0;
-
-		if (select(server_sock + 1, &ready, 0, 0, &timeout) < 0)
-		{
-			if (errno != EINTR)
-			{
-				perror("select");
-			}
-			continue;
-		}
+	/* After daemon(), so responders and log writer are its children */
+	startBackends(config);
 
-		if (FD_ISSET(server_sock, &ready))
-		{
-			handleSocket(server_sock, config);
-		}
-		else
-		{
-			(void)printf("Idly sitting here, waiting for connections...\n");
-		}
+	/* Pre-forked workers */
+	if (config->workers > 0)
+	{
+		superviseWorkers(socks, nsocks, config);
+		exit(EXIT_SUCCESS);
 	}
+
+	/* In normal mode */
+	acceptLoop(server_sock, config);
 }
@@ -12,6 +12,62 @@ struct server_config
 	char *cgi_dir;
 	int debug_mode;
 
+	/* Scripts in cgi_dir run as persistent FastCGI responders (-f) */
+	char **fcgi_scripts;
+	int nfcgi_scripts;
+	int event_mode;
+
+	/* Drive the event loop through io_uring(7) where available (-u) */
+	int use_uring;
+
+	int workers;
+	int pin_workers;
+	int backlog;
+
+	/* Persistent connections: idle timeout (seconds), requests per conn */
+	int keepalive_timeout;
+	int keepalive_max;
+
+	/* mime.types(5)-style file extending the built-in MIME table */
+	char *mime_types;
+
+	/* Bytes of shared memory for the static file cache (0: disabled) */
+	size_t cache_budget;
+
+	/*
+	 * Milliseconds static files stay open per process after use (-F; 0:
+	 * disabled), and whether inotify(7) drops them sooner (-I)
+	 */
+	int fd_cache_ms;
+	int fd_cache_notify;
+
+	/*
+	 * Seconds ~user lookups are remembered per process (-U; 0: disabled),
+	 * and whether all users are looked up at startup (-P)
+	 */
+	int userdir_ttl;
+	int userdir_preload;
+
+	/*
+	 * Threads entering the docroot's files in a manifest at startup (-M;
+	 * 0: no manifest), and the size up to which files are read ahead
+	 * into the page cache meanwhile (-R; 0: none)
+	 */
+	int prewarm_threads;
+	size_t readahead_max;
+
+	/*
+	 * Site pack made by swspack to serve instead of the docroot, which is
+	 * then optional (-A)
+	 */
+	char *pack;
+
+	/* Build missing .gz sidecars of compressible files at startup (-z) */
+	int precompress;
+
+	/* Serve live metrics at /server-status (-s) */
+	int status_page;
+
 	struct sockaddr_storage bind_addr;
 	socklen_t bind_addrlen;
 	int have_bind_address;
@@ -19,11 +75,36 @@ struct server_config
 	char *logfile;
 	FILE *logfp;
 
+	/* Milliseconds between batched log writes */
+	int log_flush_ms;
+
 	int port;
 
 	char *docroot;
 };
 
+struct http_request;
+struct http_response;
+
 void runServer(struct server_config *cfg);
 
+/*
+ * Converts the client address to a printable string in buf.
+ * Returns buf, or "unknown" for unsupported address families.
+ */
+const char *clientAddress(const struct sockaddr_storage *client, char *buf,
+                          size_t len);
+
+/*
+ * Exports the per-connection CGI variables (REMOTE_ADDR, SERVER_PORT,
+ * SERVER_NAME) into the environment of the current process.
+ */
+void setRequestEnvironment(const char *rip, struct server_config *config);
+
+/*
+ * Writes one access log line for the request.
+ */
+void logRequest(struct server_config *config, const char *clientIP,
+                struct http_request *req, struct http_response *resp);
+
 #endif
@@ -0,0 +1,639 @@
+/*
+ * Packs a document root into a site pack for sws -A (see pack.h).
+ *
+ * Every regular file becomes an entry under its request path, with a
+ * content-derived entity tag, its type and its response headers; with -z
+ * compressible files also get a gzip-coded variant where that is smaller.
+ * A directory is entered as its index.html, or else as the listing sws
+ * would generate for it. Symbolic links to files beneath the docroot are
+ * followed; those to directories, or leading out of the docroot, are not.
+ *
+ * The pack is written next to its final name and renamed into place, so
+ * a running sws switches over to it as a whole.
+ *
+ * usage: swspack [-z] [-T file] docroot pack
+ *   -z       add gzip-coded variants of compressible files
+ *   -T file  read extra MIME types from the given mime.types file
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "autoindex.h"
+#include "encoding.h"
+#include "http.h"
+#include "io.h"
+#include "mime.h"
+#include "pack.h"
+#include "resolve.h"
+#include "timefmt.h"
+
+/* Directories nftw(3) keeps open while walking the tree */
+#define SWSPACK_WALK_FDS 16
+
+struct directory
+{
+	char *key; /* request path: "/" or "/dir" */
+	char *path;
+	time_t mtime;
+};
+
+static struct pack_entry *entries = NULL;
+static size_t nentries = 0;
+static size_t entries_cap = 0;
+
+static struct directory *dirs = NULL;
+static size_t ndirs = 0;
+static size_t dirs_cap = 0;
+
+static const char *root;
+static size_t root_len;
+static int root_fd;
+static int compress_variants = 0;
+
+/* The pack being written, and where its next byte goes */
+static int out_fd;
+static uint64_t cursor;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: swspack [-z] [-T file] docroot pack\n");
+	fprintf(stderr, "  -z       Add gzip-coded variants of compressible "
+	                "files.\n");
+	fprintf(stderr, "  -T file  Read extra MIME types from the given "
+	                "mime.types file.\n");
+}
+
+static void
+fail(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void *
+grow(void *array, size_t *cap, size_t size)
+{
+	size_t n = *cap ? *cap * 2 : 256;
+
+	if ((array = realloc(array, n * size)) == NULL)
+	{
+		fail("realloc");
+	}
+	*cap = n;
+	return array;
+}
+
+/* Appends 'len' bytes (and a NUL if 'nul') to the pack */
+static struct pack_span
+put(const void *buf, size_t len, int nul)
+{
+	struct pack_span span = {cursor, len};
+
+	if (write_all(out_fd, buf, len) < 0 ||
+	    (nul && write_all(out_fd, "", 1) < 0))
+	{
+		fail("write");
+	}
+	cursor += len + (nul ? 1 : 0);
+	return span;
+}
+
+static struct pack_span
+put_string(const char *s)
+{
+	return put(s, strlen(s), 1);
+}
+
+/*
+ * Compresses 'len' bytes of buf in gzip format into a malloc'd buffer.
+ * Returns its length, or 0 if it wouldn't be smaller.
+ */
+static size_t
+gzip_buffer(const char *buf, size_t len, char **gz)
+{
+	size_t cap = len;
+	z_stream zs;
+	int rc;
+
+	if (len > UINT_MAX)
+	{
+		return 0;
+	}
+	memset(&zs, 0, sizeof(zs));
+	/* 15 bits of window, +16 for the gzip wrapper */
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+	                 Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		return 0;
+	}
+	if ((*gz = malloc(cap)) == NULL)
+	{
+		fail("malloc");
+	}
+	zs.next_in = (Bytef *)buf;
+	zs.avail_in = (uInt)len;
+	zs.next_out = (Bytef *)*gz;
+	zs.avail_out = (uInt)cap;
+	rc = deflate(&zs, Z_FINISH);
+	(void)deflateEnd(&zs);
+
+	/* Out of room means it didn't pay off */
+	if (rc != Z_STREAM_END || zs.avail_out == 0)
+	{
+		free(*gz);
+		return 0;
+	}
+	return cap - zs.avail_out;
+}
+
+/* ----- SHA-256 (FIPS 180-4), for the entity tags ----- */
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+sha256_block(uint32_t h[8], const unsigned char *p)
+{
+	uint32_t w[64], v[8];
+
+	for (int i = 0; i < 16; i++)
+	{
+		w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+		       (uint32_t)p[4 * i + 2] << 8 | (uint32_t)p[4 * i + 3];
+	}
+	for (int i = 16; i < 64; i++)
+	{
+		uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^
+		              (w[i - 15] >> 3);
+		uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^
+		              (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	memcpy(v, h, sizeof(v));
+	for (int i = 0; i < 64; i++)
+	{
+		uint32_t s1 = ROR32(v[4], 6) ^ ROR32(v[4], 11) ^ ROR32(v[4], 25);
+		uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+		uint32_t t1 = v[7] + s1 + ch + sha256_k[i] + w[i];
+		uint32_t s0 = ROR32(v[0], 2) ^ ROR32(v[0], 13) ^ ROR32(v[0], 22);
+		uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+
+		memmove(v + 1, v, 7 * sizeof(v[0]));
+		v[4] += t1;
+		v[0] = t1 + s0 + maj;
+	}
+	for (int i = 0; i < 8; i++)
+	{
+		h[i] += v[i];
+	}
+}
+
+/* Digests 'len' bytes of data into out */
+static void
+sha256(const void *data, size_t len, unsigned char out[32])
+{
+	uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	                 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+	const unsigned char *p = data;
+	unsigned char tail[128];
+	uint64_t bits = (uint64_t)len * 8;
+	size_t rest, tail_len;
+
+	for (rest = len; rest >= 64; rest -= 64, p += 64)
+	{
+		sha256_block(h, p);
+	}
+
+	/* The remainder, 0x80, zeros and the length in bits */
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, p, rest);
+	tail[rest] = 0x80;
+	tail_len = rest < 56 ? 64 : 128;
+	for (int i = 0; i < 8; i++)
+	{
+		tail[tail_len - 1 - i] = (unsigned char)(bits >> (8 * i));
+	}
+	for (size_t off = 0; off < tail_len; off += 64)
+	{
+		sha256_block(h, tail + off);
+	}
+
+	for (int i = 0; i < 8; i++)
+	{
+		out[4 * i] = (unsigned char)(h[i] >> 24);
+		out[4 * i + 1] = (unsigned char)(h[i] >> 16);
+		out[4 * i + 2] = (unsigned char)(h[i] >> 8);
+		out[4 * i + 3] = (unsigned char)h[i];
+	}
+}
+
+/* Enters 'len' bytes of body under 'key', served as 'ctype' */
+static void
+add_entry(const char *key, const char *ctype, const char *body, size_t len,
+          time_t mtime)
+{
+	struct pack_entry e;
+	char etag[HTTP_ETAG_LEN];
+	char lastmod[HTTP_DATE_LEN + 1];
+	char extra[HTTP_EXTRA_LEN];
+	char headers[1024];
+	size_t headers_len;
+	unsigned char digest[32];
+	char tag[33];
+	char *gz;
+	size_t gz_len = 0;
+
+	memset(&e, 0, sizeof(e));
+	e.body = put(body, len, 0);
+
+	/*
+	 * From the content, so that repacking unchanged files keeps the tags.
+	 * The tags are strong (If-Range splices ranges of a version it
+	 * matches), so they take 128 bits of SHA-256 rather than a checksum.
+	 */
+	sha256(body, len, digest);
+	for (int i = 0; i < 16; i++)
+	{
+		snprintf(tag + 2 * i, 3, "%02x", digest[i]);
+	}
+	snprintf(etag, sizeof(etag), "\"%s-%llx\"", tag, (unsigned long long)len);
+	timefmt_http(mtime, lastmod);
+	http_entity_extra(etag, ctype, NULL, extra);
+	headers_len = format_entity_headers(headers, sizeof(headers), (off_t)len,
+	                                    ctype, lastmod, extra);
+	e.headers = put(headers, headers_len, 0);
+
+	e.path = put_string(key);
+	e.hash = pack_hash(key);
+	e.mtime = (int64_t)mtime;
+	e.content_type = put_string(ctype);
+	e.etag = put_string(etag);
+	e.last_modified = put_string(lastmod);
+	e.extra = put_string(extra);
+
+	if (compress_variants && len >= ENC_MIN_SIZE && mime_compressible(ctype) &&
+	    (gz_len = gzip_buffer(body, len, &gz)) > 0)
+	{
+		e.gz_body = put(gz, gz_len, 0);
+		free(gz);
+
+		snprintf(etag, sizeof(etag), "\"%s-%llx-gz\"", tag,
+		         (unsigned long long)len);
+		http_entity_extra(etag, ctype, "gzip", extra);
+		headers_len = format_entity_headers(headers, sizeof(headers),
+		                                    (off_t)gz_len, ctype, lastmod,
+		                                    extra);
+		e.gz_headers = put(headers, headers_len, 0);
+		e.gz_etag = put_string(etag);
+	}
+
+	if (nentries == entries_cap)
+	{
+		entries = grow(entries, &entries_cap, sizeof(*entries));
+	}
+	entries[nentries++] = e;
+}
+
+/* Enters the regular file at 'path' (described by 'st') */
+static void
+add_file(const char *path, const struct stat *st)
+{
+	char key[PATH_MAX];
+	char *ctype;
+	void *body = NULL;
+	int fd;
+
+	if (snprintf(key, sizeof(key), "/%s", path + root_len) >= (int)sizeof(key))
+	{
+		fprintf(stderr, "%s: name too long, skipped\n", path);
+		return;
+	}
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+	{
+		fail(path);
+	}
+	if (st->st_size > 0)
+	{
+		body = mmap(NULL, (size_t)st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (body == MAP_FAILED)
+		{
+			fail(path);
+		}
+	}
+	close(fd);
+
+	if ((ctype = strdup(mime_type(path, st))) == NULL)
+	{
+		fail("strdup");
+	}
+	add_entry(key, ctype, body, (size_t)st->st_size, st->st_mtime);
+	free(ctype);
+	if (body != NULL)
+	{
+		munmap(body, (size_t)st->st_size);
+	}
+}
+
+/*
+ * Returns non-zero if sws itself would follow the symbolic link 'path':
+ * it has to resolve to somewhere beneath the root, and, where the kernel
+ * confines lookups (see resolve.h), without an absolute path.
+ */
+static int
+link_beneath_root(const char *path)
+{
+	char *real;
+	int beneath, fd;
+
+	if ((real = realpath(path, NULL)) == NULL)
+	{
+		return 0;
+	}
+	/* root_len counts the slash after the root, unless the root is "/" */
+	beneath = root_len == 1 ||
+	          (strncmp(real, root, root_len - 1) == 0 &&
+	           real[root_len - 1] == '/');
+	free(real);
+
+	if (!beneath ||
+	    (fd = resolve_open(root_fd, path + root_len, O_RDONLY | O_CLOEXEC)) < 0)
+	{
+		return 0;
+	}
+	close(fd);
+	return 1;
+}
+
+static int
+visit(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	struct stat target;
+
+	if (type == FTW_F && S_ISREG(st->st_mode))
+	{
+		add_file(path, st);
+	}
+	else if (type == FTW_SL && stat(path, &target) == 0 &&
+	         S_ISREG(target.st_mode))
+	{
+		if (link_beneath_root(path))
+		{
+			add_file(path, &target);
+		}
+		else
+		{
+			fprintf(stderr, "%s: link sws wouldn't follow, skipped\n", path);
+		}
+	}
+	else if (type == FTW_D)
+	{
+		struct directory d;
+		char key[PATH_MAX];
+
+		/* The root is "/", like the path of a file is "/" + its name */
+		if (snprintf(key, sizeof(key), "/%s",
+		             ftw->level > 0 ? path + root_len : "") >=
+		    (int)sizeof(key))
+		{
+			fprintf(stderr, "%s: name too long, skipped\n", path);
+			return 0;
+		}
+		if ((d.key = strdup(key)) == NULL || (d.path = strdup(path)) == NULL)
+		{
+			fail("strdup");
+		}
+		d.mtime = st->st_mtime;
+		if (ndirs == dirs_cap)
+		{
+			dirs = grow(dirs, &dirs_cap, sizeof(*dirs));
+		}
+		dirs[ndirs++] = d;
+	}
+	else if (type == FTW_DNR || type == FTW_NS)
+	{
+		fprintf(stderr, "%s: can't be read, skipped\n", path);
+	}
+	return 0;
+}
+
+/* Returns the entry made for 'key' so far, or NULL */
+static const struct pack_entry *
+find_entry(const char *key)
+{
+	uint32_t hash = pack_hash(key);
+	size_t len = strlen(key);
+
+	for (size_t i = 0; i < nentries; i++)
+	{
+		char buf[PATH_MAX];
+
+		if (entries[i].hash != hash || entries[i].path.len != len ||
+		    pread(out_fd, buf, len, (off_t)entries[i].path.off) !=
+		        (ssize_t)len)
+		{
+			continue;
+		}
+		if (memcmp(buf, key, len) == 0)
+		{
+			return &entries[i];
+		}
+	}
+	return NULL;
+}
+
+/* Enters a directory as its index.html, or else as its listing */
+static void
+add_directory(const struct directory *d)
+{
+	char index[PATH_MAX];
+	const struct pack_entry *found;
+	char *body;
+	size_t len;
+	int fd;
+
+	if (snprintf(index, sizeof(index), "%s%sindex.html", d->key,
+	             strcmp(d->key, "/") == 0 ? "" : "/") >= (int)sizeof(index))
+	{
+		return;
+	}
+	if ((found = find_entry(index)) != NULL)
+	{
+		struct pack_entry e = *found;
+
+		e.path = put_string(d->key);
+		e.hash = pack_hash(d->key);
+		if (nentries == entries_cap)
+		{
+			entries = grow(entries, &entries_cap, sizeof(*entries));
+		}
+		entries[nentries++] = e;
+		return;
+	}
+
+	if ((fd = open(d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 ||
+	    autoindex_render(fd, d->key, &body, &len) < 0)
+	{
+		fprintf(stderr, "%s: can't be listed, skipped\n", d->path);
+		return;
+	}
+	add_entry(d->key, "text/html", body, len, d->mtime);
+	free(body);
+}
+
+/* Writes the entries and their hash index; returns the header to put */
+static struct pack_header
+put_index(void)
+{
+	struct pack_header h;
+	uint32_t *slots;
+	uint32_t nslots = 16;
+	static const char pad[8];
+
+	while (nslots < nentries * 2)
+	{
+		nslots *= 2;
+	}
+	if ((slots = calloc(nslots, sizeof(*slots))) == NULL)
+	{
+		fail("calloc");
+	}
+	for (size_t i = 0; i < nentries; i++)
+	{
+		uint32_t j = entries[i].hash & (nslots - 1);
+
+		while (slots[j] != 0)
+		{
+			j = (j + 1) & (nslots - 1);
+		}
+		slots[j] = (uint32_t)(i + 1);
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, PACK_MAGIC, sizeof(PACK_MAGIC));
+	h.version = PACK_VERSION;
+	h.nentries = (uint32_t)nentries;
+	h.nslots = nslots;
+
+	(void)put(pad, (8 - cursor % 8) % 8, 0);
+	h.entries_off = put(entries, nentries * sizeof(*entries), 0).off;
+	h.slots_off = put(slots, nslots * sizeof(*slots), 0).off;
+	h.size = cursor;
+	free(slots);
+	return h;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct pack_header h;
+	char tmp[PATH_MAX];
+	const char *mime_types = NULL;
+	const char *out;
+	char *real;
+	int option;
+
+	while ((option = getopt(argc, argv, "T:zh")) != -1)
+	{
+		switch (option)
+		{
+		case 'T':
+			mime_types = optarg;
+			break;
+		case 'z':
+			compress_variants = 1;
+			break;
+		case 'h':
+			usage();
+			exit(0);
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	if (argc - optind != 2)
+	{
+		usage();
+		exit(1);
+	}
+	out = argv[optind + 1];
+
+	/* Request paths are made from what follows the root and its slash */
+	if ((real = realpath(argv[optind], NULL)) == NULL)
+	{
+		fail(argv[optind]);
+	}
+	root = real;
+	root_len = strcmp(root, "/") == 0 ? 1 : strlen(root) + 1;
+	if ((root_fd = resolve_root(root)) < 0)
+	{
+		fail(root);
+	}
+
+	if (mime_init(mime_types) < 0)
+	{
+		fail(mime_types);
+	}
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", out) >= (int)sizeof(tmp))
+	{
+		errno = ENAMETOOLONG;
+		fail(out);
+	}
+	if ((out_fd = mkstemp(tmp)) < 0)
+	{
+		fail(tmp);
+	}
+	memset(&h, 0, sizeof(h));
+	(void)put(&h, sizeof(h), 0);
+
+	if (nftw(root, visit, SWSPACK_WALK_FDS, FTW_PHYS) < 0)
+	{
+		(void)unlink(tmp);
+		fail(root);
+	}
+	for (size_t i = 0; i < ndirs; i++)
+	{
+		add_directory(&dirs[i]);
+	}
+
+	h = put_index();
+	if (pwrite(out_fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+	    fchmod(out_fd, 0644) < 0 || fsync(out_fd) < 0 || close(out_fd) < 0 ||
+	    rename(tmp, out) < 0)
+	{
+		int saved = errno;
+		(void)unlink(tmp);
+		errno = saved;
+		fail(out);
+	}
+	printf("%s: %zu entries, %llu bytes\n", out, nentries,
+	       (unsigned long long)h.size);
+	return 0;
+}
@@ -0,0 +1,256 @@
+#include "timefmt.h"
+
+#include <string.h>
+
+/* Latest time with a four digit year: 9999-12-31T23:59:59Z */
+#define TIMEFMT_MAX ((time_t)253402300799LL)
+
+static const char wkdays[7][4] = {"Sun", "Mon", "Tue", "Wed",
+                                  "Thu", "Fri", "Sat"};
+
+static const char months[12][4] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                   "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+/* The current second and its renderings */
+static time_t now_sec = (time_t)-1;
+static char now_http[HTTP_DATE_LEN + 1];
+static char now_iso[ISO_DATE_LEN + 1];
+
+struct civil
+{
+	int year, month, day; /* month 1-12 */
+	int hour, min, sec;
+	int wday; /* 0 = Sunday */
+};
+
+/*
+ * Days since 1970-01-01 of a proleptic Gregorian date, and back (after
+ * Howard Hinnant's chrono algorithms).
+ */
+static long long
+days_from_civil(long long y, int m, int d)
+{
+	long long era, yoe, doy, doe;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+static void
+civil_from_time(time_t t, struct civil *c)
+{
+	long long days, secs, z, era, doe, yoe, doy, mp;
+
+	if (t < 0)
+	{
+		t = 0;
+	}
+	else if (t > TIMEFMT_MAX)
+	{
+		t = TIMEFMT_MAX;
+	}
+
+	days = (long long)t / 86400;
+	secs = (long long)t % 86400;
+	c->hour = (int)(secs / 3600);
+	c->min = (int)(secs / 60 % 60);
+	c->sec = (int)(secs % 60);
+	c->wday = (int)((days + 4) % 7); /* 1970-01-01 was a Thursday */
+
+	z = days + 719468;
+	era = z / 146097;
+	doe = z - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	c->day = (int)(doy - (153 * mp + 2) / 5 + 1);
+	c->month = (int)(mp < 10 ? mp + 3 : mp - 9);
+	c->year = (int)(yoe + era * 400 + (c->month <= 2));
+}
+
+static void
+put2(char *p, int v)
+{
+	p[0] = (char)('0' + v / 10);
+	p[1] = (char)('0' + v % 10);
+}
+
+static void
+put4(char *p, int v)
+{
+	put2(p, v / 100);
+	put2(p + 2, v % 100);
+}
+
+static void
+render_http(const struct civil *c, char *buf)
+{
+	memcpy(buf, wkdays[c->wday], 3);
+	memcpy(buf + 3, ", ", 2);
+	put2(buf + 5, c->day);
+	buf[7] = ' ';
+	memcpy(buf + 8, months[c->month - 1], 3);
+	buf[11] = ' ';
+	put4(buf + 12, c->year);
+	buf[16] = ' ';
+	put2(buf + 17, c->hour);
+	buf[19] = ':';
+	put2(buf + 20, c->min);
+	buf[22] = ':';
+	put2(buf + 23, c->sec);
+	memcpy(buf + 25, " GMT", 5);
+}
+
+static void
+render_iso(const struct civil *c, char *buf)
+{
+	put4(buf, c->year);
+	buf[4] = '-';
+	put2(buf + 5, c->month);
+	buf[7] = '-';
+	put2(buf + 8, c->day);
+	buf[10] = 'T';
+	put2(buf + 11, c->hour);
+	buf[13] = ':';
+	put2(buf + 14, c->min);
+	buf[16] = ':';
+	put2(buf + 17, c->sec);
+	memcpy(buf + 19, "Z", 2);
+}
+
+time_t
+timefmt_now(void)
+{
+	time_t t;
+#ifdef CLOCK_REALTIME_COARSE
+	struct timespec ts;
+
+	/* Served from the vDSO without touching the hardware clock */
+	t = clock_gettime(CLOCK_REALTIME_COARSE, &ts) == 0 ? ts.tv_sec
+	                                                   : time(NULL);
+#else
+	t = time(NULL);
+#endif
+
+	if (t != now_sec)
+	{
+		struct civil c;
+
+		civil_from_time(t, &c);
+		render_http(&c, now_http);
+		render_iso(&c, now_iso);
+		now_sec = t;
+	}
+	return t;
+}
+
+const char *
+timefmt_http_now(void)
+{
+	(void)timefmt_now();
+	return now_http;
+}
+
+const char *
+timefmt_iso_now(void)
+{
+	(void)timefmt_now();
+	return now_iso;
+}
+
+size_t
+timefmt_http(time_t t, char *buf)
+{
+	struct civil c;
+
+	if (t == now_sec)
+	{
+		memcpy(buf, now_http, sizeof(now_http));
+		return HTTP_DATE_LEN;
+	}
+	civil_from_time(t, &c);
+	render_http(&c, buf);
+	return HTTP_DATE_LEN;
+}
+
+size_t
+timefmt_iso(time_t t, char *buf)
+{
+	struct civil c;
+
+	if (t == now_sec)
+	{
+		memcpy(buf, now_iso, sizeof(now_iso));
+		return ISO_DATE_LEN;
+	}
+	civil_from_time(t, &c);
+	render_iso(&c, buf);
+	return ISO_DATE_LEN;
+}
+
+/* Returns the value of n decimal digits at s, or -1 */
+static int
+digits(const char *s, int n)
+{
+	int v = 0;
+
+	for (int i = 0; i < n; i++)
+	{
+		if (s[i] < '0' || s[i] > '9')
+		{
+			return -1;
+		}
+		v = v * 10 + (s[i] - '0');
+	}
+	return v;
+}
+
+static int
+find_name(const char (*names)[4], int count, const char *s)
+{
+	for (int i = 0; i < count; i++)
+	{
+		if (memcmp(names[i], s, 3) == 0)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+time_t
+timefmt_parse_http(const char *s)
+{
+	static const int mdays[12] = {31, 29, 31, 30, 31, 30,
+	                              31, 31, 30, 31, 30, 31};
+	int day, month, year, hour, min, sec;
+
+	/* "Sun, 06 Nov 1994 08:49:37 GMT"; the weekday is not checked */
+	if (s == NULL || strlen(s) < HTTP_DATE_LEN ||
+	    find_name(wkdays, 7, s) < 0 || memcmp(s + 3, ", ", 2) != 0 ||
+	    s[7] != ' ' || s[11] != ' ' || s[16] != ' ' || s[19] != ':' ||
+	    s[22] != ':' || memcmp(s + 25, " GMT", 4) != 0)
+	{
+		return (time_t)-1;
+	}
+
+	day = digits(s + 5, 2);
+	month = find_name(months, 12, s + 8);
+	year = digits(s + 12, 4);
+	hour = digits(s + 17, 2);
+	min = digits(s + 20, 2);
+	sec = digits(s + 23, 2);
+
+	if (day < 1 || month < 0 || day > mdays[month] || year < 0 ||
+	    hour < 0 || hour > 23 || min < 0 || min > 59 || sec < 0 || sec > 60)
+	{
+		return (time_t)-1;
+	}
+
+	return (time_t)(days_from_civil(year, month + 1, day) * 86400 +
+	                hour * 3600 + min * 60 + sec);
+}
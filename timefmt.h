@@ -0,0 +1,51 @@
+#pragma once
+
+#include <time.h>
+
+/* Length of an IMF-fixdate, "Sun, 06 Nov 1994 08:49:37 GMT" */
+#define HTTP_DATE_LEN 29
+
+/* Length of an ISO 8601 UTC timestamp, "1994-11-06T08:49:37Z" */
+#define ISO_DATE_LEN 20
+
+/*
+ * A coarse clock and the current time pre-rendered in the formats
+ * responses and logs use. The strings are per process and rendered again
+ * only when the second changes; nothing here depends on the locale or the
+ * time zone.
+ */
+
+/*
+ * Returns the current time in seconds.
+ */
+time_t timefmt_now(void);
+
+/*
+ * Returns the current time as an IMF-fixdate, for the Date header.
+ * The string stays valid until the next call into this module.
+ */
+const char *timefmt_http_now(void);
+
+/*
+ * Returns the current time as an ISO 8601 UTC timestamp, for logging.
+ * The string stays valid until the next call into this module.
+ */
+const char *timefmt_iso_now(void);
+
+/*
+ * Writes 't' as an IMF-fixdate and a terminating NUL to buf, which must
+ * hold HTTP_DATE_LEN + 1 bytes. Returns HTTP_DATE_LEN.
+ */
+size_t timefmt_http(time_t t, char *buf);
+
+/*
+ * Writes 't' as an ISO 8601 UTC timestamp and a terminating NUL to buf,
+ * which must hold ISO_DATE_LEN + 1 bytes. Returns ISO_DATE_LEN.
+ */
+size_t timefmt_iso(time_t t, char *buf);
+
+/*
+ * Parses an IMF-fixdate (as sent in If-Modified-Since and the like).
+ * Returns the time it denotes, or -1 if s is not a valid IMF-fixdate.
+ */
+time_t timefmt_parse_http(const char *s);
@@ -0,0 +1,448 @@
+#include "uring.h"
+
+#ifdef __linux__
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* The buffer group receives pick their buffers from */
+#define URING_BGID 0
+
+struct ring
+{
+	int fd;
+
+	/* Submission queue; entry i of the array always names SQE i */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned sqe_tail;    /* next slot we fill */
+	unsigned sqe_flushed; /* slots handed to the kernel */
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* Provided buffers */
+	struct io_uring_buf_ring *br;
+	unsigned nbufs;
+	size_t bufsize;
+	char *bufmem;
+	unsigned short br_tail;
+};
+
+static struct ring ring = {.fd = -1};
+
+/* Operations the event loop needs */
+static const unsigned char needed_ops[] = {
+	IORING_OP_ACCEPT, IORING_OP_RECV,   IORING_OP_READ,
+	IORING_OP_SENDMSG, IORING_OP_SPLICE, IORING_OP_TIMEOUT,
+};
+
+static int
+sys_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_enter(unsigned submit, unsigned wait, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, ring.fd, submit, wait, flags,
+	                    NULL, 0);
+}
+
+static int
+sys_register(unsigned op, void *arg, unsigned n)
+{
+	return (int)syscall(__NR_io_uring_register, ring.fd, op, arg, n);
+}
+
+/* Creates the ring with the cheapest task running the kernel accepts */
+static int
+setup_ring(unsigned entries, struct io_uring_params *p)
+{
+	static const unsigned flag_sets[] = {
+		IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER |
+			IORING_SETUP_DEFER_TASKRUN,
+		IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN,
+		0,
+	};
+
+	for (size_t i = 0; i < sizeof(flag_sets) / sizeof(flag_sets[0]); i++)
+	{
+		int fd;
+
+		memset(p, 0, sizeof(*p));
+		p->flags = flag_sets[i] | IORING_SETUP_CQSIZE;
+		p->cq_entries = entries * 8;
+		if ((fd = sys_setup(entries, p)) >= 0 || errno != EINVAL)
+		{
+			return fd;
+		}
+	}
+	return -1;
+}
+
+static int
+map_rings(const struct io_uring_params *p)
+{
+	size_t sq_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	size_t cq_len =
+		p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+	char *sq, *cq;
+	unsigned *array;
+
+	/* With IORING_FEAT_SINGLE_MMAP both rings share one mapping */
+	if (cq_len > sq_len)
+	{
+		sq_len = cq_len;
+	}
+	sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+	          MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+	{
+		return -1;
+	}
+	cq = sq;
+
+	ring.sqes = mmap(NULL, p->sq_entries * sizeof(struct io_uring_sqe),
+	                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                 ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+	{
+		return -1;
+	}
+
+	ring.sq_head = (unsigned *)(sq + p->sq_off.head);
+	ring.sq_tail = (unsigned *)(sq + p->sq_off.tail);
+	ring.sq_mask = *(unsigned *)(sq + p->sq_off.ring_mask);
+	ring.sq_entries = p->sq_entries;
+	array = (unsigned *)(sq + p->sq_off.array);
+	for (unsigned i = 0; i < p->sq_entries; i++)
+	{
+		array[i] = i;
+	}
+	ring.sqe_tail = ring.sqe_flushed = *ring.sq_tail;
+
+	ring.cq_head = (unsigned *)(cq + p->cq_off.head);
+	ring.cq_tail = (unsigned *)(cq + p->cq_off.tail);
+	ring.cq_mask = *(unsigned *)(cq + p->cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+	return 0;
+}
+
+static int
+probe_ops(void)
+{
+	size_t len = sizeof(struct io_uring_probe) +
+	             256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, len);
+	int ok = 0;
+
+	if (probe == NULL)
+	{
+		return -1;
+	}
+	if (sys_register(IORING_REGISTER_PROBE, probe, 256) == 0)
+	{
+		ok = 1;
+		for (size_t i = 0; i < sizeof(needed_ops); i++)
+		{
+			unsigned op = needed_ops[i];
+
+			if (op > probe->last_op ||
+			    !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+			{
+				ok = 0;
+			}
+		}
+	}
+	free(probe);
+	if (!ok)
+	{
+		errno = ENOTSUP;
+		return -1;
+	}
+	return 0;
+}
+
+/* Registers the buffer ring (Linux 5.19, as is multishot accept) */
+static int
+setup_buffers(unsigned nbufs, size_t bufsize)
+{
+	struct io_uring_buf_reg reg;
+	void *br;
+
+	br = mmap(NULL, nbufs * sizeof(struct io_uring_buf),
+	          PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (br == MAP_FAILED)
+	{
+		return -1;
+	}
+	ring.br = br;
+	if ((ring.bufmem = malloc(nbufs * bufsize)) == NULL)
+	{
+		return -1;
+	}
+	ring.nbufs = nbufs;
+	ring.bufsize = bufsize;
+	ring.br_tail = 0;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)br;
+	reg.ring_entries = nbufs;
+	reg.bgid = URING_BGID;
+	if (sys_register(IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+	{
+		return -1;
+	}
+	for (unsigned i = 0; i < nbufs; i++)
+	{
+		uring_recycle(i);
+	}
+	return 0;
+}
+
+int
+uring_init(unsigned entries, unsigned nbufs, size_t bufsize)
+{
+	struct io_uring_params p;
+
+	if ((ring.fd = setup_ring(entries, &p)) < 0)
+	{
+		return -1;
+	}
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_NODROP))
+	{
+		errno = ENOTSUP;
+		goto fail;
+	}
+	if (map_rings(&p) < 0 || probe_ops() < 0 ||
+	    setup_buffers(nbufs, bufsize) < 0)
+	{
+		goto fail;
+	}
+	return 0;
+
+fail:
+	{
+		int saved = errno;
+		uring_close();
+		errno = saved;
+	}
+	return -1;
+}
+
+void
+uring_close(void)
+{
+	if (ring.fd >= 0)
+	{
+		close(ring.fd);
+		ring.fd = -1;
+	}
+}
+
+int
+uring_submit(unsigned wait)
+{
+	unsigned pending = ring.sqe_tail - ring.sqe_flushed;
+	int n;
+
+	__atomic_store_n(ring.sq_tail, ring.sqe_tail, __ATOMIC_RELEASE);
+	if (pending == 0 && wait == 0)
+	{
+		return 0;
+	}
+	n = sys_enter(pending, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+	if (n < 0)
+	{
+		return -1;
+	}
+	ring.sqe_flushed += (unsigned)n;
+	return 0;
+}
+
+int
+uring_reserve(unsigned n)
+{
+	unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+
+	if (ring.sq_entries - (ring.sqe_tail - head) >= n)
+	{
+		return 0;
+	}
+	return uring_submit(0);
+}
+
+static struct io_uring_sqe *
+get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+
+	if (uring_reserve(1) < 0)
+	{
+		return NULL;
+	}
+	if (ring.sqe_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >=
+	    ring.sq_entries)
+	{
+		return NULL;
+	}
+	sqe = &ring.sqes[ring.sqe_tail & ring.sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sqe_tail++;
+	return sqe;
+}
+
+struct io_uring_cqe *
+uring_peek(void)
+{
+	unsigned head = *ring.cq_head;
+
+	if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+	{
+		return NULL;
+	}
+	return &ring.cqes[head & ring.cq_mask];
+}
+
+void
+uring_seen(void)
+{
+	__atomic_store_n(ring.cq_head, *ring.cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void *
+uring_buffer(unsigned bid)
+{
+	return ring.bufmem + (size_t)bid * ring.bufsize;
+}
+
+void
+uring_recycle(unsigned bid)
+{
+	struct io_uring_buf *buf = &ring.br->bufs[ring.br_tail & (ring.nbufs - 1)];
+
+	buf->addr = (uint64_t)(uintptr_t)uring_buffer(bid);
+	buf->len = (uint32_t)ring.bufsize;
+	buf->bid = (uint16_t)bid;
+	ring.br_tail++;
+	__atomic_store_n(&ring.br->tail, ring.br_tail, __ATOMIC_RELEASE);
+}
+
+struct io_uring_sqe *
+uring_accept_multishot(int fd, uint64_t ud)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+
+	if (sqe)
+	{
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = fd;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_CLOEXEC;
+		sqe->user_data = ud;
+	}
+	return sqe;
+}
+
+struct io_uring_sqe *
+uring_recv(int fd, unsigned len, uint64_t ud)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+
+	if (sqe)
+	{
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = fd;
+		sqe->len = len < ring.bufsize ? len : (unsigned)ring.bufsize;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BGID;
+		sqe->user_data = ud;
+	}
+	return sqe;
+}
+
+struct io_uring_sqe *
+uring_read(int fd, void *buf, unsigned len, off_t off, uint64_t ud)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+
+	if (sqe)
+	{
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t)(uintptr_t)buf;
+		sqe->len = len;
+		sqe->off = (uint64_t)off;
+		sqe->user_data = ud;
+	}
+	return sqe;
+}
+
+struct io_uring_sqe *
+uring_sendmsg(int fd, const struct msghdr *msg, unsigned flags, uint64_t ud)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+
+	if (sqe)
+	{
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t)(uintptr_t)msg;
+		sqe->len = 1;
+		sqe->msg_flags = flags;
+		sqe->user_data = ud;
+	}
+	return sqe;
+}
+
+struct io_uring_sqe *
+uring_splice(int fd_in, int64_t off_in, int fd_out, unsigned len,
+             unsigned flags, uint64_t ud)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+
+	if (sqe)
+	{
+		sqe->opcode = IORING_OP_SPLICE;
+		sqe->splice_fd_in = fd_in;
+		sqe->splice_off_in = (uint64_t)off_in;
+		sqe->fd = fd_out;
+		sqe->off = (uint64_t)-1;
+		sqe->len = len;
+		sqe->splice_flags = flags;
+		sqe->user_data = ud;
+	}
+	return sqe;
+}
+
+struct io_uring_sqe *
+uring_timeout(const struct __kernel_timespec *ts, uint64_t ud)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+
+	if (sqe)
+	{
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->fd = -1;
+		sqe->addr = (uint64_t)(uintptr_t)ts;
+		sqe->len = 1;
+		sqe->user_data = ud;
+	}
+	return sqe;
+}
+
+
+#endif
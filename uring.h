@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __linux__
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+/*
+ * A minimal io_uring(7) interface over the raw system calls: one ring per
+ * process, with a ring of provided buffers that receives pick from. Kept
+ * in module state like the event loop's poller.
+ *
+ * Completions are consumed in place: uring_peek() returns the oldest one,
+ * uring_seen() releases it.
+ */
+
+/*
+ * Sets up a ring of 'entries' submission slots and 'nbufs' (a power of
+ * two) provided buffers of 'bufsize' bytes each. Fails unless the kernel
+ * supports everything the event loop uses: multishot accept, receives into
+ * provided buffers, reads, sendmsg, splice and timeouts (Linux 5.19).
+ * Returns 0 on success, -1 (with errno set) on error.
+ */
+int uring_init(unsigned entries, unsigned nbufs, size_t bufsize);
+
+/*
+ * Closes the ring in a forked child that does not use it.
+ */
+void uring_close(void);
+
+/*
+ * Makes sure 'n' submission slots are free, submitting what is queued if
+ * not, so a chain of linked requests doesn't get split.
+ * Returns 0 on success, -1 on error.
+ */
+int uring_reserve(unsigned n);
+
+/*
+ * Submits everything queued and waits for at least 'wait' completions.
+ * Returns 0 on success, -1 (with errno set) on error.
+ */
+int uring_submit(unsigned wait);
+
+/*
+ * Returns the oldest unconsumed completion, or NULL if there is none.
+ */
+struct io_uring_cqe *uring_peek(void);
+void uring_seen(void);
+
+/*
+ * Returns provided buffer 'bid', as named by a completion's flags.
+ * Hand it back with uring_recycle() once its data has been used.
+ */
+void *uring_buffer(unsigned bid);
+void uring_recycle(unsigned bid);
+
+/*
+ * Queue one request each, tagged with 'ud' for its completion, and return
+ * its submission entry (to add e.g. IOSQE_IO_LINK), or NULL if the ring
+ * can't take it.
+ */
+struct io_uring_sqe *uring_accept_multishot(int fd, uint64_t ud);
+/* Receives up to 'len' bytes into a provided buffer */
+struct io_uring_sqe *uring_recv(int fd, unsigned len, uint64_t ud);
+struct io_uring_sqe *uring_read(int fd, void *buf, unsigned len, off_t off,
+                               uint64_t ud);
+struct io_uring_sqe *uring_sendmsg(int fd, const struct msghdr *msg,
+                                   unsigned flags, uint64_t ud);
+/* 'off_in' is -1 for pipes and sockets */
+struct io_uring_sqe *uring_splice(int fd_in, int64_t off_in, int fd_out,
+                                  unsigned len, unsigned flags, uint64_t ud);
+struct io_uring_sqe *uring_timeout(const struct __kernel_timespec *ts,
+                                   uint64_t ud);
+
+#endif
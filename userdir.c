@@ -0,0 +1,184 @@
+#include "userdir.h"
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <pwd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct userdir
+{
+	char name[USERDIR_MAX_NAME]; /* "": free */
+	char *root;                  /* NULL: no such user or directory */
+	long long expires;           /* seconds, monotonic */
+};
+
+/* Direct-mapped: a user evicts whoever shared its slot */
+static struct userdir slots[USERDIR_SLOTS];
+
+static int ttl;
+
+void
+userdir_init(int ttl_s)
+{
+	ttl = ttl_s;
+}
+
+static long long
+now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec;
+}
+
+static struct userdir *
+slot_of(const char *name)
+{
+	uint32_t h = 2166136261u;
+
+	for (const char *p = name; *p; p++)
+	{
+		h ^= (unsigned char)*p;
+		h *= 16777619u;
+	}
+	return &slots[h & (USERDIR_SLOTS - 1)];
+}
+
+/*
+ * Stores the ~/sws directory of 'pw' in root.
+ * Returns 0 on success, -1 if it doesn't fit.
+ */
+static int
+format_root(const struct passwd *pw, char *root, size_t len)
+{
+	if (snprintf(root, len, "%s/sws", pw->pw_dir) >= (int)len)
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+/* Enters 'name' with its root, or as missing if root is NULL */
+static void
+remember(const char *name, const char *root, long long now)
+{
+	struct userdir *u = slot_of(name);
+	char *copy = NULL;
+
+	if (strlen(name) >= sizeof(u->name) ||
+	    (root != NULL && (copy = strdup(root)) == NULL))
+	{
+		return;
+	}
+	free(u->root);
+	strcpy(u->name, name);
+	u->root = copy;
+	u->expires = now + ttl;
+}
+
+/* Looks 'name' up in the password database and checks for ~/sws */
+static int
+lookup(const char *name, char *root, size_t len, long long now)
+{
+	struct passwd *pw;
+	struct stat st;
+
+	errno = 0;
+	if ((pw = getpwnam(name)) == NULL)
+	{
+		/* Not found, as opposed to a database that couldn't be read */
+		if (errno == 0 || errno == ENOENT || errno == ESRCH)
+		{
+			remember(name, NULL, now);
+		}
+		errno = ENOENT;
+		return -1;
+	}
+	if (format_root(pw, root, len) < 0)
+	{
+		return -1;
+	}
+	if (stat(root, &st) < 0 || !S_ISDIR(st.st_mode))
+	{
+		remember(name, NULL, now);
+		errno = ENOENT;
+		return -1;
+	}
+	remember(name, root, now);
+	return 0;
+}
+
+int
+userdir_preload(void)
+{
+	long long now = now_s();
+	struct passwd *pw;
+	int n = 0;
+
+	if (ttl == 0)
+	{
+		return 0;
+	}
+	setpwent();
+	while ((pw = getpwent()) != NULL)
+	{
+		char root[PATH_MAX];
+		struct stat st;
+
+		/* Users without pages are found missing once asked for */
+		if (format_root(pw, root, sizeof(root)) == 0 &&
+		    stat(root, &st) == 0 && S_ISDIR(st.st_mode))
+		{
+			remember(pw->pw_name, root, now);
+			n++;
+		}
+	}
+	endpwent();
+	return n;
+}
+
+int
+userdir_root(const char *name, char *root, size_t len)
+{
+	struct userdir *u;
+	long long now;
+
+	if (ttl == 0)
+	{
+		struct passwd *pw = getpwnam(name);
+
+		if (pw == NULL)
+		{
+			errno = ENOENT;
+			return -1;
+		}
+		return format_root(pw, root, len);
+	}
+
+	now = now_s();
+	u = slot_of(name);
+	if (strcmp(u->name, name) != 0 || u->expires <= now)
+	{
+		return lookup(name, root, len, now);
+	}
+	if (u->root == NULL)
+	{
+		errno = ENOENT;
+		return -1;
+	}
+	if (strlen(u->root) >= len)
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(root, u->root);
+	return 0;
+}
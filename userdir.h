@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Resolution of /~user to the user's ~/sws directory, with a per-process
+ * cache in front of getpwnam(3), which may have to ask NSS (files, nscd,
+ * LDAP, ...). Users without a ~/sws directory, and names that aren't
+ * users at all, are remembered as well. Entries expire after a while, so
+ * that added users and moved homes are picked up.
+ */
+
+/* Users remembered per process (power of two) */
+#define USERDIR_SLOTS 1024
+
+/* Longest user name looked up */
+#define USERDIR_MAX_NAME 64
+
+/*
+ * Remembers lookups for 'ttl' seconds (0: no caching). Call before
+ * forking.
+ */
+void userdir_init(int ttl);
+
+/*
+ * Enters every user in the password database that has a ~/sws directory,
+ * so that their pages don't need a lookup until the entries expire.
+ * Call before forking, after userdir_init().
+ * Returns the number of users entered.
+ */
+int userdir_preload(void);
+
+/*
+ * Stores the ~/sws directory of user 'name' in root (of size len).
+ * Returns 0 on success, -1 if there is no such user or, when caching,
+ * no such directory (errno ENOENT), or if it doesn't fit (ENAMETOOLONG).
+ */
+int userdir_root(const char *name, char *root, size_t len);